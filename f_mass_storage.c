@@ -60,7 +60,16 @@
  *				function will include (ie. for "nluns"
  *				LUNs).  Each element of the array has
  *				the following fields:
- *	->filename	The path to the backing file for the LUN.
+ *	->filename	The path to the backing file for the LUN,
+ *				or "ram:<size>", "null:<size>",
+ *				"pattern:<size>" or "user:<size>" (served
+ *				by a daemon, see fsg_user.h) for a LUN
+ *				without one, or
+ *				"stripe:<stripe size>:<file>,<file>..."
+ *				or "mirror:<file>,<file>..." to stripe
+ *				or mirror the LUN over several files,
+ *				or "sparse:<file>" or "compressed:<file>"
+ *				for an image in one of those formats.
  *				Required if LUN is not marked as
  *				removable.
  *	->ro		Flag specifying access to the LUN shall be
@@ -74,6 +83,9 @@
  *				being a CD-ROM.
  *	->nofua		Flag specifying that FUA flag in SCSI WRITE(10,12)
  *				commands for this LUN shall be ignored.
+ *	->direct	Flag specifying that the backing file shall be
+ *				opened with O_DIRECT, bypassing the page
+ *				cache.
  *
  *	vendor_name
  *	product_name
@@ -88,6 +100,24 @@
  *				to work correctly.  You should set it
  *				to true.
  *
+ *	uas		Set to offer USB Attached SCSI as alternate
+ *				setting 1 of the interface, next to
+ *				Bulk-Only Transport in setting 0.
+ *
+ *	premap		Set to DMA-map the pipeline buffers once, when
+ *				the interface is enabled, for UDCs which
+ *				accept pre-mapped requests (musb).
+ *
+ *	autotune	Set to let the function pick the number of
+ *				pipeline buffers from what it measures
+ *				during READ and WRITE commands.
+ *
+ *	idle_timeout	Milliseconds without a command after which
+ *				all pipeline buffers but one are freed,
+ *				until the next command; 0 for never.
+ *				They are also freed under memory
+ *				pressure while waiting for a command.
+ *
  * If "removable" is not set for a LUN then a backing file must be
  * specified.  If it is set, then NULL filename means the LUN's medium
  * is not loaded (an empty string as "filename" in the fsg_config
@@ -202,19 +232,25 @@
 #include <linux/dcache.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/fcntl.h>
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/kref.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/limits.h>
+#include <linux/math64.h>
+#include <linux/pagemap.h>
 #include <linux/rwsem.h>
+#include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/freezer.h>
 #include <linux/module.h>
 #include <linux/uaccess.h>
+#include <linux/workqueue.h>
 
 #include <linux/usb/ch9.h>
 #include <linux/usb/gadget.h>
@@ -254,6 +290,45 @@ static struct usb_gadget_strings *fsg_strings_array[] = {
 struct fsg_dev;
 struct fsg_common;
 
+/* A request on the UAS command pipe and the IU it received */
+struct fsg_uas_cmd {
+	struct usb_request	*req;
+	int			busy;
+	enum fsg_buffer_state	state;
+	struct list_head	list;		/* On uas_cmd_queue */
+};
+
+/*
+ * Pipeline depth auto-tuner.  The thread adds up, over windows of
+ * FSG_TUNE_WINDOW READ and WRITE commands, the time they took and how
+ * much of it it spent waiting for a buffer to be sent or filled by the
+ * host, and resizes the ring after each window; see fsg_tune_window().
+ */
+struct fsg_autotune {
+	unsigned int		enabled:1;
+	unsigned int		min, max;	/* Bounds on fsg_num_buffers */
+
+	/* The current command and window, only used by the thread */
+	u64			cmd_start;	/* ns, 0 if not measured */
+	u64			cmd_wait;	/* ns */
+	u64			busy;		/* ns */
+	u64			wait;		/* ns */
+	u64			bytes;
+	unsigned int		cmds;
+
+	/* The last change, checked against the window after it */
+	int			step;
+	unsigned int		depth;		/* Ring size it asked for */
+	u64			base_rate;	/* kB/s before it */
+	unsigned int		hold;		/* Windows without a try */
+
+	/* What it decided, for autotune_stats */
+	unsigned int		windows, grown, shrunk, reverted;
+	unsigned int		wait_pct;
+	u64			rate;
+	const char		*last;
+};
+
 /* Data shared by all the FSG instances. */
 struct fsg_common {
 	struct usb_gadget	*gadget;
@@ -275,6 +350,11 @@ struct fsg_common {
 	struct fsg_buffhd	*next_buffhd_to_drain;
 	struct fsg_buffhd	*buffhds;
 	unsigned int		fsg_num_buffers;
+	unsigned int		buflen;		/* Size of each buffer */
+	/* Ring to switch to between commands, 0 = none; protected by lock */
+	unsigned int		resize_num_buffers;
+	unsigned int		resize_buflen;
+	struct fsg_autotune	tune;		/* Bounds and report by lock */
 
 	int			cmnd_size;
 	u8			cmnd[MAX_COMMAND_SIZE];
@@ -301,11 +381,57 @@ struct fsg_common {
 	unsigned int		bad_lun_okay:1;
 	unsigned int		running:1;
 	unsigned int		sysfs:1;
+	unsigned int		uas_capable:1;	/* Offer alternate setting 1 */
+	unsigned int		premap:1;	/* Map buffers with the requests */
+	unsigned int		uas:1;		/* Alternate setting 1 active */
+	unsigned int		uas_streams:1;
+	unsigned int		uas_ready_sent:1;
+
+	/*
+	 * USB Attached SCSI.  Command IUs received but not carried out yet
+	 * wait on uas_cmd_queue, protected by lock.  new_alt is the setting
+	 * the host asked for in the last SET_INTERFACE, alt the one in use.
+	 */
+	unsigned int		new_alt;
+	unsigned int		alt;
+	struct fsg_uas_cmd	uas_cmds[FSG_UAS_NUM_CMDS];
+	struct list_head	uas_cmd_queue;
+	struct usb_request	*uas_status_req;
+	int			uas_status_busy;
+	enum fsg_buffer_state	uas_status_state;
 
 	int			thread_wakeup_needed;
 	struct completion	thread_notifier;
 	struct task_struct	*thread_task;
 
+	/*
+	 * Idle release, see fsg_park_buffers().  idle, park_requested and
+	 * the counters are protected by lock; parked belongs to the thread.
+	 */
+	struct timer_list	idle_timer;
+	unsigned int		idle_timeout;	/* ms, 0 = never */
+	bool			idle;		/* Waiting for a command */
+	bool			park_requested;
+	bool			parked;
+	unsigned int		parks, unparks;
+	u64			unpark_ns, unpark_max_ns;
+	struct shrinker		shrinker;
+	bool			shrinker_registered;
+
+	/*
+	 * Write-behind stage.  The queue and the counters below are
+	 * protected by lock; wb_done and wb_error are only meaningful
+	 * while a WRITE command is in progress.
+	 */
+	struct workqueue_struct	*wb_wq;
+	struct work_struct	wb_work;
+	struct list_head	wb_queue;
+	unsigned int		wb_queued;	/* Buffers queued or in write */
+	u32			wb_dirty;	/* Bytes queued or in write */
+	u32			wb_done;	/* Bytes written this command */
+	int			wb_error;
+	loff_t			wb_error_offset;
+
 	/* Gadget's private data. */
 	void			*private_data;
 
@@ -327,12 +453,16 @@ struct fsg_dev {
 
 	unsigned int		bulk_in_enabled:1;
 	unsigned int		bulk_out_enabled:1;
+	unsigned int		cmd_out_enabled:1;
+	unsigned int		status_in_enabled:1;
 
 	unsigned long		atomic_bitflags;
 #define IGNORE_BULK_OUT		0
 
 	struct usb_ep		*bulk_in;
 	struct usb_ep		*bulk_out;
+	struct usb_ep		*cmd_out;	/* UAS command pipe */
+	struct usb_ep		*status_in;	/* UAS status pipe */
 };
 
 static inline int __fsg_is_set(struct fsg_common *common,
@@ -450,11 +580,21 @@ static int ep0_queue(struct fsg_common *common)
 
 /* Completion handlers. These always run in_irq. */
 
+/* Give a premapped buffer back to the CPU, see fsg_bh_map() */
+static void fsg_bh_sync_for_cpu(struct fsg_buffhd *bh,
+				struct usb_request *req,
+				enum dma_data_direction dir)
+{
+	if (bh->dma_dev && !req->num_sgs)
+		dma_sync_single_for_cpu(bh->dma_dev, bh->dma, req->length, dir);
+}
+
 static void bulk_in_complete(struct usb_ep *ep, struct usb_request *req)
 {
 	struct fsg_common	*common = ep->driver_data;
 	struct fsg_buffhd	*bh = req->context;
 
+	fsg_bh_sync_for_cpu(bh, req, DMA_TO_DEVICE);
 	if (req->status || req->actual != req->length)
 		DBG(common, "%s --> %d, %u/%u\n", __func__,
 		    req->status, req->actual, req->length);
@@ -475,6 +615,7 @@ static void bulk_out_complete(struct usb_ep *ep, struct usb_request *req)
 	struct fsg_common	*common = ep->driver_data;
 	struct fsg_buffhd	*bh = req->context;
 
+	fsg_bh_sync_for_cpu(bh, req, DMA_FROM_DEVICE);
 	dump_msg(common, "bulk-out", req->buf, req->actual);
 	if (req->status || req->actual != bh->bulk_out_intended_length)
 		DBG(common, "%s --> %d, %u/%u\n", __func__,
@@ -595,10 +736,84 @@ static void start_transfer(struct fsg_dev *fsg, struct usb_ep *ep,
 		WARNING(fsg, "error in submission: %s --> %d\n", ep->name, rc);
 }
 
+static int fsg_uas_data_ready(struct fsg_common *common, u8 iu_id);
+
+/*
+ * Pipeline buffers can be DMA-mapped for the UDC once, when the requests
+ * are allocated, rather than by usb_gadget_map_request() on every
+ * transfer.  A request's dma address then tells the UDC the buffer is
+ * already mapped.  Only UDCs known to honour that get it: the others
+ * would map the buffer a second time.  The CPU and the block layer keep
+ * using the buffer between transfers, so it is synced for the device
+ * when a request is queued and for the CPU when it completes.  Zero-copy
+ * requests bring their own scatter-gather list.
+ */
+#define FSG_DMA_ADDR_INVALID	(~(dma_addr_t)0)
+
+static const char * const fsg_premap_udcs[] = {
+	"musb-hdrc",
+};
+
+static bool fsg_udc_takes_premapped(struct usb_gadget *gadget)
+{
+	int	i;
+
+	for (i = 0; i < ARRAY_SIZE(fsg_premap_udcs); ++i)
+		if (!strcmp(gadget->name, fsg_premap_udcs[i]))
+			return true;
+	return false;
+}
+
+static void fsg_bh_map(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct device	*dev = common->gadget->dev.parent;
+
+	if (!fsg_udc_takes_premapped(common->gadget)) {
+		DBG(common, "%s maps requests itself, not premapping\n",
+		    common->gadget->name);
+		return;
+	}
+	bh->dma = dma_map_single(dev, bh->buf, bh->buflen, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, bh->dma)) {
+		WARNING(common, "can't map buffer, mapping per transfer\n");
+		return;
+	}
+	bh->dma_dev = dev;
+}
+
+static void fsg_bh_unmap(struct fsg_buffhd *bh)
+{
+	if (!bh->dma_dev)
+		return;
+	dma_unmap_single(bh->dma_dev, bh->dma, bh->buflen, DMA_BIDIRECTIONAL);
+	bh->dma_dev = NULL;
+}
+
+static void fsg_bh_set_dma(struct fsg_buffhd *bh, struct usb_request *req,
+			   enum dma_data_direction dir)
+{
+	if (!bh->dma_dev)
+		return;
+	if (req->num_sgs) {
+		req->dma = FSG_DMA_ADDR_INVALID;
+		return;
+	}
+	req->dma = bh->dma;
+	dma_sync_single_for_device(bh->dma_dev, bh->dma, req->length, dir);
+}
+
+/*
+ * With UAS these only ever carry data; the stream ID (or a READ/WRITE
+ * READY IU sent beforehand) tells the host which command it belongs to.
+ */
 static bool start_in_transfer(struct fsg_common *common, struct fsg_buffhd *bh)
 {
 	if (!fsg_is_set(common))
 		return false;
+	if (common->uas && fsg_uas_data_ready(common, IU_ID_READ_READY))
+		return false;
+	bh->inreq->stream_id = common->uas_streams ? common->tag : 0;
+	fsg_bh_set_dma(bh, bh->inreq, DMA_TO_DEVICE);
 	start_transfer(common->fsg, common->fsg->bulk_in,
 		       bh->inreq, &bh->inreq_busy, &bh->state);
 	return true;
@@ -608,6 +823,10 @@ static bool start_out_transfer(struct fsg_common *common, struct fsg_buffhd *bh)
 {
 	if (!fsg_is_set(common))
 		return false;
+	if (common->uas && fsg_uas_data_ready(common, IU_ID_WRITE_READY))
+		return false;
+	bh->outreq->stream_id = common->uas_streams ? common->tag : 0;
+	fsg_bh_set_dma(bh, bh->outreq, DMA_FROM_DEVICE);
 	start_transfer(common->fsg, common->fsg->bulk_out,
 		       bh->outreq, &bh->outreq_busy, &bh->state);
 	return true;
@@ -641,19 +860,476 @@ static int sleep_thread(struct fsg_common *common, bool can_freeze)
 	return rc;
 }
 
+/*
+ * sleep_thread() while a data transfer waits for the host to send or fill
+ * a buffer; the time counts against the pipeline depth for the tuner.
+ */
+static int sleep_thread_for_buffer(struct fsg_common *common)
+{
+	u64	start;
+	int	rc;
+
+	if (!common->tune.cmd_start)
+		return sleep_thread(common, false);
+	start = ktime_get_ns();
+	rc = sleep_thread(common, false);
+	common->tune.cmd_wait += ktime_get_ns() - start;
+	return rc;
+}
+
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Sequential read-ahead.  A READ which starts where the previous READ on
+ * the same LUN ended is taken as part of a stream; for such commands the
+ * next ra_chunks buffers' worth of data past the end of the command is
+ * submitted to the page cache so that it is already in flight (or already
+ * resident) by the time the host asks for it.  The prefetched range is
+ * remembered so that hits and misses can be reported per LUN.
+ */
+static void fsg_lun_ra_account(struct fsg_lun *curlun, loff_t file_offset)
+{
+	if (!curlun->ra_chunks)
+		return;
+	if (file_offset >= curlun->ra_start && file_offset < curlun->ra_end)
+		curlun->ra_hits++;
+	else
+		curlun->ra_misses++;
+}
+
+static void fsg_lun_readahead(struct fsg_lun *curlun, loff_t start,
+			      loff_t end, unsigned int buflen)
+{
+	loff_t		ra_start, ra_end;
+	pgoff_t		index;
+
+	if (start != curlun->ra_next) {
+		/* Random access, drop the window */
+		curlun->ra_next = end;
+		curlun->ra_start = curlun->ra_end = 0;
+		return;
+	}
+	curlun->ra_next = end;
+
+	/* There's no page cache to fill with O_DIRECT or a backend */
+	if (!curlun->ra_chunks || curlun->direct || !fsg_lun_is_flat(curlun))
+		return;
+
+	ra_end = min(end + (loff_t)curlun->ra_chunks * buflen,
+		     curlun->file_length);
+	ra_start = max(end, curlun->ra_end);
+	if (ra_start >= ra_end)
+		return;
+
+	/* Start a new window unless we are extending the current one */
+	if (curlun->ra_end <= end)
+		curlun->ra_start = end;
+	curlun->ra_end = ra_end;
+
+	index = fsg_lun_file_offset(curlun, ra_start) >> PAGE_SHIFT;
+	curlun->ra_state.ra_pages =
+		((unsigned long)curlun->ra_chunks * buflen) >> PAGE_SHIFT;
+	page_cache_sync_readahead(curlun->filp->f_mapping, &curlun->ra_state,
+				  curlun->filp, index,
+				  ((fsg_lun_file_offset(curlun, ra_end) +
+				    PAGE_SIZE - 1) >> PAGE_SHIFT) - index);
+	VLDBG(curlun, "read-ahead %llu..%llu\n",
+	      (unsigned long long)ra_start, (unsigned long long)ra_end);
+}
+
+/*
+ * Zero-copy reads.  Instead of copying the data into bh->buf, the
+ * page-cache pages covering the range are looked up (and read in when
+ * they aren't uptodate) and handed to the UDC as a scatter-gather list
+ * on bh->inreq.  The pages stay pinned until the buffer head is reused,
+ * see fsg_bh_put_pages().  UDCs which can't do scatter-gather get the
+ * regular copy path.
+ */
+static bool fsg_lun_can_zero_copy(struct fsg_common *common,
+				  struct fsg_lun *curlun)
+{
+	return curlun->zero_copy && !curlun->direct &&
+		fsg_lun_is_flat(curlun) && common->gadget->sg_supported &&
+		curlun->filp->f_mapping->a_ops->readpage;
+}
+
+/* Release the pages left over from a zero-copy transfer, if any */
+static void fsg_bh_put_pages(struct fsg_buffhd *bh)
+{
+	while (bh->num_pages)
+		put_page(bh->pages[--bh->num_pages]);
+	if (bh->inreq) {
+		bh->inreq->sg = NULL;
+		bh->inreq->num_sgs = 0;
+	}
+}
+
+static ssize_t fsg_read_pages(struct fsg_lun *curlun, struct fsg_buffhd *bh,
+			      unsigned int amount, loff_t file_offset)
+{
+	struct address_space	*mapping = curlun->filp->f_mapping;
+	pgoff_t			index;
+	unsigned int		offset;
+	unsigned int		nread = 0;
+	struct page		*page;
+
+	file_offset = fsg_lun_file_offset(curlun, file_offset);
+	index = file_offset >> PAGE_SHIFT;
+	offset = file_offset & ~PAGE_MASK;
+	while (nread < amount) {
+		page = read_mapping_page(mapping, index++, curlun->filp);
+		if (IS_ERR(page)) {
+			if (nread == 0)
+				return PTR_ERR(page);
+			break;
+		}
+		mark_page_accessed(page);
+		bh->pages[bh->num_pages++] = page;
+		nread += min_t(unsigned int, amount - nread,
+			       PAGE_SIZE - offset);
+		offset = 0;
+	}
+	return nread;
+}
+
+/* Describe the first nread bytes of the pinned pages on bh->inreq */
+static void fsg_bh_map_pages(struct fsg_buffhd *bh, loff_t file_offset,
+			     unsigned int nread)
+{
+	unsigned int	offset = file_offset & ~PAGE_MASK;
+	unsigned int	len, nents;
+
+	nents = nread ? DIV_ROUND_UP(offset + nread, PAGE_SIZE) : 0;
+
+	/* Drop the pages past a short read */
+	while (bh->num_pages > nents)
+		put_page(bh->pages[--bh->num_pages]);
+	if (!nents)
+		return;
+
+	sg_init_table(bh->sg, nents);
+	for (nents = 0; nents < bh->num_pages; ++nents) {
+		len = min_t(unsigned int, nread, PAGE_SIZE - offset);
+		sg_set_page(&bh->sg[nents], bh->pages[nents], len, offset);
+		nread -= len;
+		offset = 0;
+	}
+	bh->inreq->sg = bh->sg;
+	bh->inreq->num_sgs = bh->num_pages;
+}
 
 /*-------------------------------------------------------------------------*/
 
+/*
+ * Direct bio engine for LUNs backed by a block device.  Instead of going
+ * through vfs_read()/vfs_write() and the block device's page cache, bios
+ * are built straight from the pipeline buffers (which are physically
+ * contiguous, see fsg_common_set_num_buffers()) and several of them are
+ * kept in flight at once.  Their completions drive the buffer states: a
+ * read buffer becomes ready to send, a written buffer becomes free again.
+ *
+ * Like O_DIRECT, the block device's page cache is written back before we
+ * read and invalidated after we write, should anybody else be using it.
+ */
+static bool fsg_lun_use_bio(struct fsg_lun *curlun)
+{
+	return curlun->bio && fsg_lun_is_flat(curlun) &&
+		S_ISBLK(file_inode(curlun->filp)->i_mode);
+}
+
+static void fsg_bio_read_end_io(struct bio *bio)
+{
+	struct fsg_buffhd	*bh = bio->bi_private;
+	struct fsg_common	*common = bh->common;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&common->lock, flags);
+	bh->bio_error = bio->bi_error;
+	smp_wmb();
+	bh->bio_pending = 0;
+	wakeup_thread(common);
+	spin_unlock_irqrestore(&common->lock, flags);
+	bio_put(bio);
+}
+
+static void fsg_bio_write_end_io(struct bio *bio)
+{
+	struct fsg_buffhd	*bh = bio->bi_private;
+	struct fsg_common	*common = bh->common;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&common->lock, flags);
+	if (bio->bi_error) {
+		/* Completions may come out of order, report the first block */
+		if (!common->wb_error ||
+		    bh->wb_offset < common->wb_error_offset)
+			common->wb_error_offset = bh->wb_offset;
+		common->wb_error = -EIO;
+	} else {
+		common->wb_done += bh->wb_amount;
+	}
+	common->wb_dirty -= bh->wb_amount;
+	common->wb_queued--;
+	bh->bio_pending = 0;
+	bh->state = BUF_STATE_EMPTY;
+	wakeup_thread(common);
+	spin_unlock_irqrestore(&common->lock, flags);
+	bio_put(bio);
+}
+
+/*
+ * Submit a bio for amount bytes of bh->buf at file_offset.  Failures are
+ * reported through the completion routine, so the caller only has to wait
+ * for bh->bio_pending to clear.
+ */
+static void fsg_bio_submit(struct fsg_lun *curlun, struct fsg_buffhd *bh,
+			   int rw, loff_t file_offset, unsigned int amount)
+{
+	unsigned int	len, done = 0;
+	struct bio	*bio;
+
+	bio = bio_alloc(GFP_NOIO, DIV_ROUND_UP(amount, PAGE_SIZE));
+	bio->bi_bdev = I_BDEV(curlun->filp->f_mapping->host);
+	bio->bi_iter.bi_sector = fsg_lun_file_offset(curlun, file_offset) >> 9;
+	bio->bi_end_io = rw & WRITE ? fsg_bio_write_end_io
+				    : fsg_bio_read_end_io;
+	bio->bi_private = bh;
+	bh->bio_pending = 1;
+
+	while (done < amount) {
+		len = min_t(unsigned int, amount - done, PAGE_SIZE);
+		if (bio_add_page(bio, virt_to_page(bh->buf + done), len,
+				 0) != len) {
+			bio->bi_error = -EIO;
+			bio_endio(bio);
+			return;
+		}
+		done += len;
+	}
+	submit_bio(rw, bio);
+}
+
+/*
+ * O_DIRECT reads of other flat backing files go through the same pipeline,
+ * with an asynchronous kiocb per buffer instead of a bio.  The buffer's
+ * pages are handed over as a bvec: direct I/O can't take kernel iovecs.
+ * The file and the transfer must be aligned for O_DIRECT, unaligned
+ * READs take the synchronous path and its bounce buffer.
+ */
+static bool fsg_lun_use_aio(struct fsg_lun *curlun, loff_t file_offset,
+			    u32 amount)
+{
+	return curlun->dio_align && fsg_lun_is_flat(curlun) &&
+		curlun->filp->f_op->read_iter &&
+		IS_ALIGNED(fsg_lun_file_offset(curlun, file_offset),
+			   curlun->dio_align) &&
+		IS_ALIGNED(amount, curlun->dio_align);
+}
+
+static void fsg_aio_read_complete(struct kiocb *iocb, long ret, long ret2)
+{
+	struct fsg_buffhd	*bh = container_of(iocb, struct fsg_buffhd,
+						   iocb);
+	struct fsg_common	*common = bh->common;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&common->lock, flags);
+	bh->bio_error = ret == bh->bio_amount ? 0 : ret < 0 ? ret : -EIO;
+	smp_wmb();
+	bh->bio_pending = 0;
+	wakeup_thread(common);
+	spin_unlock_irqrestore(&common->lock, flags);
+}
+
+/* Like fsg_bio_submit(), for a READ of a file opened O_DIRECT */
+static void fsg_aio_submit(struct fsg_lun *curlun, struct fsg_buffhd *bh,
+			   loff_t file_offset, unsigned int amount)
+{
+	struct file	*filp = curlun->filp;
+	struct iov_iter	iter;
+	unsigned int	len, done, n = 0;
+	ssize_t		rc;
+
+	for (done = 0; done < amount; done += len) {
+		len = min_t(unsigned int, amount - done, PAGE_SIZE);
+		bh->bvec[n].bv_page = virt_to_page(bh->buf + done);
+		bh->bvec[n].bv_len = len;
+		bh->bvec[n].bv_offset = 0;
+		++n;
+	}
+	iov_iter_bvec(&iter, ITER_BVEC | READ, bh->bvec, n, amount);
+
+	memset(&bh->iocb, 0, sizeof(bh->iocb));
+	bh->iocb.ki_filp = filp;
+	bh->iocb.ki_pos = fsg_lun_file_offset(curlun, file_offset);
+	bh->iocb.ki_flags = IOCB_DIRECT;
+	bh->iocb.ki_complete = fsg_aio_read_complete;
+	bh->bio_pending = 1;
+
+	rc = filp->f_op->read_iter(&bh->iocb, &iter);
+	if (rc != -EIOCBQUEUED)
+		fsg_aio_read_complete(&bh->iocb, rc, 0);
+}
+
+/*
+ * Bios and kiocbs can't be cancelled, wait until the ones in flight have
+ * completed
+ */
+static void fsg_bio_wait(struct fsg_common *common)
+{
+	struct fsg_buffhd	*bh;
+	int			i;
+
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
+		bh = &common->buffhds[i];
+		for (;;) {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			if (!bh->bio_pending)
+				break;
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+	smp_rmb();
+}
+
+/*
+ * READ through the bio engine, or with kiocbs.  Reads are started into
+ * every free buffer ahead of the one being sent, and each buffer is
+ * handed to the bulk-in endpoint as soon as its read completes, in LBA
+ * order; the last one is left for finish_reply() as usual.
+ */
+static int do_read_async(struct fsg_common *common, loff_t file_offset,
+			 u32 amount_left, bool use_bio)
+{
+	struct fsg_lun		*curlun = common->curlun;
+	struct address_space	*mapping = curlun->filp->f_mapping;
+	struct fsg_buffhd	*bh, *fill, *drain;
+	loff_t			submit_offset = file_offset;
+	u32			amount_left_to_submit;
+	unsigned int		amount, inflight = 0;
+	int			rc = 0;
+
+	amount_left_to_submit = min((loff_t)amount_left,
+				    curlun->file_length - file_offset);
+	/* O_DIRECT does this by itself */
+	if (use_bio && mapping->nrpages)
+		filemap_write_and_wait_range(mapping,
+				fsg_lun_file_offset(curlun, file_offset),
+				fsg_lun_file_offset(curlun, file_offset) +
+				amount_left_to_submit - 1);
+
+	fill = drain = common->next_buffhd_to_fill;
+	for (;;) {
+		/* Start reading into the next free buffer */
+		bh = fill;
+		if (amount_left_to_submit && bh->state == BUF_STATE_EMPTY) {
+			fsg_bh_put_pages(bh);
+			amount = min(amount_left_to_submit, common->buflen);
+			bh->bio_amount = amount;
+			bh->bio_error = 0;
+			bh->state = BUF_STATE_BUSY;
+			if (use_bio)
+				fsg_bio_submit(curlun, bh, READ, submit_offset,
+					       amount);
+			else
+				fsg_aio_submit(curlun, bh, submit_offset,
+					       amount);
+			submit_offset += amount;
+			amount_left_to_submit -= amount;
+			fill = bh->next;
+			++inflight;
+			continue;
+		}
+
+		/* Send the oldest buffer once its data has arrived */
+		bh = drain;
+		if (!inflight || bh->bio_pending) {
+			/* With nothing in flight, every buffer is being sent */
+			rc = inflight ? sleep_thread(common, false) :
+				sleep_thread_for_buffer(common);
+			if (rc)
+				break;
+			continue;
+		}
+		smp_rmb();
+		drain = bh->next;
+		--inflight;
+
+		amount = bh->bio_error ? 0 : bh->bio_amount;
+		VLDBG(curlun, "async read %u @ %llu -> %d\n", bh->bio_amount,
+		      (unsigned long long)file_offset,
+		      bh->bio_error ?: amount);
+		file_offset += amount;
+		amount_left -= amount;
+		common->residue -= amount;
+		bh->inreq->length = amount;
+		bh->state = BUF_STATE_FULL;
+		common->next_buffhd_to_fill = bh;
+
+		/* If an error occurred, report it and its position */
+		if (amount < bh->bio_amount) {
+			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
+			break;
+		}
+
+		if (amount_left == 0)
+			break;		/* No more left to read */
+
+		/* Send this buffer and go read some more */
+		bh->inreq->zero = 0;
+		if (!start_in_transfer(common, bh)) {
+			/* Don't know what to do if common->fsg is NULL */
+			rc = -EIO;
+			break;
+		}
+		common->next_buffhd_to_fill = bh->next;
+
+		/*
+		 * If we were asked to read past the end of file,
+		 * end with an empty buffer.
+		 */
+		if (!inflight && !amount_left_to_submit) {
+			bh = bh->next;
+			while (bh->state != BUF_STATE_EMPTY) {
+				rc = sleep_thread_for_buffer(common);
+				if (rc)
+					return rc;
+			}
+			fsg_bh_put_pages(bh);
+			curlun->sense_data =
+					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
+			bh->inreq->length = 0;
+			bh->state = BUF_STATE_FULL;
+			break;
+		}
+	}
+
+	/* Release the buffers still being read into */
+	if (inflight) {
+		fsg_bio_wait(common);
+		for (bh = drain; inflight--; bh = bh->next)
+			bh->state = BUF_STATE_EMPTY;
+	}
+	return rc ?: -EIO;	/* No default reply */
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
-	u32			lba;
+	u64			lba;
 	struct fsg_buffhd	*bh;
 	int			rc;
 	u32			amount_left;
-	loff_t			file_offset, file_offset_tmp;
+	loff_t			start_offset, file_offset, file_offset_tmp;
 	unsigned int		amount;
 	ssize_t			nread;
+	bool			zero_copy;
 
 	/*
 	 * Get the starting Logical Block Address and check that it's
@@ -662,7 +1338,10 @@ static int do_read(struct fsg_common *common)
 	if (common->cmnd[0] == READ_6)
 		lba = get_unaligned_be24(&common->cmnd[1]);
 	else {
-		lba = get_unaligned_be32(&common->cmnd[2]);
+		if (common->cmnd[0] == READ_16)
+			lba = get_unaligned_be64(&common->cmnd[2]);
+		else
+			lba = get_unaligned_be32(&common->cmnd[2]);
 
 		/*
 		 * We allow DPO (Disable Page Out = don't save data in the
@@ -685,6 +1364,14 @@ static int do_read(struct fsg_common *common)
 	if (unlikely(amount_left == 0))
 		return -EIO;		/* No default reply */
 
+	start_offset = file_offset;
+	fsg_lun_ra_account(curlun, start_offset);
+	if (fsg_lun_use_bio(curlun))
+		return do_read_async(common, file_offset, amount_left, true);
+	if (fsg_lun_use_aio(curlun, file_offset, amount_left))
+		return do_read_async(common, file_offset, amount_left, false);
+	zero_copy = fsg_lun_can_zero_copy(common, curlun);
+
 	for (;;) {
 		/*
 		 * Figure out how much we need to read:
@@ -692,17 +1379,18 @@ static int do_read(struct fsg_common *common)
 		 * But don't read more than the buffer size.
 		 * And don't try to read past the end of the file.
 		 */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t)amount,
 			     curlun->file_length - file_offset);
 
 		/* Wait for the next buffer to become available */
 		bh = common->next_buffhd_to_fill;
 		while (bh->state != BUF_STATE_EMPTY) {
-			rc = sleep_thread(common, false);
+			rc = sleep_thread_for_buffer(common);
 			if (rc)
 				return rc;
 		}
+		fsg_bh_put_pages(bh);
 
 		/*
 		 * If we were asked to read past the end of file,
@@ -711,9 +1399,8 @@ static int do_read(struct fsg_common *common)
 		if (amount == 0) {
 			curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-			curlun->sense_data_info =
-					file_offset >> curlun->blkbits;
-			curlun->info_valid = 1;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
 			bh->inreq->length = 0;
 			bh->state = BUF_STATE_FULL;
 			break;
@@ -721,9 +1408,12 @@ static int do_read(struct fsg_common *common)
 
 		/* Perform the read */
 		file_offset_tmp = file_offset;
-		nread = vfs_read(curlun->filp,
-				 (char __user *)bh->buf,
-				 amount, &file_offset_tmp);
+		if (zero_copy)
+			nread = fsg_read_pages(curlun, bh, amount,
+					       file_offset);
+		else
+			nread = fsg_lun_read(curlun, bh->buf, amount,
+					     &file_offset_tmp);
 		VLDBG(curlun, "file read %u @ %llu -> %d\n", amount,
 		      (unsigned long long)file_offset, (int)nread);
 		if (signal_pending(current))
@@ -737,6 +1427,10 @@ static int do_read(struct fsg_common *common)
 			     (int)nread, amount);
 			nread = round_down(nread, curlun->blksize);
 		}
+		if (zero_copy)
+			fsg_bh_map_pages(bh,
+					 fsg_lun_file_offset(curlun, file_offset),
+					 nread);
 		file_offset  += nread;
 		amount_left  -= nread;
 		common->residue -= nread;
@@ -752,9 +1446,8 @@ static int do_read(struct fsg_common *common)
 		/* If an error occurred, report it and its position */
 		if (nread < amount) {
 			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
-			curlun->sense_data_info =
-					file_offset >> curlun->blkbits;
-			curlun->info_valid = 1;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
 			break;
 		}
 
@@ -769,68 +1462,421 @@ static int do_read(struct fsg_common *common)
 		common->next_buffhd_to_fill = bh->next;
 	}
 
+	/* The last buffer is sent by finish_reply(), prefetch meanwhile */
+	fsg_lun_readahead(curlun, start_offset, file_offset, common->buflen);
+
 	return -EIO;		/* No default reply */
 }
 
 
 /*-------------------------------------------------------------------------*/
 
-static int do_write(struct fsg_common *common)
+/*
+ * Write-behind stage.  When a LUN has a non-zero wb_depth, do_write()
+ * doesn't call vfs_write() itself: filled buffers are handed over to
+ * fsg_wb_work() and stay BUSY until their data has reached the backing
+ * file.  In the meantime the main thread keeps queueing bulk-out requests
+ * into the remaining buffers, so the host doesn't see the link go idle
+ * while the page cache throttles us in balance_dirty_pages().  A LUN's
+ * wb_dirty caps the bytes queued; any value goes, even one below the
+ * buffer length, as a single buffer is always let through (see
+ * fsg_wb_has_room()).
+ *
+ * The worker writes the buffers in the order they were queued and stops
+ * at the first error; do_write() waits for the queue to drain before it
+ * returns, so the sense data and the residue are exact by the time the
+ * CSW is sent.
+ */
+static void fsg_wb_work(struct work_struct *work)
 {
-	struct fsg_lun		*curlun = common->curlun;
-	u32			lba;
+	struct fsg_common	*common =
+		container_of(work, struct fsg_common, wb_work);
 	struct fsg_buffhd	*bh;
-	int			get_some_more;
-	u32			amount_left_to_req, amount_left_to_write;
-	loff_t			usb_offset, file_offset, file_offset_tmp;
-	unsigned int		amount;
+	mm_segment_t		old_fs;
+	loff_t			file_offset_tmp;
 	ssize_t			nwritten;
-	int			rc;
-
-	if (curlun->ro) {
-		curlun->sense_data = SS_WRITE_PROTECTED;
-		return -EINVAL;
-	}
-	spin_lock(&curlun->filp->f_lock);
-	curlun->filp->f_flags &= ~O_SYNC;	/* Default is not to wait */
-	spin_unlock(&curlun->filp->f_lock);
+	int			failed;
 
-	/*
-	 * Get the starting Logical Block Address and check that it's
-	 * not too big
-	 */
-	if (common->cmnd[0] == WRITE_6)
-		lba = get_unaligned_be24(&common->cmnd[1]);
-	else {
-		lba = get_unaligned_be32(&common->cmnd[2]);
+	spin_lock_irq(&common->lock);
+	while (!list_empty(&common->wb_queue)) {
+		bh = list_first_entry(&common->wb_queue, struct fsg_buffhd,
+				      wb_list);
+		list_del_init(&bh->wb_list);
+		failed = common->wb_error;
+		spin_unlock_irq(&common->lock);
 
-		/*
-		 * We allow DPO (Disable Page Out = don't save data in the
-		 * cache) and FUA (Force Unit Access = write directly to the
-		 * medium).  We don't implement DPO; we implement FUA by
-		 * performing synchronous output.
-		 */
-		if (common->cmnd[1] & ~0x18) {
-			curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
-			return -EINVAL;
+		/* Once something went wrong only release the buffers */
+		nwritten = 0;
+		if (!failed) {
+			old_fs = get_fs();
+			set_fs(get_ds());
+			file_offset_tmp = bh->wb_offset;
+			nwritten = fsg_lun_write(bh->wb_lun, bh->buf,
+						 bh->wb_amount,
+						 &file_offset_tmp);
+			set_fs(old_fs);
 		}
-		if (!curlun->nofua && (common->cmnd[1] & 0x08)) { /* FUA */
-			spin_lock(&curlun->filp->f_lock);
-			curlun->filp->f_flags |= O_SYNC;
-			spin_unlock(&curlun->filp->f_lock);
+
+		spin_lock_irq(&common->lock);
+		if (!failed) {
+			if (nwritten < 0)
+				nwritten = 0;
+			else if (nwritten < bh->wb_amount)
+				nwritten = round_down(nwritten,
+						      bh->wb_lun->blksize);
+			common->wb_done += nwritten;
+			if (nwritten < bh->wb_amount && !common->wb_error) {
+				common->wb_error = -EIO;
+				common->wb_error_offset =
+					bh->wb_offset + nwritten;
+			}
 		}
+		common->wb_dirty -= bh->wb_amount;
+		common->wb_queued--;
+		bh->state = BUF_STATE_EMPTY;
+		wakeup_thread(common);
 	}
-	if (lba >= curlun->num_sectors) {
-		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-		return -EINVAL;
-	}
-
+	spin_unlock_irq(&common->lock);
+}
+
+/* Can another wb_amount bytes be queued without exceeding the limits? */
+static bool fsg_wb_has_room(struct fsg_common *common,
+			    struct fsg_lun *curlun, unsigned int amount)
+{
+	if (curlun->wb_depth && common->wb_queued >= curlun->wb_depth)
+		return false;
+	if (curlun->wb_dirty && common->wb_queued &&
+	    common->wb_dirty + amount > curlun->wb_dirty)
+		return false;
+	return true;
+}
+
+static void fsg_wb_queue(struct fsg_common *common, struct fsg_buffhd *bh,
+			 struct fsg_lun *curlun, loff_t file_offset,
+			 unsigned int amount, bool use_bio)
+{
+	bh->wb_lun = curlun;
+	bh->wb_offset = file_offset;
+	bh->wb_amount = amount;
+
+	spin_lock_irq(&common->lock);
+	bh->state = BUF_STATE_BUSY;
+	if (!use_bio)
+		list_add_tail(&bh->wb_list, &common->wb_queue);
+	common->wb_queued++;
+	common->wb_dirty += amount;
+	spin_unlock_irq(&common->lock);
+
+	/* The bio engine writes the buffer itself, see fsg_bio_submit() */
+	if (use_bio)
+		fsg_bio_submit(curlun, bh,
+			       curlun->filp->f_flags & O_DSYNC ? WRITE_FUA
+							       : WRITE,
+			       file_offset, amount);
+	else
+		queue_work(common->wb_wq, &common->wb_work);
+}
+
+/*
+ * Wait until everything queued by do_write() has been written and report
+ * a failure the same way an inline vfs_write() error would have been.
+ * The number of queued bytes that didn't make it to the file is stored
+ * in *lost so the caller can correct the residue.
+ */
+static int fsg_wb_drain(struct fsg_common *common, u32 queued, u32 *lost)
+{
+	struct fsg_lun	*curlun = common->curlun;
+	int		rc;
+
+	*lost = 0;
+	while (common->wb_queued) {
+		rc = sleep_thread(common, false);
+		if (rc)
+			return rc;
+	}
+	smp_rmb();
+
+	if (common->wb_error) {
+		*lost = queued - common->wb_done;
+		curlun->sense_data = SS_WRITE_ERROR;
+		fsg_lun_set_sense_info(curlun,
+				common->wb_error_offset >> curlun->blkbits);
+	}
+	return 0;
+}
+
+/*
+ * Stop the write-behind stage: buffers which haven't been written yet
+ * are dropped and we wait for the one in progress, if any, as well as
+ * for the bio engine's writes.
+ */
+static void fsg_wb_abort(struct fsg_common *common)
+{
+	spin_lock_irq(&common->lock);
+	if (common->wb_queued && !common->wb_error)
+		common->wb_error = -EINTR;
+	spin_unlock_irq(&common->lock);
+	flush_work(&common->wb_work);
+	if (common->buffhds)
+		fsg_bio_wait(common);
+}
+
+/*
+ * Zero-copy writes.  The page-cache pages for the range a bulk-out request
+ * will cover are obtained (and locked) with pagecache_write_begin() before
+ * the request is queued, and the request's scatter-gather list points
+ * straight at them.  When the data has arrived do_write() commits it with
+ * pagecache_write_end(), just like generic_perform_write() would after
+ * copying from a user buffer.
+ *
+ * The pages stay locked while the host takes its time sending the data.
+ * On a filesystem, write_begin would also hold i_mutex and whatever the
+ * filesystem keeps across write_end, such as a journal handle that
+ * stalls commits for all of it, so this is only done on block devices.
+ * Synchronous writes (FUA, O_SYNC) are never done zero-copy: nothing
+ * here syncs the pages.
+ *
+ * Only requests which need no padding up to the bulk-out maxpacket size
+ * are done this way.
+ */
+static bool fsg_lun_can_zero_copy_write(struct fsg_common *common,
+					struct fsg_lun *curlun)
+{
+	const struct address_space_operations *a_ops;
+
+	if (!curlun->zero_copy_write || curlun->direct ||
+	    !fsg_lun_is_flat(curlun) || !common->gadget->sg_supported ||
+	    !S_ISBLK(file_inode(curlun->filp)->i_mode))
+		return false;
+	if ((curlun->filp->f_flags & O_DSYNC) ||
+	    IS_SYNC(curlun->filp->f_mapping->host))
+		return false;
+	a_ops = curlun->filp->f_mapping->a_ops;
+	return a_ops->write_begin && a_ops->write_end;
+}
+
+/*
+ * Commit the first 'copied' bytes received into the pages of a zero-copy
+ * request and release the pages.  The first 'received' bytes may have
+ * been overwritten by the transfer; pages holding any of them past what
+ * was committed are dropped from the cache, to be read again.  Dirty ones
+ * can't be, but the bytes lie within the WRITE's own blocks, which are
+ * indeterminate after a failed WRITE anyway.  Returns how many bytes,
+ * counted from the start of the request, made it into the page cache.
+ */
+static unsigned int fsg_write_end_pages(struct fsg_lun *curlun,
+					struct fsg_buffhd *bh,
+					unsigned int copied,
+					unsigned int received)
+{
+	struct file	*filp = curlun->filp;
+	loff_t		pos = bh->zc_offset;
+	unsigned int	written = 0, len, part, got, i;
+	pgoff_t		stale_first = 0, stale_last = 0;
+	bool		failed = false, stale = false;
+	struct page	*page;
+	int		rc;
+
+	for (i = 0; i < bh->num_pages; ++i) {
+		page = bh->pages[i];
+		len = bh->sg[i].length;
+		part = failed ? 0 : min(len, copied);
+		got = min(len, received);
+		copied -= min(len, copied);
+		received -= got;
+
+		if (got > part) {
+			if (!stale)
+				stale_first = page->index;
+			stale_last = page->index;
+			stale = true;
+		}
+
+		flush_dcache_page(page);
+		rc = pagecache_write_end(filp, filp->f_mapping, pos, len,
+					 part, page, bh->fsdata[i]);
+		if (!failed) {
+			if (rc > 0)
+				written += min_t(unsigned int, rc, part);
+			failed = rc < 0 || rc < part;
+		}
+		pos += len;
+	}
+
+	bh->num_pages = 0;
+	bh->zc_write = 0;
+	bh->outreq->sg = NULL;
+	bh->outreq->num_sgs = 0;
+
+	if (stale)
+		invalidate_inode_pages2_range(filp->f_mapping, stale_first,
+					      stale_last);
+
+	if (written)
+		balance_dirty_pages_ratelimited(filp->f_mapping);
+	return written;
+}
+
+static int fsg_write_begin_pages(struct fsg_lun *curlun,
+				 struct fsg_buffhd *bh, loff_t file_offset,
+				 unsigned int amount)
+{
+	struct file	*filp = curlun->filp;
+	unsigned int	offset;
+	unsigned int	len, done = 0;
+	struct page	*page;
+	int		rc;
+
+	fsg_bh_put_pages(bh);
+	file_offset = fsg_lun_file_offset(curlun, file_offset);
+	offset = file_offset & ~PAGE_MASK;
+	bh->zc_offset = file_offset;
+	bh->zc_write = 1;
+	sg_init_table(bh->sg, DIV_ROUND_UP(offset + amount, PAGE_SIZE));
+
+	while (done < amount) {
+		len = min_t(unsigned int, amount - done, PAGE_SIZE - offset);
+		rc = pagecache_write_begin(filp, filp->f_mapping,
+					   file_offset + done, len, 0, &page,
+					   &bh->fsdata[bh->num_pages]);
+		if (rc) {
+			fsg_write_end_pages(curlun, bh, 0, 0);
+			return rc;
+		}
+		sg_set_page(&bh->sg[bh->num_pages], page, len, offset);
+		bh->pages[bh->num_pages++] = page;
+		done += len;
+		offset = 0;
+	}
+
+	bh->outreq->sg = bh->sg;
+	bh->outreq->num_sgs = bh->num_pages;
+	return 0;
+}
+
+/*
+ * Called on the way out of do_write(): requests still waiting for data
+ * into locked page-cache pages are cancelled, the pages released and the
+ * data the host will still send is left for throw_away_data().
+ */
+static void fsg_zc_write_cleanup(struct fsg_common *common,
+				 struct fsg_lun *curlun)
+{
+	struct fsg_buffhd	*bh;
+	int			i;
+
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
+		bh = &common->buffhds[i];
+		if (!bh->zc_write)
+			continue;
+
+		if (bh->outreq_busy && fsg_is_set(common))
+			usb_ep_dequeue(common->fsg->bulk_out, bh->outreq);
+		for (;;) {
+			set_current_state(TASK_UNINTERRUPTIBLE);
+			if (!bh->outreq_busy)
+				break;
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+
+		if (bh->state == BUF_STATE_BUSY || bh->outreq->status) {
+			common->usb_amount_left +=
+				bh->bulk_out_intended_length -
+				min(bh->outreq->actual,
+				    bh->bulk_out_intended_length);
+		}
+		fsg_write_end_pages(curlun, bh, 0, bh->outreq->actual);
+		bh->state = BUF_STATE_EMPTY;
+	}
+}
+
+/*
+ * FUA is done with O_SYNC, and by writing cached lines through; file-less
+ * LUNs have nothing to sync
+ */
+static void fsg_lun_set_sync(struct fsg_lun *curlun, bool sync)
+{
+	curlun->fua = sync;
+	if (!curlun->filp)
+		return;
+	spin_lock(&curlun->filp->f_lock);
+	if (sync)
+		curlun->filp->f_flags |= O_SYNC;
+	else
+		curlun->filp->f_flags &= ~O_SYNC;
+	spin_unlock(&curlun->filp->f_lock);
+}
+
+static int do_write(struct fsg_common *common)
+{
+	struct fsg_lun		*curlun = common->curlun;
+	u64			lba;
+	struct fsg_buffhd	*bh;
+	int			get_some_more;
+	u32			amount_left_to_req, amount_left_to_write;
+	loff_t			usb_offset, file_offset, file_offset_tmp;
+	unsigned int		amount;
+	ssize_t			nwritten;
+	int			rc;
+	u32			wb_queued_bytes = 0, wb_lost;
+	bool			zero_copy, zc, wb, use_bio;
+
+	if (curlun->ro) {
+		curlun->sense_data = SS_WRITE_PROTECTED;
+		return -EINVAL;
+	}
+	fsg_lun_set_sync(curlun, false);	/* Default is not to wait */
+
+	/*
+	 * Get the starting Logical Block Address and check that it's
+	 * not too big
+	 */
+	if (common->cmnd[0] == WRITE_6)
+		lba = get_unaligned_be24(&common->cmnd[1]);
+	else {
+		if (common->cmnd[0] == WRITE_16)
+			lba = get_unaligned_be64(&common->cmnd[2]);
+		else
+			lba = get_unaligned_be32(&common->cmnd[2]);
+
+		/*
+		 * We allow DPO (Disable Page Out = don't save data in the
+		 * cache) and FUA (Force Unit Access = write directly to the
+		 * medium).  We don't implement DPO; we implement FUA by
+		 * performing synchronous output.
+		 */
+		if (common->cmnd[1] & ~0x18) {
+			curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
+			return -EINVAL;
+		}
+		if (!curlun->nofua && (common->cmnd[1] & 0x08)) /* FUA */
+			fsg_lun_set_sync(curlun, true);
+	}
+	if (lba >= curlun->num_sectors) {
+		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		return -EINVAL;
+	}
+
 	/* Carry out the file writes */
 	get_some_more = 1;
 	file_offset = usb_offset = ((loff_t) lba) << curlun->blkbits;
 	amount_left_to_req = common->data_size_from_cmnd;
 	amount_left_to_write = common->data_size_from_cmnd;
 
+	spin_lock_irq(&common->lock);
+	common->wb_done = 0;
+	common->wb_error = 0;
+	spin_unlock_irq(&common->lock);
+
+	/*
+	 * Zero-copy requests are committed inline, no write-behind then.
+	 * The bio engine always writes behind.
+	 */
+	use_bio = fsg_lun_use_bio(curlun);
+	zero_copy = !use_bio && fsg_lun_can_zero_copy_write(common, curlun);
+	wb = (curlun->wb_depth || use_bio) && !zero_copy;
+
 	while (amount_left_to_write > 0) {
 
 		/* Queue a request for more data from the host */
@@ -842,19 +1888,26 @@ static int do_write(struct fsg_common *common)
 			 * Try to get the remaining amount,
 			 * but not more than the buffer size.
 			 */
-			amount = min(amount_left_to_req, FSG_BUFLEN);
+			amount = min(amount_left_to_req, common->buflen);
 
 			/* Beyond the end of the backing file? */
 			if (usb_offset >= curlun->file_length) {
 				get_some_more = 0;
 				curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-				curlun->sense_data_info =
-					usb_offset >> curlun->blkbits;
-				curlun->info_valid = 1;
+				fsg_lun_set_sense_info(curlun,
+						usb_offset >> curlun->blkbits);
 				continue;
 			}
 
+			/*
+			 * Receive straight into the page cache if we can, but
+			 * never into pages past the end of the LUN
+			 */
+			zc = zero_copy &&
+				amount % common->bulk_out_maxpacket == 0 &&
+				amount <= curlun->file_length - usb_offset;
+
 			/* Get the next buffer */
 			usb_offset += amount;
 			common->usb_amount_left -= amount;
@@ -862,15 +1915,22 @@ static int do_write(struct fsg_common *common)
 			if (amount_left_to_req == 0)
 				get_some_more = 0;
 
+			if (zc && fsg_write_begin_pages(curlun, bh,
+							usb_offset - amount,
+							amount))
+				LDBG(curlun, "zero-copy write refused\n");
+
 			/*
 			 * Except at the end of the transfer, amount will be
 			 * equal to the buffer size, which is divisible by
 			 * the bulk-out maxpacket size.
 			 */
 			set_bulk_out_req_length(common, bh, amount);
-			if (!start_out_transfer(common, bh))
+			if (!start_out_transfer(common, bh)) {
 				/* Dunno what to do if common->fsg is NULL */
-				return -EIO;
+				rc = -EIO;
+				goto out;
+			}
 			common->next_buffhd_to_fill = bh->next;
 			continue;
 		}
@@ -879,17 +1939,23 @@ static int do_write(struct fsg_common *common)
 		bh = common->next_buffhd_to_drain;
 		if (bh->state == BUF_STATE_EMPTY && !get_some_more)
 			break;			/* We stopped early */
-		if (bh->state == BUF_STATE_FULL) {
+		if (wb && common->wb_error)
+			break;			/* The write-behind failed */
+		if (bh->state == BUF_STATE_FULL &&
+		    (!wb || fsg_wb_has_room(common, curlun,
+					    bh->bulk_out_intended_length))) {
 			smp_rmb();
 			common->next_buffhd_to_drain = bh->next;
 			bh->state = BUF_STATE_EMPTY;
 
 			/* Did something go wrong with the transfer? */
 			if (bh->outreq->status != 0) {
+				if (bh->zc_write)
+					fsg_write_end_pages(curlun, bh, 0,
+							    bh->outreq->actual);
 				curlun->sense_data = SS_COMMUNICATION_FAILURE;
-				curlun->sense_data_info =
-					file_offset >> curlun->blkbits;
-				curlun->info_valid = 1;
+				fsg_lun_set_sense_info(curlun,
+						file_offset >> curlun->blkbits);
 				break;
 			}
 
@@ -909,19 +1975,42 @@ static int do_write(struct fsg_common *common)
 
 			/* Don't write a partial block */
 			amount = round_down(amount, curlun->blksize);
+
+			/* The data is already in the page cache, commit it */
+			if (bh->zc_write) {
+				nwritten = fsg_write_end_pages(curlun, bh,
+						amount, bh->outreq->actual);
+				VLDBG(curlun, "zero-copy write %u @ %llu -> %d\n",
+				      amount, (unsigned long long)file_offset,
+				      (int)nwritten);
+				goto written;
+			}
 			if (amount == 0)
 				goto empty_write;
 
+			/* Leave the write to the write-behind stage */
+			if (wb) {
+				fsg_wb_queue(common, bh, curlun,
+					     file_offset, amount, use_bio);
+				file_offset += amount;
+				amount_left_to_write -= amount;
+				common->residue -= amount;
+				wb_queued_bytes += amount;
+				goto empty_write;
+			}
+
 			/* Perform the write */
 			file_offset_tmp = file_offset;
-			nwritten = vfs_write(curlun->filp,
-					     (char __user *)bh->buf,
-					     amount, &file_offset_tmp);
+			nwritten = fsg_lun_write(curlun, bh->buf, amount,
+						 &file_offset_tmp);
 			VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
 			      (unsigned long long)file_offset, (int)nwritten);
-			if (signal_pending(current))
-				return -EINTR;		/* Interrupted! */
+			if (signal_pending(current)) {
+				rc = -EINTR;		/* Interrupted! */
+				goto out;
+			}
 
+ written:
 			if (nwritten < 0) {
 				LDBG(curlun, "error in file write: %d\n",
 				     (int)nwritten);
@@ -938,9 +2027,8 @@ static int do_write(struct fsg_common *common)
 			/* If an error occurred, report it and its position */
 			if (nwritten < amount) {
 				curlun->sense_data = SS_WRITE_ERROR;
-				curlun->sense_data_info =
-					file_offset >> curlun->blkbits;
-				curlun->info_valid = 1;
+				fsg_lun_set_sense_info(curlun,
+						file_offset >> curlun->blkbits);
 				break;
 			}
 
@@ -954,12 +2042,35 @@ static int do_write(struct fsg_common *common)
 		}
 
 		/* Wait for something to happen */
-		rc = sleep_thread(common, false);
+		if (bh->outreq_busy)
+			rc = sleep_thread_for_buffer(common);
+		else
+			rc = sleep_thread(common, false);
 		if (rc)
-			return rc;
+			goto out;
 	}
 
-	return -EIO;		/* No default reply */
+	if (wb_queued_bytes) {
+		rc = fsg_wb_drain(common, wb_queued_bytes, &wb_lost);
+		if (rc)
+			goto out;
+		common->residue += wb_lost;
+	}
+
+	rc = -EIO;		/* No default reply */
+
+out:
+	/* Don't leave stale data in the block device's page cache */
+	usb_offset = ((loff_t) lba) << curlun->blkbits;
+	if (use_bio && curlun->filp->f_mapping->nrpages &&
+	    file_offset > usb_offset)
+		invalidate_inode_pages2_range(curlun->filp->f_mapping,
+			fsg_lun_file_offset(curlun, usb_offset) >> PAGE_SHIFT,
+			(fsg_lun_file_offset(curlun, file_offset) - 1) >>
+				PAGE_SHIFT);
+	if (zero_copy)
+		fsg_zc_write_cleanup(common, curlun);
+	return rc;
 }
 
 
@@ -984,9 +2095,12 @@ static int do_synchronize_cache(struct fsg_common *common)
 static void invalidate_sub(struct fsg_lun *curlun)
 {
 	struct file	*filp = curlun->filp;
-	struct inode	*inode = file_inode(filp);
+	struct inode	*inode;
 	unsigned long	rc;
 
+	if (!filp)		/* Nothing is cached for file-less LUNs */
+		return;
+	inode = file_inode(filp);
 	rc = invalidate_mapping_pages(inode->i_mapping, 0, -1);
 	VLDBG(curlun, "invalidate_mapping_pages -> %ld\n", rc);
 }
@@ -994,7 +2108,7 @@ static void invalidate_sub(struct fsg_lun *curlun)
 static int do_verify(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
-	u32			lba;
+	u64			lba;
 	u32			verification_length;
 	struct fsg_buffhd	*bh = common->next_buffhd_to_fill;
 	loff_t			file_offset, file_offset_tmp;
@@ -1006,7 +2120,13 @@ static int do_verify(struct fsg_common *common)
 	 * Get the starting Logical Block Address and check that it's
 	 * not too big.
 	 */
-	lba = get_unaligned_be32(&common->cmnd[2]);
+	if (common->cmnd[0] == VERIFY_16) {
+		lba = get_unaligned_be64(&common->cmnd[2]);
+		verification_length = get_unaligned_be32(&common->cmnd[10]);
+	} else {
+		lba = get_unaligned_be32(&common->cmnd[2]);
+		verification_length = get_unaligned_be16(&common->cmnd[7]);
+	}
 	if (lba >= curlun->num_sectors) {
 		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
 		return -EINVAL;
@@ -1021,10 +2141,16 @@ static int do_verify(struct fsg_common *common)
 		return -EINVAL;
 	}
 
-	verification_length = get_unaligned_be16(&common->cmnd[7]);
 	if (unlikely(verification_length == 0))
 		return -EIO;		/* No default reply */
 
+	/* A 32-bit length could overflow the byte count below */
+	if (verification_length > curlun->num_sectors - lba ||
+	    verification_length > U32_MAX >> curlun->blkbits) {
+		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		return -EINVAL;
+	}
+
 	/* Prepare to carry out the file verify */
 	amount_left = verification_length << curlun->blkbits;
 	file_offset = ((loff_t) lba) << curlun->blkbits;
@@ -1046,23 +2172,21 @@ static int do_verify(struct fsg_common *common)
 		 * the buffer size.
 		 * And don't try to read past the end of the file.
 		 */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t)amount,
 			     curlun->file_length - file_offset);
 		if (amount == 0) {
 			curlun->sense_data =
 					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
-			curlun->sense_data_info =
-				file_offset >> curlun->blkbits;
-			curlun->info_valid = 1;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
 			break;
 		}
 
 		/* Perform the read */
 		file_offset_tmp = file_offset;
-		nread = vfs_read(curlun->filp,
-				(char __user *) bh->buf,
-				amount, &file_offset_tmp);
+		nread = fsg_lun_read(curlun, bh->buf, amount,
+				     &file_offset_tmp);
 		VLDBG(curlun, "file read %u @ %llu -> %d\n", amount,
 				(unsigned long long) file_offset,
 				(int) nread);
@@ -1079,9 +2203,8 @@ static int do_verify(struct fsg_common *common)
 		}
 		if (nread == 0) {
 			curlun->sense_data = SS_UNRECOVERED_READ_ERROR;
-			curlun->sense_data_info =
-				file_offset >> curlun->blkbits;
-			curlun->info_valid = 1;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
 			break;
 		}
 		file_offset += nread;
@@ -1093,70 +2216,356 @@ static int do_verify(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
-static int do_inquiry(struct fsg_common *common, struct fsg_buffhd *bh)
+/*
+ * Receive the parameter list or data block of a command other than
+ * WRITE.  It has to fit in the single buffer; finish_reply() throws the
+ * rest away.  Returns the number of bytes received.
+ */
+static int fsg_receive_data(struct fsg_common *common, struct fsg_buffhd *bh,
+			    u32 length)
 {
-	struct fsg_lun *curlun = common->curlun;
-	u8	*buf = (u8 *) bh->buf;
+	struct fsg_lun	*curlun = common->curlun;
+	u32		amount;
+	int		rc;
 
-	if (!curlun) {		/* Unsupported LUNs are okay */
-		common->bad_lun_okay = 1;
-		memset(buf, 0, 36);
-		buf[0] = TYPE_NO_LUN;	/* Unsupported, no device-type */
-		buf[4] = 31;		/* Additional length */
-		return 36;
+	set_bulk_out_req_length(common, bh, length);
+	if (!start_out_transfer(common, bh))
+		/* Dunno what to do if common->fsg is NULL */
+		return -EIO;
+	common->next_buffhd_to_fill = bh->next;
+	common->usb_amount_left -= length;
+
+	while (bh->state != BUF_STATE_FULL) {
+		rc = sleep_thread(common, false);
+		if (rc)
+			return rc;
 	}
+	smp_rmb();
+	common->next_buffhd_to_drain = bh->next;
+	bh->state = BUF_STATE_EMPTY;
 
-	buf[0] = curlun->cdrom ? TYPE_ROM : TYPE_DISK;
-	buf[1] = curlun->removable ? 0x80 : 0;
-	buf[2] = 2;		/* ANSI SCSI level 2 */
-	buf[3] = 2;		/* SCSI-2 INQUIRY data format */
-	buf[4] = 31;		/* Additional length */
-	buf[5] = 0;		/* No special options */
-	buf[6] = 0;
-	buf[7] = 0;
-	memcpy(buf + 8, common->inquiry_string, sizeof common->inquiry_string);
-	return 36;
+	if (bh->outreq->status != 0) {
+		curlun->sense_data = SS_COMMUNICATION_FAILURE;
+		return -EIO;
+	}
+	amount = min(bh->outreq->actual, length);
+	common->residue -= amount;
+	if (amount < length) {
+		common->short_packet_received = 1;
+		curlun->sense_data = SS_PARAMETER_LIST_LENGTH_ERROR;
+		return -EIO;
+	}
+	return amount;
 }
 
-static int do_request_sense(struct fsg_common *common, struct fsg_buffhd *bh)
+static int do_unmap(struct fsg_common *common, struct fsg_buffhd *bh)
 {
 	struct fsg_lun	*curlun = common->curlun;
+	u32		length = common->data_size_from_cmnd;
 	u8		*buf = (u8 *) bh->buf;
-	u32		sd, sdinfo;
-	int		valid;
+	unsigned int	num_desc, i;
+	u64		lba;
+	u32		num_blocks;
+	int		rc;
 
-	/*
-	 * From the SCSI-2 spec., section 7.9 (Unit attention condition):
-	 *
-	 * If a REQUEST SENSE command is received from an initiator
-	 * with a pending unit attention condition (before the target
-	 * generates the contingent allegiance condition), then the
-	 * target shall either:
-	 *   a) report any pending sense data and preserve the unit
-	 *	attention condition on the logical unit, or,
-	 *   b) report the unit attention condition, may discard any
-	 *	pending sense data, and clear the unit attention
-	 *	condition on the logical unit for that initiator.
-	 *
-	 * FSG normally uses option a); enable this code to use option b).
-	 */
-#if 0
-	if (curlun && curlun->unit_attention_data != SS_NO_SENSE) {
-		curlun->sense_data = curlun->unit_attention_data;
-		curlun->unit_attention_data = SS_NO_SENSE;
+	if (curlun->ro) {
+		curlun->sense_data = SS_WRITE_PROTECTED;
+		return -EINVAL;
 	}
-#endif
 
-	if (!curlun) {		/* Unsupported LUNs are okay */
-		common->bad_lun_okay = 1;
-		sd = SS_LOGICAL_UNIT_NOT_SUPPORTED;
-		sdinfo = 0;
-		valid = 0;
-	} else {
-		sd = curlun->sense_data;
-		sdinfo = curlun->sense_data_info;
-		valid = curlun->info_valid << 7;
-		curlun->sense_data = SS_NO_SENSE;
+	if (length == 0)
+		return 0;		/* Nothing to unmap */
+	if (length < 8 || length > common->buflen) {
+		curlun->sense_data = SS_PARAMETER_LIST_LENGTH_ERROR;
+		return -EINVAL;
+	}
+
+	rc = fsg_receive_data(common, bh, length);
+	if (rc < 0)
+		return rc;
+
+	/* Check all the block descriptors before unmapping any of them */
+	num_desc = min_t(u32, get_unaligned_be16(&buf[2]), length - 8) / 16;
+	for (i = 0; i < num_desc; ++i) {
+		lba = get_unaligned_be64(&buf[8 + 16 * i]);
+		num_blocks = get_unaligned_be32(&buf[8 + 16 * i + 8]);
+		if (lba > curlun->num_sectors ||
+		    num_blocks > curlun->num_sectors - lba) {
+			curlun->sense_data =
+					SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < num_desc; ++i) {
+		lba = get_unaligned_be64(&buf[8 + 16 * i]);
+		num_blocks = get_unaligned_be32(&buf[8 + 16 * i + 8]);
+		if (num_blocks == 0)
+			continue;
+
+		/*
+		 * Unmapping is only a hint, keeping the data is allowed --
+		 * unless we told the host unmapped blocks read as zeroes.
+		 */
+		rc = fsg_lun_discard(curlun, ((loff_t) lba) << curlun->blkbits,
+				     ((loff_t) num_blocks) << curlun->blkbits);
+		VLDBG(curlun, "unmap %u @ %llu -> %d\n", num_blocks,
+		      (unsigned long long) lba, rc);
+		if (signal_pending(current))
+			return -EINTR;
+		if (rc && (rc != -EOPNOTSUPP || curlun->unmap_zeroes)) {
+			curlun->sense_data = SS_WRITE_ERROR;
+			fsg_lun_set_sense_info(curlun, lba);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int do_write_same(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct fsg_lun		*curlun = common->curlun;
+	u8			*buf = (u8 *) bh->buf;
+	u64			lba;
+	u32			num_blocks;
+	loff_t			start_offset, file_offset, file_offset_tmp;
+	loff_t			amount_left;
+	unsigned int		amount, fill;
+	ssize_t			nwritten;
+	int			rc;
+
+	if (curlun->ro) {
+		curlun->sense_data = SS_WRITE_PROTECTED;
+		return -EINVAL;
+	}
+
+	if (common->cmnd[0] == WRITE_SAME_16) {
+		lba = get_unaligned_be64(&common->cmnd[2]);
+		num_blocks = get_unaligned_be32(&common->cmnd[10]);
+	} else {
+		lba = get_unaligned_be32(&common->cmnd[2]);
+		num_blocks = get_unaligned_be16(&common->cmnd[7]);
+	}
+
+	/*
+	 * Only the UNMAP bit is supported.  The Block Limits VPD page
+	 * sets WSNZ, so a zero NUMBER OF LOGICAL BLOCKS is invalid.
+	 */
+	if ((common->cmnd[1] & ~0x08) || num_blocks == 0) {
+		curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
+		return -EINVAL;
+	}
+	if (lba >= curlun->num_sectors ||
+	    num_blocks > curlun->num_sectors - lba) {
+		curlun->sense_data = SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE;
+		return -EINVAL;
+	}
+
+	rc = fsg_receive_data(common, bh, curlun->blksize);
+	if (rc < 0)
+		return rc;
+
+	file_offset = start_offset = ((loff_t) lba) << curlun->blkbits;
+	amount_left = ((loff_t) num_blocks) << curlun->blkbits;
+
+	/* Zeroes with UNMAP set can become a hole or a discard */
+	if ((common->cmnd[1] & 0x08) && curlun->unmap_zeroes &&
+	    !memchr_inv(buf, 0, curlun->blksize)) {
+		rc = fsg_lun_discard(curlun, file_offset, amount_left);
+		VLDBG(curlun, "write same unmap %u @ %llu -> %d\n", num_blocks,
+		      (unsigned long long) lba, rc);
+		if (rc == 0)
+			return 0;
+	}
+
+	/* Repeat the block over the whole buffer and write it out */
+	fill = round_down(common->buflen, curlun->blksize);
+	for (amount = curlun->blksize; amount < fill;
+	     amount += curlun->blksize)
+		memcpy(buf + amount, buf, curlun->blksize);
+
+	while (amount_left > 0) {
+		amount = min_t(loff_t, amount_left, fill);
+		file_offset_tmp = file_offset;
+		nwritten = fsg_lun_write(curlun, buf, amount,
+					 &file_offset_tmp);
+		VLDBG(curlun, "file write same %u @ %llu -> %d\n", amount,
+		      (unsigned long long) file_offset, (int) nwritten);
+		if (signal_pending(current))
+			return -EINTR;
+
+		if (nwritten < 0) {
+			LDBG(curlun, "error in file write same: %d\n",
+			     (int) nwritten);
+			nwritten = 0;
+		} else if (nwritten < amount) {
+			LDBG(curlun, "partial file write same: %d/%u\n",
+			     (int) nwritten, amount);
+			nwritten = round_down(nwritten, curlun->blksize);
+		}
+		file_offset += nwritten;
+		amount_left -= nwritten;
+
+		if (nwritten < amount) {
+			curlun->sense_data = SS_WRITE_ERROR;
+			fsg_lun_set_sense_info(curlun,
+					file_offset >> curlun->blkbits);
+			break;
+		}
+	}
+
+	/* The bio engine reads around the block device's page cache */
+	if (fsg_lun_use_bio(curlun) && file_offset > start_offset) {
+		start_offset = fsg_lun_file_offset(curlun, start_offset);
+		file_offset = fsg_lun_file_offset(curlun, file_offset);
+		filemap_write_and_wait_range(curlun->filp->f_mapping,
+					     start_offset, file_offset - 1);
+		invalidate_inode_pages2_range(curlun->filp->f_mapping,
+					      start_offset >> PAGE_SHIFT,
+					      (file_offset - 1) >> PAGE_SHIFT);
+	}
+	return 0;
+}
+
+
+/*-------------------------------------------------------------------------*/
+
+static int do_inquiry_vpd(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct fsg_lun	*curlun = common->curlun;
+	u8		*buf = (u8 *) bh->buf;
+	int		n = 0;
+
+	memset(buf, 0, 64);
+	buf[0] = curlun->cdrom ? TYPE_ROM : TYPE_DISK;
+	buf[1] = common->cmnd[2];
+
+	switch (common->cmnd[2]) {
+	case 0x00:		/* Supported VPD pages */
+		buf[4 + n++] = 0x00;
+		if (!curlun->cdrom)
+			buf[4 + n++] = 0xb0;
+		if (curlun->unmap)
+			buf[4 + n++] = 0xb2;
+		break;
+
+	case 0xb0:		/* Block limits */
+		if (curlun->cdrom)
+			goto invalid;
+		n = 0x3c;
+		buf[4] = 0x01;	/* WSNZ: WRITE SAME must give a length */
+		put_unaligned_be16(1 << curlun->pblk_exp, &buf[6]);
+				/* Optimal transfer length granularity */
+		put_unaligned_be32(common->buflen >> curlun->blkbits, &buf[12]);
+				/* Optimal transfer length */
+		if (curlun->unmap) {
+			put_unaligned_be32(U32_MAX, &buf[20]);
+				/* Maximum unmap LBA count */
+			put_unaligned_be32((common->buflen - 8) / 16, &buf[24]);
+				/* Maximum unmap block descriptor count */
+			put_unaligned_be32(1 << curlun->pblk_exp, &buf[28]);
+				/* Optimal unmap granularity */
+		}
+		break;
+
+	case 0xb2:		/* Logical block provisioning */
+		if (!curlun->unmap)
+			goto invalid;
+		n = 4;
+		buf[5] = 0x80 | 0x40 | 0x20;	/* LBPU, LBPWS, LBPWS10 */
+		if (curlun->unmap_zeroes)
+			buf[5] |= 0x04;		/* LBPRZ */
+		if (!curlun->filp ||
+		    !S_ISBLK(file_inode(curlun->filp)->i_mode))
+			buf[6] = 0x02;		/* Thin provisioned */
+		break;
+
+	default:
+		goto invalid;
+	}
+	put_unaligned_be16(n, &buf[2]);	/* Page length */
+	return 4 + n;
+
+invalid:
+	curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
+	return -EINVAL;
+}
+
+static int do_inquiry(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct fsg_lun *curlun = common->curlun;
+	u8	*buf = (u8 *) bh->buf;
+
+	if (!curlun) {		/* Unsupported LUNs are okay */
+		common->bad_lun_okay = 1;
+		memset(buf, 0, 36);
+		buf[0] = TYPE_NO_LUN;	/* Unsupported, no device-type */
+		buf[4] = 31;		/* Additional length */
+		return 36;
+	}
+
+	if (common->cmnd[1] & 0x01)	/* EVPD */
+		return do_inquiry_vpd(common, bh);
+	if (common->cmnd[2]) {
+		curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
+		return -EINVAL;
+	}
+
+	buf[0] = curlun->cdrom ? TYPE_ROM : TYPE_DISK;
+	buf[1] = curlun->removable ? 0x80 : 0;
+	/*
+	 * Hosts only look for logical block provisioning on SPC-3
+	 * devices, everything else stays SCSI-2.
+	 */
+	buf[2] = curlun->unmap ? 5 : 2;	/* ANSI SCSI level */
+	buf[3] = 2;		/* SCSI-2 INQUIRY data format */
+	buf[4] = 31;		/* Additional length */
+	buf[5] = 0;		/* No special options */
+	buf[6] = 0;
+	buf[7] = 0;
+	memcpy(buf + 8, common->inquiry_string, sizeof common->inquiry_string);
+	return 36;
+}
+
+static int do_request_sense(struct fsg_common *common, struct fsg_buffhd *bh)
+{
+	struct fsg_lun	*curlun = common->curlun;
+	u8		*buf = (u8 *) bh->buf;
+	u32		sd, sdinfo;
+	int		valid;
+
+	/*
+	 * From the SCSI-2 spec., section 7.9 (Unit attention condition):
+	 *
+	 * If a REQUEST SENSE command is received from an initiator
+	 * with a pending unit attention condition (before the target
+	 * generates the contingent allegiance condition), then the
+	 * target shall either:
+	 *   a) report any pending sense data and preserve the unit
+	 *	attention condition on the logical unit, or,
+	 *   b) report the unit attention condition, may discard any
+	 *	pending sense data, and clear the unit attention
+	 *	condition on the logical unit for that initiator.
+	 *
+	 * FSG normally uses option a); enable this code to use option b).
+	 */
+#if 0
+	if (curlun && curlun->unit_attention_data != SS_NO_SENSE) {
+		curlun->sense_data = curlun->unit_attention_data;
+		curlun->unit_attention_data = SS_NO_SENSE;
+	}
+#endif
+
+	if (!curlun) {		/* Unsupported LUNs are okay */
+		common->bad_lun_okay = 1;
+		sd = SS_LOGICAL_UNIT_NOT_SUPPORTED;
+		sdinfo = 0;
+		valid = 0;
+	} else {
+		sd = curlun->sense_data;
+		sdinfo = curlun->sense_data_info;
+		valid = curlun->info_valid << 7;
+		curlun->sense_data = SS_NO_SENSE;
 		curlun->sense_data_info = 0;
 		curlun->info_valid = 0;
 	}
@@ -1184,12 +2593,39 @@ static int do_read_capacity(struct fsg_common *common, struct fsg_buffhd *bh)
 		return -EINVAL;
 	}
 
-	put_unaligned_be32(curlun->num_sectors - 1, &buf[0]);
-						/* Max logical block */
+	/* Tell hosts to use READ CAPACITY(16) for larger LUNs */
+	put_unaligned_be32(min_t(loff_t, curlun->num_sectors - 1, U32_MAX),
+			   &buf[0]);		/* Max logical block */
 	put_unaligned_be32(curlun->blksize, &buf[4]);/* Block length */
 	return 8;
 }
 
+static int do_read_capacity_16(struct fsg_common *common,
+			       struct fsg_buffhd *bh)
+{
+	struct fsg_lun	*curlun = common->curlun;
+	u64		lba = get_unaligned_be64(&common->cmnd[2]);
+	int		pmi = common->cmnd[14];
+	u8		*buf = (u8 *)bh->buf;
+
+	/* Check the PMI and LBA fields */
+	if (pmi > 1 || (pmi == 0 && lba != 0)) {
+		curlun->sense_data = SS_INVALID_FIELD_IN_CDB;
+		return -EINVAL;
+	}
+
+	memset(buf, 0, 32);
+	put_unaligned_be64(curlun->num_sectors - 1, &buf[0]);
+						/* Max logical block */
+	put_unaligned_be32(curlun->blksize, &buf[8]);/* Block length */
+	buf[13] = curlun->pblk_exp;	/* Logical blocks per physical block */
+	if (curlun->unmap)
+		buf[14] = 0x80;		/* LBPME */
+	if (curlun->unmap_zeroes)
+		buf[14] |= 0x40;	/* LBPRZ */
+	return 32;
+}
+
 static int do_read_header(struct fsg_common *common, struct fsg_buffhd *bh)
 {
 	struct fsg_lun	*curlun = common->curlun;
@@ -1277,7 +2713,7 @@ static int do_mode_sense(struct fsg_common *common, struct fsg_buffhd *bh)
 	} else {			/* MODE_SENSE_10 */
 		buf[3] = (curlun->ro ? 0x80 : 0x00);		/* WP, DPOFUA */
 		buf += 8;
-		limit = 65535;		/* Should really be FSG_BUFLEN */
+		limit = 65535;		/* Should really be buflen */
 	}
 
 	/* No block descriptors */
@@ -1409,8 +2845,8 @@ static int do_read_format_capacities(struct fsg_common *common,
 	buf[3] = 8;	/* Only the Current/Maximum Capacity Descriptor */
 	buf += 4;
 
-	put_unaligned_be32(curlun->num_sectors, &buf[0]);
-						/* Number of blocks */
+	put_unaligned_be32(min_t(loff_t, curlun->num_sectors, U32_MAX),
+			   &buf[0]);		/* Number of blocks */
 	put_unaligned_be32(curlun->blksize, &buf[4]);/* Block length */
 	buf[4] = 0x02;				/* Current capacity */
 	return 12;
@@ -1448,186 +2884,745 @@ static int halt_bulk_in_endpoint(struct fsg_dev *fsg)
 			return -EINTR;
 		rc = usb_ep_set_halt(fsg->bulk_in);
 	}
-	return rc;
+	return rc;
+}
+
+static int wedge_bulk_in_endpoint(struct fsg_dev *fsg)
+{
+	int	rc;
+
+	DBG(fsg, "bulk-in set wedge\n");
+	rc = usb_ep_set_wedge(fsg->bulk_in);
+	if (rc == -EAGAIN)
+		VDBG(fsg, "delayed bulk-in endpoint wedge\n");
+	while (rc != 0) {
+		if (rc != -EAGAIN) {
+			WARNING(fsg, "usb_ep_set_wedge -> %d\n", rc);
+			rc = 0;
+			break;
+		}
+
+		/* Wait for a short time and then try again */
+		if (msleep_interruptible(100) != 0)
+			return -EINTR;
+		rc = usb_ep_set_wedge(fsg->bulk_in);
+	}
+	return rc;
+}
+
+static int throw_away_data(struct fsg_common *common)
+{
+	struct fsg_buffhd	*bh;
+	u32			amount;
+	int			rc;
+
+	for (bh = common->next_buffhd_to_drain;
+	     bh->state != BUF_STATE_EMPTY || common->usb_amount_left > 0;
+	     bh = common->next_buffhd_to_drain) {
+
+		/* Throw away the data in a filled buffer */
+		if (bh->state == BUF_STATE_FULL) {
+			smp_rmb();
+			bh->state = BUF_STATE_EMPTY;
+			common->next_buffhd_to_drain = bh->next;
+
+			/* A short packet or an error ends everything */
+			if (bh->outreq->actual < bh->bulk_out_intended_length ||
+			    bh->outreq->status != 0) {
+				raise_exception(common,
+						FSG_STATE_ABORT_BULK_OUT);
+				return -EINTR;
+			}
+			continue;
+		}
+
+		/* Try to submit another request if we need one */
+		bh = common->next_buffhd_to_fill;
+		if (bh->state == BUF_STATE_EMPTY
+		 && common->usb_amount_left > 0) {
+			amount = min(common->usb_amount_left, common->buflen);
+
+			/*
+			 * Except at the end of the transfer, amount will be
+			 * equal to the buffer size, which is divisible by
+			 * the bulk-out maxpacket size.
+			 */
+			set_bulk_out_req_length(common, bh, amount);
+			if (!start_out_transfer(common, bh))
+				/* Dunno what to do if common->fsg is NULL */
+				return -EIO;
+			common->next_buffhd_to_fill = bh->next;
+			common->usb_amount_left -= amount;
+			continue;
+		}
+
+		/* Otherwise wait for something to happen */
+		rc = sleep_thread(common, true);
+		if (rc)
+			return rc;
+	}
+	return 0;
+}
+
+static int finish_reply(struct fsg_common *common)
+{
+	struct fsg_buffhd	*bh = common->next_buffhd_to_fill;
+	int			rc = 0;
+
+	switch (common->data_dir) {
+	case DATA_DIR_NONE:
+		break;			/* Nothing to send */
+
+	/*
+	 * If we don't know whether the host wants to read or write,
+	 * this must be CB or CBI with an unknown command.  We mustn't
+	 * try to send or receive any data.  So stall both bulk pipes
+	 * if we can and wait for a reset.
+	 */
+	case DATA_DIR_UNKNOWN:
+		if (!common->can_stall) {
+			/* Nothing */
+		} else if (fsg_is_set(common)) {
+			fsg_set_halt(common->fsg, common->fsg->bulk_out);
+			rc = halt_bulk_in_endpoint(common->fsg);
+		} else {
+			/* Don't know what to do if common->fsg is NULL */
+			rc = -EIO;
+		}
+		break;
+
+	/* All but the last buffer of data must have already been sent */
+	case DATA_DIR_TO_HOST:
+		if (common->data_size == 0) {
+			/* Nothing to send */
+
+		/* Don't know what to do if common->fsg is NULL */
+		} else if (!fsg_is_set(common)) {
+			rc = -EIO;
+
+		/* If there's no residue, simply send the last buffer */
+		} else if (common->residue == 0) {
+			bh->inreq->zero = 0;
+			if (!start_in_transfer(common, bh))
+				return -EIO;
+			common->next_buffhd_to_fill = bh->next;
+
+		/*
+		 * UAS never stalls: a short packet ends the data, and a
+		 * command which failed before sending anything has no
+		 * data phase at all.
+		 */
+		} else if (common->uas) {
+			if (bh->inreq->length == 0 &&
+			    common->residue == common->data_size) {
+				bh->state = BUF_STATE_EMPTY;
+				break;
+			}
+			bh->inreq->zero = 1;
+			if (!start_in_transfer(common, bh))
+				rc = -EIO;
+			common->next_buffhd_to_fill = bh->next;
+
+		/*
+		 * For Bulk-only, mark the end of the data with a short
+		 * packet.  If we are allowed to stall, halt the bulk-in
+		 * endpoint.  (Note: This violates the Bulk-Only Transport
+		 * specification, which requires us to pad the data if we
+		 * don't halt the endpoint.  Presumably nobody will mind.)
+		 */
+		} else {
+			bh->inreq->zero = 1;
+			if (!start_in_transfer(common, bh))
+				rc = -EIO;
+			common->next_buffhd_to_fill = bh->next;
+			if (common->can_stall)
+				rc = halt_bulk_in_endpoint(common->fsg);
+		}
+		break;
+
+	/*
+	 * We have processed all we want from the data the host has sent.
+	 * There may still be outstanding bulk-out requests.
+	 */
+	case DATA_DIR_FROM_HOST:
+		if (common->residue == 0) {
+			/* Nothing to receive */
+
+		/*
+		 * With UAS no data has been asked for yet, the host will
+		 * drop it when it sees the status.
+		 */
+		} else if (common->uas &&
+			   common->usb_amount_left == common->data_size) {
+			/* Nothing to receive */
+
+		/* Did the host stop sending unexpectedly early? */
+		} else if (common->short_packet_received) {
+			raise_exception(common, FSG_STATE_ABORT_BULK_OUT);
+			rc = -EINTR;
+
+		/*
+		 * We haven't processed all the incoming data.  Even though
+		 * we may be allowed to stall, doing so would cause a race.
+		 * The controller may already have ACK'ed all the remaining
+		 * bulk-out packets, in which case the host wouldn't see a
+		 * STALL.  Not realizing the endpoint was halted, it wouldn't
+		 * clear the halt -- leading to problems later on.
+		 */
+#if 0
+		} else if (common->can_stall) {
+			if (fsg_is_set(common))
+				fsg_set_halt(common->fsg,
+					     common->fsg->bulk_out);
+			raise_exception(common, FSG_STATE_ABORT_BULK_OUT);
+			rc = -EINTR;
+#endif
+
+		/*
+		 * We can't stall.  Read in the excess data and throw it
+		 * all away.
+		 */
+		} else {
+			rc = throw_away_data(common);
+		}
+		break;
+	}
+	return rc;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * Idle release.  While the thread waits for a command, for longer than
+ * idle_timeout or when the shrinker asks for memory, it frees the data of
+ * every buffer but the one the next CBW is (or will be) read into, and
+ * closes the ring around that one.  The next command brings the others
+ * back before it is carried out; how long that takes is kept for
+ * idle_stats.
+ */
+static void fsg_idle_timer(unsigned long data)
+{
+	struct fsg_common	*common = (struct fsg_common *)data;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&common->lock, flags);
+	if (common->idle) {
+		common->park_requested = true;
+		wakeup_thread(common);
+	}
+	spin_unlock_irqrestore(&common->lock, flags);
+}
+
+static void fsg_park_buffers(struct fsg_common *common)
+{
+	struct fsg_buffhd	*keep = common->next_buffhd_to_fill, *bh;
+	unsigned int		i;
+
+	/* Wait for the last status to go out */
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
+		bh = &common->buffhds[i];
+		if (bh != keep && (bh->state != BUF_STATE_EMPTY ||
+				   bh->inreq_busy || bh->outreq_busy))
+			return;
+	}
+
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
+		bh = &common->buffhds[i];
+		if (bh == keep || !bh->buf)
+			continue;
+		fsg_bh_put_pages(bh);
+		fsg_bh_unmap(bh);
+		free_pages_exact(bh->buf, bh->buflen);
+		bh->buf = NULL;
+		if (bh->inreq)
+			bh->inreq->buf = bh->outreq->buf = NULL;
+	}
+	keep->next = keep;
+	common->next_buffhd_to_drain = keep;
+	common->parked = true;
+
+	spin_lock_irq(&common->lock);
+	common->park_requested = false;
+	++common->parks;
+	spin_unlock_irq(&common->lock);
+	DBG(common, "buffers released\n");
+}
+
+/*
+ * Give the parked buffers their data back and relink the ring over them.
+ * Any that can't get it stay out of the ring, and are tried again with
+ * the next command.
+ */
+static void fsg_unpark_buffers(struct fsg_common *common)
+{
+	struct fsg_buffhd	*keep = common->next_buffhd_to_fill;
+	struct fsg_buffhd	*bh, *prev = keep;
+	unsigned int		n = common->fsg_num_buffers;
+	unsigned int		i, first = keep - common->buffhds;
+	bool			parked = false;
+	u64			start = ktime_get_ns(), took;
+
+	for (i = 1; i <= n; ++i) {
+		bh = &common->buffhds[(first + i) % n];
+		if (!bh->buf) {
+			bh->buf = alloc_pages_exact(bh->buflen, GFP_KERNEL);
+			if (!bh->buf) {
+				parked = true;
+				continue;
+			}
+			if (bh->inreq) {
+				bh->inreq->buf = bh->outreq->buf = bh->buf;
+				if (common->premap)
+					fsg_bh_map(common, bh);
+			}
+		}
+		prev->next = bh;
+		prev = bh;
+	}
+	common->parked = parked;
+	took = ktime_get_ns() - start;
+
+	spin_lock_irq(&common->lock);
+	++common->unparks;
+	common->unpark_ns = took;
+	common->unpark_max_ns = max(common->unpark_max_ns, took);
+	spin_unlock_irq(&common->lock);
+	if (parked)
+		WARNING(common, "can't allocate all the buffers back\n");
+}
+
+/* sleep_thread() while waiting for the host to send a command */
+static int sleep_thread_idle(struct fsg_common *common)
+{
+	if (!common->idle) {
+		spin_lock_irq(&common->lock);
+		common->idle = true;
+		spin_unlock_irq(&common->lock);
+		if (common->idle_timeout && !common->parked)
+			mod_timer(&common->idle_timer, jiffies +
+				  msecs_to_jiffies(common->idle_timeout));
+	}
+	if (common->park_requested && !common->parked)
+		fsg_park_buffers(common);
+	return sleep_thread(common, true);
+}
+
+/* A command has arrived: bring the buffers back for it */
+static void fsg_idle_end(struct fsg_common *common)
+{
+	spin_lock_irq(&common->lock);
+	common->idle = false;
+	common->park_requested = false;
+	spin_unlock_irq(&common->lock);
+	if (common->parked)
+		fsg_unpark_buffers(common);
+}
+
+static unsigned long fsg_shrink_count(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	struct fsg_common *common =
+		container_of(shrinker, struct fsg_common, shrinker);
+
+	if (!common->idle || common->parked)
+		return 0;
+	return (common->fsg_num_buffers - 1) *
+		(PAGE_ALIGN(common->buflen) >> PAGE_SHIFT);
+}
+
+/* The thread does the freeing, the next time it looks */
+static unsigned long fsg_shrink_scan(struct shrinker *shrinker,
+				     struct shrink_control *sc)
+{
+	struct fsg_common	*common =
+		container_of(shrinker, struct fsg_common, shrinker);
+	unsigned long		flags;
+
+	spin_lock_irqsave(&common->lock, flags);
+	if (common->idle && !common->parked) {
+		common->park_requested = true;
+		wakeup_thread(common);
+	}
+	spin_unlock_irqrestore(&common->lock, flags);
+	return SHRINK_STOP;
+}
+
+/*-------------------------------------------------------------------------*/
+
+/*
+ * USB Attached SCSI.  When the host selects alternate setting 1, command
+ * IUs arrive on a pipe of their own and the status of each command goes
+ * back in a sense IU on the status pipe; data still moves through the
+ * bulk-in and bulk-out endpoints and the buffer ring.  The host may queue
+ * up to FSG_UAS_NUM_CMDS tagged commands.  The main thread carries them
+ * out one at a time with the same do_*() handlers as for Bulk-Only, so
+ * only get_next_command(), send_status() and the start of the data phase
+ * differ.
+ *
+ * On SuperSpeed the data and status transfers of a command use its tag
+ * as stream ID.  Without streams a READ READY or WRITE READY IU tells the
+ * host which command the following data belongs to.
+ */
+
+/* Only single level LUNs with peripheral device addressing are accepted */
+static unsigned int fsg_uas_lun(const struct scsi_lun *lun)
+{
+	return lun->scsi_lun[0] ? ~0u : lun->scsi_lun[1];
+}
+
+/* The CDB field of a command IU is always 16 bytes long */
+static int fsg_uas_cdb_len(u8 opcode)
+{
+	switch (opcode >> 5) {
+	case 0:
+		return 6;
+	case 1:
+	case 2:
+		return 10;
+	case 5:
+		return 12;
+	default:
+		return 16;
+	}
+}
+
+static void uas_cmd_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct fsg_common	*common = ep->driver_data;
+	struct fsg_uas_cmd	*cmd = req->context;
+
+	if (req->status && req->status != -ESHUTDOWN)
+		DBG(common, "%s --> %d, %u/%u\n", __func__,
+		    req->status, req->actual, req->length);
+
+	/* Hold the lock while we update the request and queue states */
+	smp_wmb();
+	spin_lock(&common->lock);
+	cmd->busy = 0;
+	if (req->status == 0 && req->actual >= sizeof(struct iu))
+		list_add_tail(&cmd->list, &common->uas_cmd_queue);
+	wakeup_thread(common);
+	spin_unlock(&common->lock);
+}
+
+static void uas_status_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct fsg_common	*common = ep->driver_data;
+
+	if (req->status && req->status != -ESHUTDOWN)
+		DBG(common, "%s --> %d, %u/%u\n", __func__,
+		    req->status, req->actual, req->length);
+
+	spin_lock(&common->lock);
+	common->uas_status_busy = 0;
+	common->uas_status_state = BUF_STATE_EMPTY;
+	wakeup_thread(common);
+	spin_unlock(&common->lock);
+}
+
+/* Keep every command request not holding an unprocessed IU queued */
+static void fsg_uas_queue_cmds(struct fsg_common *common)
+{
+	struct fsg_uas_cmd	*cmd;
+	bool			idle;
+	int			i;
+
+	if (!fsg_is_set(common))
+		return;
+	for (i = 0; i < FSG_UAS_NUM_CMDS; ++i) {
+		cmd = &common->uas_cmds[i];
+		spin_lock_irq(&common->lock);
+		idle = !cmd->busy && list_empty(&cmd->list);
+		spin_unlock_irq(&common->lock);
+		if (!idle)
+			continue;
+
+		cmd->req->length = usb_endpoint_maxp(common->fsg->cmd_out->desc);
+		start_transfer(common->fsg, common->fsg->cmd_out, cmd->req,
+			       &cmd->busy, &cmd->state);
+	}
+}
+
+/* Task management IUs overtake the commands queued before them */
+static struct fsg_uas_cmd *fsg_uas_next_iu(struct fsg_common *common)
+{
+	struct fsg_uas_cmd	*cmd, *next = NULL;
+	struct iu		*iu;
+
+	spin_lock_irq(&common->lock);
+	list_for_each_entry(cmd, &common->uas_cmd_queue, list) {
+		iu = cmd->req->buf;
+		if (iu->iu_id == IU_ID_TASK_MGMT) {
+			next = cmd;
+			break;
+		}
+	}
+	if (!next && !list_empty(&common->uas_cmd_queue))
+		next = list_first_entry(&common->uas_cmd_queue,
+					struct fsg_uas_cmd, list);
+	if (next)
+		list_del_init(&next->list);
+	spin_unlock_irq(&common->lock);
+	return next;
+}
+
+/* Wait for the status request; the caller then fills in its buffer */
+static int fsg_uas_wait_status(struct fsg_common *common)
+{
+	int	rc;
+
+	while (common->uas_status_busy) {
+		rc = sleep_thread(common, true);
+		if (rc)
+			return rc;
+	}
+	return 0;
 }
 
-static int wedge_bulk_in_endpoint(struct fsg_dev *fsg)
+static int fsg_uas_send_iu(struct fsg_common *common, unsigned int length,
+			   u16 tag)
 {
-	int	rc;
-
-	DBG(fsg, "bulk-in set wedge\n");
-	rc = usb_ep_set_wedge(fsg->bulk_in);
-	if (rc == -EAGAIN)
-		VDBG(fsg, "delayed bulk-in endpoint wedge\n");
-	while (rc != 0) {
-		if (rc != -EAGAIN) {
-			WARNING(fsg, "usb_ep_set_wedge -> %d\n", rc);
-			rc = 0;
-			break;
-		}
+	struct usb_request	*req = common->uas_status_req;
 
-		/* Wait for a short time and then try again */
-		if (msleep_interruptible(100) != 0)
-			return -EINTR;
-		rc = usb_ep_set_wedge(fsg->bulk_in);
-	}
-	return rc;
+	if (!fsg_is_set(common))
+		return -EIO;
+	req->length = length;
+	req->zero = 0;
+	req->stream_id = common->uas_streams ? tag : 0;
+	start_transfer(common->fsg, common->fsg->status_in, req,
+		       &common->uas_status_busy, &common->uas_status_state);
+	return 0;
 }
 
-static int throw_away_data(struct fsg_common *common)
+static int fsg_uas_send_response(struct fsg_common *common, u16 tag, u8 code)
 {
-	struct fsg_buffhd	*bh;
-	u32			amount;
+	struct response_iu	*riu;
 	int			rc;
 
-	for (bh = common->next_buffhd_to_drain;
-	     bh->state != BUF_STATE_EMPTY || common->usb_amount_left > 0;
-	     bh = common->next_buffhd_to_drain) {
+	rc = fsg_uas_wait_status(common);
+	if (rc)
+		return rc;
 
-		/* Throw away the data in a filled buffer */
-		if (bh->state == BUF_STATE_FULL) {
-			smp_rmb();
-			bh->state = BUF_STATE_EMPTY;
-			common->next_buffhd_to_drain = bh->next;
+	DBG(common, "UAS response x%02x for tag %u\n", code, tag);
+	riu = common->uas_status_req->buf;
+	memset(riu, 0, sizeof(*riu));
+	riu->iu_id = IU_ID_RESPONSE;
+	riu->tag = cpu_to_be16(tag);
+	riu->response_code = code;
+	return fsg_uas_send_iu(common, sizeof(*riu), tag);
+}
 
-			/* A short packet or an error ends everything */
-			if (bh->outreq->actual < bh->bulk_out_intended_length ||
-			    bh->outreq->status != 0) {
-				raise_exception(common,
-						FSG_STATE_ABORT_BULK_OUT);
-				return -EINTR;
-			}
-			continue;
-		}
+/* Announce the data phase of the current command, if there are no streams */
+static int fsg_uas_data_ready(struct fsg_common *common, u8 iu_id)
+{
+	struct iu	*iu;
+	int		rc;
 
-		/* Try to submit another request if we need one */
-		bh = common->next_buffhd_to_fill;
-		if (bh->state == BUF_STATE_EMPTY
-		 && common->usb_amount_left > 0) {
-			amount = min(common->usb_amount_left, FSG_BUFLEN);
+	if (common->uas_streams || common->uas_ready_sent)
+		return 0;
 
-			/*
-			 * Except at the end of the transfer, amount will be
-			 * equal to the buffer size, which is divisible by
-			 * the bulk-out maxpacket size.
-			 */
-			set_bulk_out_req_length(common, bh, amount);
-			if (!start_out_transfer(common, bh))
-				/* Dunno what to do if common->fsg is NULL */
-				return -EIO;
-			common->next_buffhd_to_fill = bh->next;
-			common->usb_amount_left -= amount;
+	rc = fsg_uas_wait_status(common);
+	if (rc)
+		return rc;
+
+	iu = common->uas_status_req->buf;
+	memset(iu, 0, sizeof(*iu));
+	iu->iu_id = iu_id;
+	iu->tag = cpu_to_be16(common->tag);
+	common->uas_ready_sent = 1;
+	return fsg_uas_send_iu(common, sizeof(*iu), common->tag);
+}
+
+/*
+ * Commands still waiting in the queue can be aborted; the one being
+ * carried out when the task management IU arrived has already finished.
+ */
+static int fsg_uas_task_mgmt(struct fsg_common *common,
+			     struct task_mgmt_iu *tmf, unsigned int length)
+{
+	struct fsg_uas_cmd	*cmd, *tmp;
+	struct command_iu	*ciu;
+	u16			tag = be16_to_cpu(tmf->tag);
+	u16			task_tag = be16_to_cpu(tmf->task_tag);
+	unsigned int		lun = fsg_uas_lun(&tmf->lun);
+	bool			nexus = tmf->function == TMF_I_T_NEXUS_RESET;
+	bool			found = false;
+	u8			code = RC_TMF_COMPLETE;
+	int			i;
+
+	if (length < sizeof(*tmf))
+		return fsg_uas_send_response(common, tag,
+					     RC_INVALID_INFO_UNIT);
+	if (!nexus && (lun >= ARRAY_SIZE(common->luns) || !common->luns[lun]))
+		return fsg_uas_send_response(common, tag, RC_INCORRECT_LUN);
+
+	spin_lock_irq(&common->lock);
+	list_for_each_entry_safe(cmd, tmp, &common->uas_cmd_queue, list) {
+		ciu = cmd->req->buf;
+		if (ciu->iu_id != IU_ID_COMMAND ||
+		    (!nexus && fsg_uas_lun(&ciu->lun) != lun))
+			continue;
+
+		switch (tmf->function) {
+		case TMF_ABORT_TASK:
+		case TMF_QUERY_TASK:
+			if (be16_to_cpu(ciu->tag) != task_tag)
+				continue;
+			break;
+		case TMF_ABORT_TASK_SET:
+		case TMF_CLEAR_TASK_SET:
+		case TMF_LOGICAL_UNIT_RESET:
+		case TMF_I_T_NEXUS_RESET:
+			break;
+		default:
 			continue;
 		}
+		found = true;
+		if (tmf->function != TMF_QUERY_TASK)
+			list_del_init(&cmd->list);
+	}
+	spin_unlock_irq(&common->lock);
 
-		/* Otherwise wait for something to happen */
-		rc = sleep_thread(common, true);
-		if (rc)
-			return rc;
+	switch (tmf->function) {
+	case TMF_ABORT_TASK:
+	case TMF_ABORT_TASK_SET:
+	case TMF_CLEAR_TASK_SET:
+		break;
+	case TMF_LOGICAL_UNIT_RESET:
+		common->luns[lun]->unit_attention_data = SS_RESET_OCCURRED;
+		break;
+	case TMF_I_T_NEXUS_RESET:
+		for (i = 0; i < ARRAY_SIZE(common->luns); ++i)
+			if (common->luns[i])
+				common->luns[i]->unit_attention_data =
+					SS_RESET_OCCURRED;
+		break;
+	case TMF_QUERY_TASK:
+		code = found ? RC_TMF_SUCCEEDED : RC_TMF_COMPLETE;
+		break;
+	default:
+		code = RC_TMF_NOT_SUPPORTED;
+		break;
 	}
-	return 0;
+	return fsg_uas_send_response(common, tag, code);
 }
 
-static int finish_reply(struct fsg_common *common)
+static int fsg_uas_received_iu(struct fsg_common *common,
+			       struct usb_request *req)
 {
-	struct fsg_buffhd	*bh = common->next_buffhd_to_fill;
-	int			rc = 0;
-
-	switch (common->data_dir) {
-	case DATA_DIR_NONE:
-		break;			/* Nothing to send */
+	struct command_iu	*ciu = req->buf;
+	u16			tag = be16_to_cpu(ciu->tag);
+	unsigned int		lun;
 
-	/*
-	 * If we don't know whether the host wants to read or write,
-	 * this must be CB or CBI with an unknown command.  We mustn't
-	 * try to send or receive any data.  So stall both bulk pipes
-	 * if we can and wait for a reset.
-	 */
-	case DATA_DIR_UNKNOWN:
-		if (!common->can_stall) {
-			/* Nothing */
-		} else if (fsg_is_set(common)) {
-			fsg_set_halt(common->fsg, common->fsg->bulk_out);
-			rc = halt_bulk_in_endpoint(common->fsg);
-		} else {
-			/* Don't know what to do if common->fsg is NULL */
-			rc = -EIO;
-		}
+	switch (ciu->iu_id) {
+	case IU_ID_COMMAND:
 		break;
+	case IU_ID_TASK_MGMT:
+		fsg_uas_task_mgmt(common, req->buf, req->actual);
+		return -EINVAL;		/* Not a command */
+	default:
+		fsg_uas_send_response(common, tag, RC_INVALID_INFO_UNIT);
+		return -EINVAL;
+	}
 
-	/* All but the last buffer of data must have already been sent */
-	case DATA_DIR_TO_HOST:
-		if (common->data_size == 0) {
-			/* Nothing to send */
+	/* No additional CDB bytes, the CDB field is all we take */
+	if (req->actual < sizeof(*ciu) || ciu->len) {
+		DBG(common, "invalid command IU: len %u cdb+%u\n",
+		    req->actual, ciu->len * 4);
+		fsg_uas_send_response(common, tag, RC_INVALID_INFO_UNIT);
+		return -EINVAL;
+	}
 
-		/* Don't know what to do if common->fsg is NULL */
-		} else if (!fsg_is_set(common)) {
-			rc = -EIO;
+	/* Save the command for later */
+	common->cmnd_size = fsg_uas_cdb_len(ciu->cdb[0]);
+	memcpy(common->cmnd, ciu->cdb, common->cmnd_size);
+	common->data_dir = DATA_DIR_UNKNOWN;	/* Set by check_command() */
+	common->data_size = 0;
+	lun = fsg_uas_lun(&ciu->lun);
+	common->lun = lun;
+	if (lun < ARRAY_SIZE(common->luns))
+		common->curlun = common->luns[lun];
+	else
+		common->curlun = NULL;
+	common->tag = tag;
+	common->uas_ready_sent = 0;
+	return 0;
+}
 
-		/* If there's no residue, simply send the last buffer */
-		} else if (common->residue == 0) {
-			bh->inreq->zero = 0;
-			if (!start_in_transfer(common, bh))
-				return -EIO;
-			common->next_buffhd_to_fill = bh->next;
+static int fsg_uas_get_next_command(struct fsg_common *common)
+{
+	struct fsg_uas_cmd	*cmd;
+	int			rc;
 
-		/*
-		 * For Bulk-only, mark the end of the data with a short
-		 * packet.  If we are allowed to stall, halt the bulk-in
-		 * endpoint.  (Note: This violates the Bulk-Only Transport
-		 * specification, which requires us to pad the data if we
-		 * don't halt the endpoint.  Presumably nobody will mind.)
-		 */
-		} else {
-			bh->inreq->zero = 1;
-			if (!start_in_transfer(common, bh))
-				rc = -EIO;
-			common->next_buffhd_to_fill = bh->next;
-			if (common->can_stall)
-				rc = halt_bulk_in_endpoint(common->fsg);
-		}
-		break;
+	/* Wait for the next IU to arrive */
+	for (;;) {
+		fsg_uas_queue_cmds(common);
+		cmd = fsg_uas_next_iu(common);
+		if (cmd)
+			break;
+		rc = sleep_thread_idle(common);
+		if (rc)
+			return rc;
+	}
+	smp_rmb();
+	rc = fsg_uas_received_iu(common, cmd->req);
 
-	/*
-	 * We have processed all we want from the data the host has sent.
-	 * There may still be outstanding bulk-out requests.
-	 */
-	case DATA_DIR_FROM_HOST:
-		if (common->residue == 0) {
-			/* Nothing to receive */
+	/* The request can go back to the controller now */
+	fsg_uas_queue_cmds(common);
+	return rc;
+}
 
-		/* Did the host stop sending unexpectedly early? */
-		} else if (common->short_packet_received) {
-			raise_exception(common, FSG_STATE_ABORT_BULK_OUT);
-			rc = -EINTR;
+static int fsg_uas_send_status(struct fsg_common *common)
+{
+	struct fsg_lun		*curlun = common->curlun;
+	struct sense_iu		*siu;
+	u32			sd, sdinfo = 0;
+	int			valid = 0;
+	int			rc;
 
-		/*
-		 * We haven't processed all the incoming data.  Even though
-		 * we may be allowed to stall, doing so would cause a race.
-		 * The controller may already have ACK'ed all the remaining
-		 * bulk-out packets, in which case the host wouldn't see a
-		 * STALL.  Not realizing the endpoint was halted, it wouldn't
-		 * clear the halt -- leading to problems later on.
-		 */
-#if 0
-		} else if (common->can_stall) {
-			if (fsg_is_set(common))
-				fsg_set_halt(common->fsg,
-					     common->fsg->bulk_out);
-			raise_exception(common, FSG_STATE_ABORT_BULK_OUT);
-			rc = -EINTR;
-#endif
+	if (curlun) {
+		sd = curlun->sense_data;
+		sdinfo = curlun->sense_data_info;
+		valid = curlun->info_valid << 7;
+	} else if (common->bad_lun_okay)
+		sd = SS_NO_SENSE;
+	else
+		sd = SS_LOGICAL_UNIT_NOT_SUPPORTED;
 
-		/*
-		 * We can't stall.  Read in the excess data and throw it
-		 * all away.
-		 */
-		} else {
-			rc = throw_away_data(common);
-		}
-		break;
+	if (common->phase_error) {
+		DBG(common, "sending phase-error status\n");
+		sd = SS_INVALID_COMMAND;
+		valid = 0;
 	}
-	return rc;
+
+	rc = fsg_uas_wait_status(common);
+	if (rc)
+		return rc;
+
+	/* Store and send the sense IU, with the sense data if it failed */
+	siu = common->uas_status_req->buf;
+	memset(siu, 0, sizeof(*siu));
+	siu->iu_id = IU_ID_STATUS;
+	siu->tag = cpu_to_be16(common->tag);
+	if (sd == SS_NO_SENSE) {
+		siu->status = SAM_STAT_GOOD;
+	} else {
+		DBG(common, "sending command-failure status\n");
+		VDBG(common, "  sense data: SK x%02x, ASC x%02x, ASCQ x%02x;"
+				"  info x%x\n",
+				SK(sd), ASC(sd), ASCQ(sd), sdinfo);
+		siu->status = SAM_STAT_CHECK_CONDITION;
+		siu->len = cpu_to_be16(18);
+		siu->sense[0] = valid | 0x70;		/* Valid, current error */
+		siu->sense[2] = SK(sd);
+		put_unaligned_be32(sdinfo, &siu->sense[3]);
+		siu->sense[7] = 18 - 8;			/* Additional length */
+		siu->sense[12] = ASC(sd);
+		siu->sense[13] = ASCQ(sd);
+	}
+	return fsg_uas_send_iu(common,
+			       offsetof(struct sense_iu, sense) +
+			       be16_to_cpu(siu->len), common->tag);
 }
 
 static int send_status(struct fsg_common *common)
@@ -1639,6 +3634,9 @@ static int send_status(struct fsg_common *common)
 	u8			status = US_BULK_STAT_OK;
 	u32			sd, sdinfo = 0;
 
+	if (common->uas)
+		return fsg_uas_send_status(common);
+
 	/* Wait for the next buffer to become available */
 	bh = common->next_buffhd_to_fill;
 	while (bh->state != BUF_STATE_EMPTY) {
@@ -1646,6 +3644,7 @@ static int send_status(struct fsg_common *common)
 		if (rc)
 			return rc;
 	}
+	fsg_bh_put_pages(bh);
 
 	if (curlun) {
 		sd = curlun->sense_data;
@@ -1717,6 +3716,14 @@ static int check_command(struct fsg_common *common, int cmnd_size,
 	 */
 	if (common->data_size_from_cmnd == 0)
 		data_dir = DATA_DIR_NONE;
+
+	/* A UAS command IU doesn't give the data size or direction */
+	if (common->uas) {
+		if (data_dir == DATA_DIR_UNKNOWN)
+			data_dir = DATA_DIR_NONE;
+		common->data_dir = data_dir;
+		common->data_size = common->data_size_from_cmnd;
+	}
 	if (common->data_size < common->data_size_from_cmnd) {
 		/*
 		 * Host data size < Device data size is a phase error.
@@ -1826,8 +3833,18 @@ static int check_command_size_in_blocks(struct fsg_common *common,
 		int cmnd_size, enum data_direction data_dir,
 		unsigned int mask, int needs_medium, const char *name)
 {
-	if (common->curlun)
-		common->data_size_from_cmnd <<= common->curlun->blkbits;
+	struct fsg_lun	*curlun = common->curlun;
+
+	/*
+	 * A 32-bit block count may not fit in bytes; no host can ask for
+	 * that much data, so it ends up as a phase error.
+	 */
+	if (curlun) {
+		if (common->data_size_from_cmnd > U32_MAX >> curlun->blkbits)
+			common->data_size_from_cmnd = U32_MAX;
+		else
+			common->data_size_from_cmnd <<= curlun->blkbits;
+	}
 	return check_command(common, cmnd_size, data_dir,
 			mask, needs_medium, name);
 }
@@ -1850,6 +3867,7 @@ static int do_scsi_command(struct fsg_common *common)
 		if (rc)
 			return rc;
 	}
+	fsg_bh_put_pages(bh);
 	common->phase_error = 0;
 	common->short_packet_received = 0;
 
@@ -1858,9 +3876,10 @@ static int do_scsi_command(struct fsg_common *common)
 
 	case INQUIRY:
 		pr_info("%s: INQUIRY: test passed\n",__func__);
-		common->data_size_from_cmnd = common->cmnd[4];
+		common->data_size_from_cmnd =
+			get_unaligned_be16(&common->cmnd[3]);
 		reply = check_command(common, 6, DATA_DIR_TO_HOST,
-				      (1<<4), 0,
+				      (1<<1) | (1<<2) | (3<<3), 0,
 				      "INQUIRY");
 		if (reply == 0)
 			reply = do_inquiry(common, bh);
@@ -1935,13 +3954,24 @@ static int do_scsi_command(struct fsg_common *common)
 			reply = do_read(common);
 		break;
 
-	case READ_12:
+	case READ_12:
+		common->data_size_from_cmnd =
+				get_unaligned_be32(&common->cmnd[6]);
+		reply = check_command_size_in_blocks(common, 12,
+				      DATA_DIR_TO_HOST,
+				      (1<<1) | (0xf<<2) | (0xf<<6), 1,
+				      "READ(12)");
+		if (reply == 0)
+			reply = do_read(common);
+		break;
+
+	case READ_16:
 		common->data_size_from_cmnd =
-				get_unaligned_be32(&common->cmnd[6]);
-		reply = check_command_size_in_blocks(common, 12,
+				get_unaligned_be32(&common->cmnd[10]);
+		reply = check_command_size_in_blocks(common, 16,
 				      DATA_DIR_TO_HOST,
-				      (1<<1) | (0xf<<2) | (0xf<<6), 1,
-				      "READ(12)");
+				      (1<<1) | (0xff<<2) | (0xf<<10), 1,
+				      "READ(16)");
 		if (reply == 0)
 			reply = do_read(common);
 		break;
@@ -1955,6 +3985,18 @@ static int do_scsi_command(struct fsg_common *common)
 			reply = do_read_capacity(common, bh);
 		break;
 
+	case SERVICE_ACTION_IN_16:
+		if ((common->cmnd[1] & 0x1f) != SAI_READ_CAPACITY_16)
+			goto unknown_cmnd;
+		common->data_size_from_cmnd =
+			get_unaligned_be32(&common->cmnd[10]);
+		reply = check_command(common, 16, DATA_DIR_TO_HOST,
+				      (1<<1) | (0xff<<2) | (0xf<<10) | (1<<14),
+				      1, "READ CAPACITY(16)");
+		if (reply == 0)
+			reply = do_read_capacity_16(common, bh);
+		break;
+
 	case READ_HEADER:
 		if (!common->curlun || !common->curlun->cdrom)
 			goto unknown_cmnd;
@@ -2016,6 +4058,27 @@ static int do_scsi_command(struct fsg_common *common)
 			reply = do_synchronize_cache(common);
 		break;
 
+	case SYNCHRONIZE_CACHE_16:
+		common->data_size_from_cmnd = 0;
+		reply = check_command(common, 16, DATA_DIR_NONE,
+				      (0xff<<2) | (0xf<<10), 1,
+				      "SYNCHRONIZE CACHE(16)");
+		if (reply == 0)
+			reply = do_synchronize_cache(common);
+		break;
+
+	case UNMAP:
+		if (!common->curlun || !common->curlun->unmap)
+			goto unknown_cmnd;
+		common->data_size_from_cmnd =
+			get_unaligned_be16(&common->cmnd[7]);
+		reply = check_command(common, 10, DATA_DIR_FROM_HOST,
+				      (3<<7), 1,
+				      "UNMAP");
+		if (reply == 0)
+			reply = do_unmap(common, bh);
+		break;
+
 	case TEST_UNIT_READY:
 		common->data_size_from_cmnd = 0;
 		reply = check_command(common, 6, DATA_DIR_NONE,
@@ -2036,6 +4099,15 @@ static int do_scsi_command(struct fsg_common *common)
 			reply = do_verify(common);
 		break;
 
+	case VERIFY_16:
+		common->data_size_from_cmnd = 0;
+		reply = check_command(common, 16, DATA_DIR_NONE,
+				      (1<<1) | (0xff<<2) | (0xf<<10), 1,
+				      "VERIFY(16)");
+		if (reply == 0)
+			reply = do_verify(common);
+		break;
+
 	case WRITE_6:
 		i = common->cmnd[4];
 		common->data_size_from_cmnd = (i == 0) ? 256 : i;
@@ -2069,6 +4141,37 @@ static int do_scsi_command(struct fsg_common *common)
 			reply = do_write(common);
 		break;
 
+	case WRITE_16:
+		common->data_size_from_cmnd =
+				get_unaligned_be32(&common->cmnd[10]);
+		reply = check_command_size_in_blocks(common, 16,
+				      DATA_DIR_FROM_HOST,
+				      (1<<1) | (0xff<<2) | (0xf<<10), 1,
+				      "WRITE(16)");
+		if (reply == 0)
+			reply = do_write(common);
+		break;
+
+	case WRITE_SAME:
+		common->data_size_from_cmnd = 1;
+		reply = check_command_size_in_blocks(common, 10,
+				      DATA_DIR_FROM_HOST,
+				      (1<<1) | (0xf<<2) | (3<<7), 1,
+				      "WRITE SAME(10)");
+		if (reply == 0)
+			reply = do_write_same(common, bh);
+		break;
+
+	case WRITE_SAME_16:
+		common->data_size_from_cmnd = 1;
+		reply = check_command_size_in_blocks(common, 16,
+				      DATA_DIR_FROM_HOST,
+				      (1<<1) | (0xff<<2) | (0xf<<10), 1,
+				      "WRITE SAME(16)");
+		if (reply == 0)
+			reply = do_write_same(common, bh);
+		break;
+
 	/*
 	 * Some mandatory commands that we recognize but don't implement.
 	 * They don't mean much in this setting.  It's left as an exercise
@@ -2191,6 +4294,9 @@ static int get_next_command(struct fsg_common *common)
 	struct fsg_buffhd	*bh;
 	int			rc = 0;
 
+	if (common->uas)
+		return fsg_uas_get_next_command(common);
+
 	/* Wait for the next buffer to become available */
 	bh = common->next_buffhd_to_fill;
 	while (bh->state != BUF_STATE_EMPTY) {
@@ -2213,7 +4319,7 @@ static int get_next_command(struct fsg_common *common)
 
 	/* Wait for the CBW to arrive */
 	while (bh->state != BUF_STATE_FULL) {
-		rc = sleep_thread(common, true);
+		rc = sleep_thread_idle(common);
 		if (rc)
 			return rc;
 	}
@@ -2237,7 +4343,152 @@ static int alloc_request(struct fsg_common *common, struct usb_ep *ep,
 	return -ENOMEM;
 }
 
+static void fsg_free_requests(struct fsg_dev *fsg, struct fsg_buffhd *buffhds,
+			      unsigned int n)
+{
+	struct fsg_buffhd	*bh;
+	unsigned int		i;
+
+	for (i = 0; i < n; ++i) {
+		bh = &buffhds[i];
+		fsg_bh_put_pages(bh);
+		fsg_bh_unmap(bh);
+		if (bh->inreq) {
+			usb_ep_free_request(fsg->bulk_in, bh->inreq);
+			bh->inreq = NULL;
+		}
+		if (bh->outreq) {
+			usb_ep_free_request(fsg->bulk_out, bh->outreq);
+			bh->outreq = NULL;
+		}
+	}
+}
+
+static int fsg_alloc_requests(struct fsg_common *common, struct fsg_dev *fsg,
+			      struct fsg_buffhd *buffhds, unsigned int n)
+{
+	struct fsg_buffhd	*bh;
+	unsigned int		i;
+	int			rc;
+
+	for (i = 0; i < n; ++i) {
+		bh = &buffhds[i];
+		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
+		if (rc)
+			return rc;
+		rc = alloc_request(common, fsg->bulk_out, &bh->outreq);
+		if (rc)
+			return rc;
+		bh->inreq->buf = bh->outreq->buf = bh->buf;
+		bh->inreq->context = bh->outreq->context = bh;
+		bh->inreq->complete = bulk_in_complete;
+		bh->outreq->complete = bulk_out_complete;
+		if (common->premap && bh->buf)	/* Unless parked */
+			fsg_bh_map(common, bh);
+	}
+	return 0;
+}
+
 /* Reset interface setting and re-init endpoint state (toggle etc). */
+static void fsg_uas_disable(struct fsg_common *common, struct fsg_dev *fsg)
+{
+	struct fsg_uas_cmd	*cmd;
+	int			i;
+
+	if (fsg->cmd_out_enabled) {
+		usb_ep_disable(fsg->cmd_out);
+		fsg->cmd_out_enabled = 0;
+	}
+	if (fsg->status_in_enabled) {
+		usb_ep_disable(fsg->status_in);
+		fsg->status_in_enabled = 0;
+	}
+
+	for (i = 0; i < FSG_UAS_NUM_CMDS; ++i) {
+		cmd = &common->uas_cmds[i];
+		if (cmd->req) {
+			kfree(cmd->req->buf);
+			usb_ep_free_request(fsg->cmd_out, cmd->req);
+			cmd->req = NULL;
+		}
+		cmd->busy = 0;
+		INIT_LIST_HEAD(&cmd->list);
+	}
+	INIT_LIST_HEAD(&common->uas_cmd_queue);
+
+	if (common->uas_status_req) {
+		kfree(common->uas_status_req->buf);
+		usb_ep_free_request(fsg->status_in, common->uas_status_req);
+		common->uas_status_req = NULL;
+	}
+	common->uas_status_busy = 0;
+	common->uas_status_state = BUF_STATE_EMPTY;
+}
+
+static int fsg_uas_alloc_request(struct fsg_common *common, struct usb_ep *ep,
+				 struct usb_request **preq, unsigned int len)
+{
+	int	rc;
+
+	rc = alloc_request(common, ep, preq);
+	if (rc)
+		return rc;
+	(*preq)->buf = kmalloc(len, GFP_KERNEL);
+	if (!(*preq)->buf) {
+		usb_ep_free_request(ep, *preq);
+		*preq = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int fsg_uas_enable(struct fsg_common *common, struct fsg_dev *fsg)
+{
+	struct usb_gadget	*gadget = common->gadget;
+	struct fsg_uas_cmd	*cmd;
+	int			i, rc;
+
+	rc = config_ep_by_speed(gadget, &fsg->function, fsg->cmd_out);
+	if (rc)
+		return rc;
+	rc = usb_ep_enable(fsg->cmd_out);
+	if (rc)
+		return rc;
+	fsg->cmd_out->driver_data = common;
+	fsg->cmd_out_enabled = 1;
+
+	rc = config_ep_by_speed(gadget, &fsg->function, fsg->status_in);
+	if (rc)
+		return rc;
+	rc = usb_ep_enable(fsg->status_in);
+	if (rc)
+		return rc;
+	fsg->status_in->driver_data = common;
+	fsg->status_in_enabled = 1;
+
+	common->uas_streams = gadget->speed >= USB_SPEED_SUPER &&
+		fsg_ss_uas_bulk_in_comp_desc.bmAttributes;
+
+	for (i = 0; i < FSG_UAS_NUM_CMDS; ++i) {
+		cmd = &common->uas_cmds[i];
+		rc = fsg_uas_alloc_request(common, fsg->cmd_out, &cmd->req,
+					   FSG_UAS_CMD_BUFLEN);
+		if (rc)
+			return rc;
+		cmd->req->context = cmd;
+		cmd->req->complete = uas_cmd_complete;
+		cmd->req->stream_id = 0;
+	}
+
+	rc = fsg_uas_alloc_request(common, fsg->status_in,
+				   &common->uas_status_req,
+				   sizeof(struct sense_iu));
+	if (rc)
+		return rc;
+	common->uas_status_req->complete = uas_status_complete;
+	return 0;
+}
+
 static int do_set_interface(struct fsg_common *common, struct fsg_dev *new_fsg)
 {
 	struct fsg_dev *fsg;
@@ -2250,19 +4501,8 @@ reset:
 	/* Deallocate the requests */
 	if (common->fsg) {
 		fsg = common->fsg;
-
-		for (i = 0; i < common->fsg_num_buffers; ++i) {
-			struct fsg_buffhd *bh = &common->buffhds[i];
-
-			if (bh->inreq) {
-				usb_ep_free_request(fsg->bulk_in, bh->inreq);
-				bh->inreq = NULL;
-			}
-			if (bh->outreq) {
-				usb_ep_free_request(fsg->bulk_out, bh->outreq);
-				bh->outreq = NULL;
-			}
-		}
+		fsg_free_requests(fsg, common->buffhds,
+				  common->fsg_num_buffers);
 
 		/* Disable the endpoints */
 		if (fsg->bulk_in_enabled) {
@@ -2273,12 +4513,15 @@ reset:
 			usb_ep_disable(fsg->bulk_out);
 			fsg->bulk_out_enabled = 0;
 		}
+		fsg_uas_disable(common, fsg);
 
 		common->fsg = NULL;
 		wake_up(&common->fsg_wait);
 	}
 
 	common->running = 0;
+	common->uas = 0;
+	common->alt = 0;
 	if (!new_fsg || rc)
 		return rc;
 
@@ -2289,6 +4532,9 @@ reset:
 	rc = config_ep_by_speed(common->gadget, &(fsg->function), fsg->bulk_in);
 	if (rc)
 		goto reset;
+	if (common->new_alt == FSG_UAS_ALT &&
+	    common->gadget->speed >= USB_SPEED_SUPER)
+		fsg->bulk_in->comp_desc = &fsg_ss_uas_bulk_in_comp_desc;
 	rc = usb_ep_enable(fsg->bulk_in);
 	if (rc)
 		goto reset;
@@ -2299,6 +4545,9 @@ reset:
 				fsg->bulk_out);
 	if (rc)
 		goto reset;
+	if (common->new_alt == FSG_UAS_ALT &&
+	    common->gadget->speed >= USB_SPEED_SUPER)
+		fsg->bulk_out->comp_desc = &fsg_ss_uas_bulk_out_comp_desc;
 	rc = usb_ep_enable(fsg->bulk_out);
 	if (rc)
 		goto reset;
@@ -2308,21 +4557,19 @@ reset:
 	clear_bit(IGNORE_BULK_OUT, &fsg->atomic_bitflags);
 
 	/* Allocate the requests */
-	for (i = 0; i < common->fsg_num_buffers; ++i) {
-		struct fsg_buffhd	*bh = &common->buffhds[i];
+	rc = fsg_alloc_requests(common, fsg, common->buffhds,
+				common->fsg_num_buffers);
+	if (rc)
+		goto reset;
 
-		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
-		if (rc)
-			goto reset;
-		rc = alloc_request(common, fsg->bulk_out, &bh->outreq);
+	if (common->new_alt == FSG_UAS_ALT) {
+		rc = fsg_uas_enable(common, fsg);
 		if (rc)
 			goto reset;
-		bh->inreq->buf = bh->outreq->buf = bh->buf;
-		bh->inreq->context = bh->outreq->context = bh;
-		bh->inreq->complete = bulk_in_complete;
-		bh->outreq->complete = bulk_out_complete;
+		common->uas = 1;
 	}
 
+	common->alt = common->new_alt;
 	common->running = 1;
 	for (i = 0; i < ARRAY_SIZE(common->luns); ++i)
 		if (common->luns[i])
@@ -2337,15 +4584,27 @@ reset:
 static int fsg_set_alt(struct usb_function *f, unsigned intf, unsigned alt)
 {
 	struct fsg_dev *fsg = fsg_from_func(f);
+
+	if (alt > FSG_UAS_ALT || (alt == FSG_UAS_ALT && !fsg->cmd_out))
+		return -EINVAL;
 	fsg->common->new_fsg = fsg;
+	fsg->common->new_alt = alt;
 	raise_exception(fsg->common, FSG_STATE_CONFIG_CHANGE);
 	return USB_GADGET_DELAYED_STATUS;
 }
 
+static int fsg_get_alt(struct usb_function *f, unsigned intf)
+{
+	struct fsg_dev *fsg = fsg_from_func(f);
+
+	return fsg->common->fsg == fsg ? fsg->common->alt : 0;
+}
+
 static void fsg_disable(struct usb_function *f)
 {
 	struct fsg_dev *fsg = fsg_from_func(f);
 	fsg->common->new_fsg = NULL;
+	fsg->common->new_alt = 0;
 	raise_exception(fsg->common, FSG_STATE_CONFIG_CHANGE);
 }
 
@@ -2375,6 +4634,9 @@ static void handle_exception(struct fsg_common *common)
 		}
 	}
 
+	/* Stop writing out data the host will have to resend anyway */
+	fsg_wb_abort(common);
+
 	/* Cancel all the pending transfers */
 	if (likely(common->fsg)) {
 		for (i = 0; i < common->fsg_num_buffers; ++i) {
@@ -2385,10 +4647,14 @@ static void handle_exception(struct fsg_common *common)
 				usb_ep_dequeue(common->fsg->bulk_out,
 					       bh->outreq);
 		}
+		/* Command IUs stay queued, they belong to later commands */
+		if (common->uas_status_busy)
+			usb_ep_dequeue(common->fsg->status_in,
+				       common->uas_status_req);
 
 		/* Wait until everything is idle */
 		for (;;) {
-			int num_active = 0;
+			int num_active = common->uas_status_busy;
 			for (i = 0; i < common->fsg_num_buffers; ++i) {
 				bh = &common->buffhds[i];
 				num_active += bh->inreq_busy + bh->outreq_busy;
@@ -2416,8 +4682,17 @@ static void handle_exception(struct fsg_common *common)
 		bh = &common->buffhds[i];
 		bh->state = BUF_STATE_EMPTY;
 	}
-	common->next_buffhd_to_fill = &common->buffhds[0];
-	common->next_buffhd_to_drain = &common->buffhds[0];
+	spin_unlock_irq(&common->lock);
+
+	for (i = 0; i < common->fsg_num_buffers; ++i)
+		fsg_bh_put_pages(&common->buffhds[i]);
+
+	spin_lock_irq(&common->lock);
+	/* A parked ring is just the buffer they already point to */
+	if (!common->parked) {
+		common->next_buffhd_to_fill = &common->buffhds[0];
+		common->next_buffhd_to_drain = &common->buffhds[0];
+	}
 	exception_req_tag = common->exception_req_tag;
 	old_state = common->state;
 
@@ -2501,6 +4776,205 @@ static void handle_exception(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+static struct fsg_buffhd *fsg_alloc_buffers(struct fsg_common *common,
+					    unsigned int n, unsigned int buflen);
+static void _fsg_common_free_buffers(struct fsg_buffhd *buffhds, unsigned n);
+
+/*
+ * Swap in the ring asked for by fsg_common_resize_buffers(), between two
+ * commands: once the last transfers have completed no buffer is in use
+ * and the new ring, with its requests, simply replaces the old one.  If
+ * it can't be allocated the old ring stays.
+ */
+static void fsg_common_apply_resize(struct fsg_common *common)
+{
+	struct fsg_dev		*fsg = common->fsg;
+	struct fsg_buffhd	*buffhds, *old = common->buffhds;
+	unsigned int		n, buflen, old_n = common->fsg_num_buffers;
+	unsigned int		i;
+
+	/* Let the status of the last command go out */
+	for (i = 0; i < old_n; ++i) {
+		while (old[i].inreq_busy || old[i].outreq_busy) {
+			if (sleep_thread(common, true))
+				return;		/* Retried after the exception */
+		}
+	}
+
+	spin_lock_irq(&common->lock);
+	n = common->resize_num_buffers;
+	buflen = common->resize_buflen;
+	common->resize_num_buffers = 0;
+	spin_unlock_irq(&common->lock);
+
+	buffhds = fsg_alloc_buffers(common, n, buflen);
+	if (!buffhds)
+		goto fail;
+	if (fsg && fsg_alloc_requests(common, fsg, buffhds, n)) {
+		fsg_free_requests(fsg, buffhds, n);
+		_fsg_common_free_buffers(buffhds, n);
+		goto fail;
+	}
+	if (fsg)
+		fsg_free_requests(fsg, old, old_n);
+
+	spin_lock_irq(&common->lock);
+	common->buffhds = buffhds;
+	common->fsg_num_buffers = n;
+	common->buflen = buflen;
+	common->next_buffhd_to_fill = &buffhds[0];
+	common->next_buffhd_to_drain = &buffhds[0];
+	spin_unlock_irq(&common->lock);
+	common->parked = false;
+
+	_fsg_common_free_buffers(old, old_n);
+	DBG(common, "%u buffers of %u bytes\n", n, buflen);
+	return;
+
+fail:
+	WARNING(common, "can't allocate %u buffers of %u bytes\n", n, buflen);
+}
+
+#define FSG_TUNE_WINDOW		64	/* Commands per decision */
+#define FSG_TUNE_HOLD		16	/* Windows to stay after a revert */
+#define FSG_TUNE_WAIT_LOW	10	/* % of the time: file I/O bound */
+#define FSG_TUNE_WAIT_HIGH	50	/* % of the time: host bound */
+
+static void fsg_tune_begin(struct fsg_common *common)
+{
+	struct fsg_autotune	*t = &common->tune;
+
+	t->cmd_start = 0;
+	t->cmd_wait = 0;
+	if (!t->enabled) {
+		t->cmds = 0;
+		t->step = 0;
+		t->hold = 0;
+		return;
+	}
+
+	switch (common->cmnd[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		t->cmd_start = ktime_get_ns();
+		break;
+	}
+}
+
+/*
+ * A window is over: keep or undo the last change and pick the next one.
+ * The thread waiting for buffers most of the time means the host sets
+ * the pace and a buffer can go; it hardly ever waiting means it is busy
+ * with the backing file, and more buffers in flight may help.  Every
+ * change is checked against the throughput of the window after it, so
+ * that the ring stops growing at the knee.
+ */
+static void fsg_tune_window(struct fsg_common *common)
+{
+	struct fsg_autotune	*t = &common->tune;
+	unsigned int		n = common->fsg_num_buffers, want = n;
+	unsigned int		wait_pct;
+	int			step = 0;
+	u64			rate;
+	const char		*what;
+
+	wait_pct = div64_u64(t->wait * 100, t->busy);
+	rate = div64_u64(t->bytes * 1000,
+			 max_t(u64, div_u64(t->busy, NSEC_PER_USEC), 1));
+
+	spin_lock_irq(&common->lock);
+	if (common->resize_num_buffers || (t->step && n != t->depth)) {
+		/* The ring was resized behind our back, or could not be */
+		t->step = 0;
+		what = "skip";
+	} else if (n < t->min || n > t->max) {
+		want = clamp(n, t->min, t->max);
+		t->step = 0;
+		what = "bounds";
+	} else if (t->step > 0 && rate < t->base_rate + t->base_rate / 32) {
+		want = n - t->step;
+		t->step = 0;
+		t->hold = FSG_TUNE_HOLD;
+		++t->reverted;
+		what = "revert grow";
+	} else if (t->step < 0 && rate + t->base_rate / 16 < t->base_rate) {
+		want = n - t->step;
+		t->step = 0;
+		t->hold = FSG_TUNE_HOLD;
+		++t->reverted;
+		what = "revert shrink";
+	} else if (t->hold) {
+		--t->hold;
+		t->step = 0;
+		what = "hold";
+	} else if (wait_pct >= FSG_TUNE_WAIT_HIGH && n > t->min) {
+		want = n - 1;
+		step = -1;
+		++t->shrunk;
+		what = "shrink";
+	} else if (wait_pct <= FSG_TUNE_WAIT_LOW && n < t->max) {
+		want = min(n + DIV_ROUND_UP(n, 4), t->max);
+		step = want - n;
+		++t->grown;
+		what = "grow";
+	} else {
+		t->step = 0;
+		what = "keep";
+	}
+
+	if (step) {
+		t->step = step;
+		t->base_rate = rate;
+	}
+	if (want != n) {
+		t->depth = want;
+		common->resize_num_buffers = want;
+		common->resize_buflen = common->buflen;
+	}
+	++t->windows;
+	t->wait_pct = wait_pct;
+	t->rate = rate;
+	t->last = what;
+	spin_unlock_irq(&common->lock);
+
+	VDBG(common, "autotune: %u buffers, wait %u%%, %llu kB/s: %s\n",
+	     n, wait_pct, (unsigned long long)rate, what);
+}
+
+static void fsg_tune_end(struct fsg_common *common)
+{
+	struct fsg_autotune	*t = &common->tune;
+	u64			busy;
+	u32			moved;
+
+	if (!t->cmd_start)
+		return;
+	busy = ktime_get_ns() - t->cmd_start;
+	t->cmd_start = 0;
+	moved = common->data_size - common->residue;
+	if (!moved || !busy)
+		return;
+
+	if (!t->cmds) {
+		t->busy = 0;
+		t->wait = 0;
+		t->bytes = 0;
+	}
+	t->busy += busy;
+	t->wait += min(t->cmd_wait, busy);
+	t->bytes += moved;
+	if (++t->cmds == FSG_TUNE_WINDOW) {
+		fsg_tune_window(common);
+		t->cmds = 0;
+	}
+}
+
 static int fsg_main_thread(void *common_)
 {
 	struct fsg_common	*common = common_;
@@ -2525,6 +4999,13 @@ static int fsg_main_thread(void *common_)
 	 */
 	set_fs(get_ds());
 
+	common->shrinker.count_objects = fsg_shrink_count;
+	common->shrinker.scan_objects = fsg_shrink_scan;
+	common->shrinker.seeks = DEFAULT_SEEKS;
+	common->shrinker_registered = !register_shrinker(&common->shrinker);
+	if (!common->shrinker_registered)
+		WARNING(common, "can't register shrinker\n");
+
 	/* The main loop */
 	while (common->state != FSG_STATE_TERMINATED) {
 		if (exception_in_progress(common) || signal_pending(current)) {
@@ -2532,21 +5013,29 @@ static int fsg_main_thread(void *common_)
 			continue;
 		}
 
+		if (common->resize_num_buffers) {
+			fsg_common_apply_resize(common);
+			continue;
+		}
+
 		if (!common->running) {
-			sleep_thread(common, true);
+			sleep_thread_idle(common);
 			continue;
 		}
 
 		if (get_next_command(common))
 			continue;
+		fsg_idle_end(common);
 
 		spin_lock_irq(&common->lock);
 		if (!exception_in_progress(common))
 			common->state = FSG_STATE_DATA_PHASE;
 		spin_unlock_irq(&common->lock);
 
+		fsg_tune_begin(common);
 		if (do_scsi_command(common) || finish_reply(common))
 			continue;
+		fsg_tune_end(common);
 
 		spin_lock_irq(&common->lock);
 		if (!exception_in_progress(common))
@@ -2564,8 +5053,15 @@ static int fsg_main_thread(void *common_)
 
 	spin_lock_irq(&common->lock);
 	common->thread_task = NULL;
+	common->idle = false;
 	spin_unlock_irq(&common->lock);
 
+	if (common->shrinker_registered) {
+		unregister_shrinker(&common->shrinker);
+		common->shrinker_registered = false;
+	}
+	del_timer_sync(&common->idle_timer);
+
 	/* Eject media from all LUNs */
 
 	down_write(&common->filesem);
@@ -2634,7 +5130,55 @@ static ssize_t file_store(struct device *dev, struct device_attribute *attr,
 	return fsg_store_file(curlun, filesem, buf, count);
 }
 
+static ssize_t readahead_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+
+	return fsg_show_readahead(curlun, buf);
+}
+
+static ssize_t readahead_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+
+	return fsg_store_readahead(curlun, filesem, buf, count);
+}
+
+static ssize_t readahead_stats_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+
+	return fsg_show_readahead_stats(curlun, buf);
+}
+
+static ssize_t backend_stats_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+
+	return fsg_show_backend_stats(curlun, filesem, buf);
+}
+
+static ssize_t cache_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun		*curlun = fsg_lun_from_dev(dev);
+	struct rw_semaphore	*filesem = dev_get_drvdata(dev);
+
+	return fsg_show_cache_stats(curlun, filesem, buf);
+}
+
 static DEVICE_ATTR_RW(nofua);
+static DEVICE_ATTR_RW(readahead);
+static DEVICE_ATTR_RO(readahead_stats);
+static DEVICE_ATTR_RO(backend_stats);
+static DEVICE_ATTR_RO(cache_stats);
 /* mode wil be set in fsg_lun_attr_is_visible() */
 static DEVICE_ATTR(ro, 0, ro_show, ro_store);
 static DEVICE_ATTR(file, 0, file_show, file_store);
@@ -2672,6 +5216,17 @@ static inline int fsg_num_buffers_validate(unsigned int fsg_num_buffers)
 	return -EINVAL;
 }
 
+/* check if buflen is within a valid range */
+static inline int fsg_buflen_validate(unsigned int buflen)
+{
+	if (buflen >= FSG_MIN_BUFLEN && buflen <= FSG_MAX_BUFLEN &&
+	    IS_ALIGNED(buflen, FSG_MIN_BUFLEN))
+		return 0;
+	pr_err("buflen %u is out of range (%u to %u, multiple of %u)\n",
+	       buflen, FSG_MIN_BUFLEN, FSG_MAX_BUFLEN, FSG_MIN_BUFLEN);
+	return -EINVAL;
+}
+
 static struct fsg_common *fsg_common_setup(struct fsg_common *common)
 {
 	if (!common) {
@@ -2687,7 +5242,22 @@ static struct fsg_common *fsg_common_setup(struct fsg_common *common)
 	kref_init(&common->ref);
 	init_completion(&common->thread_notifier);
 	init_waitqueue_head(&common->fsg_wait);
+	setup_timer(&common->idle_timer, fsg_idle_timer,
+		    (unsigned long)common);
+	INIT_LIST_HEAD(&common->wb_queue);
+	INIT_WORK(&common->wb_work, fsg_wb_work);
+	INIT_LIST_HEAD(&common->uas_cmd_queue);
+	common->wb_wq = alloc_ordered_workqueue("file-storage-wb",
+						WQ_MEM_RECLAIM);
+	if (!common->wb_wq) {
+		if (common->free_storage_on_release)
+			kfree(common);
+		return ERR_PTR(-ENOMEM);
+	}
 	common->state = FSG_STATE_TERMINATED;
+	common->buflen = FSG_BUFLEN;
+	common->tune.min = 2;
+	common->tune.max = FSG_MAX_NUM_BUFFERS;
 	memset(common->luns, 0, sizeof(common->luns));
 
 	return common;
@@ -2704,25 +5274,32 @@ static void _fsg_common_free_buffers(struct fsg_buffhd *buffhds, unsigned n)
 	if (buffhds) {
 		struct fsg_buffhd *bh = buffhds;
 		while (n--) {
-			kfree(bh->buf);
+			fsg_bh_put_pages(bh);
+			kfree(bh->bvec);
+			kfree(bh->fsdata);
+			kfree(bh->pages);
+			kfree(bh->sg);
+			if (bh->buf)
+				free_pages_exact(bh->buf, bh->buflen);
 			++bh;
 		}
 		kfree(buffhds);
 	}
 }
 
-int fsg_common_set_num_buffers(struct fsg_common *common, unsigned int n)
+static struct fsg_buffhd *fsg_alloc_buffers(struct fsg_common *common,
+					    unsigned int n, unsigned int buflen)
 {
 	struct fsg_buffhd *bh, *buffhds;
-	int i, rc;
-
-	rc = fsg_num_buffers_validate(n);
-	if (rc != 0)
-		return rc;
+	unsigned int nents;
+	int i;
 
 	buffhds = kcalloc(n, sizeof(*buffhds), GFP_KERNEL);
 	if (!buffhds)
-		return -ENOMEM;
+		return NULL;
+
+	/* Pages a buffer's worth of data can span when read zero-copy */
+	nents = buflen / PAGE_SIZE + 1;
 
 	/* Data buffers cyclic list */
 	bh = buffhds;
@@ -2732,17 +5309,21 @@ int fsg_common_set_num_buffers(struct fsg_common *common, unsigned int n)
 		bh->next = bh + 1;
 		++bh;
 buffhds_first_it:
-		bh->buf = kmalloc(FSG_BUFLEN, GFP_KERNEL);
-		if (unlikely(!bh->buf))
+		INIT_LIST_HEAD(&bh->wb_list);
+		bh->common = common;
+		/* Page aligned, so O_DIRECT can use it as it is */
+		bh->buf = alloc_pages_exact(buflen, GFP_KERNEL);
+		bh->buflen = buflen;
+		bh->sg = kcalloc(nents, sizeof(*bh->sg), GFP_KERNEL);
+		bh->pages = kcalloc(nents, sizeof(*bh->pages), GFP_KERNEL);
+		bh->fsdata = kcalloc(nents, sizeof(*bh->fsdata), GFP_KERNEL);
+		bh->bvec = kcalloc(nents, sizeof(*bh->bvec), GFP_KERNEL);
+		if (unlikely(!bh->buf || !bh->sg || !bh->pages || !bh->fsdata ||
+			     !bh->bvec))
 			goto error_release;
 	} while (--i);
 	bh->next = buffhds;
-
-	_fsg_common_free_buffers(common->buffhds, common->fsg_num_buffers);
-	common->fsg_num_buffers = n;
-	common->buffhds = buffhds;
-
-	return 0;
+	return buffhds;
 
 error_release:
 	/*
@@ -2750,16 +5331,148 @@ error_release:
 	 * so releasing them won't hurt
 	 */
 	_fsg_common_free_buffers(buffhds, n);
+	return NULL;
+}
 
-	return -ENOMEM;
+int fsg_common_set_num_buffers(struct fsg_common *common, unsigned int n)
+{
+	struct fsg_buffhd *buffhds;
+	int rc;
+
+	rc = fsg_num_buffers_validate(n);
+	if (rc != 0)
+		return rc;
+
+	buffhds = fsg_alloc_buffers(common, n, common->buflen);
+	if (!buffhds)
+		return -ENOMEM;
+
+	_fsg_common_free_buffers(common->buffhds, common->fsg_num_buffers);
+	common->fsg_num_buffers = n;
+	common->buffhds = buffhds;
+	common->parked = false;
+
+	return 0;
 }
 EXPORT_SYMBOL_GPL(fsg_common_set_num_buffers);
 
+int fsg_common_set_buflen(struct fsg_common *common, unsigned int buflen)
+{
+	unsigned int old = common->buflen;
+	int rc;
+
+	rc = fsg_buflen_validate(buflen);
+	if (rc != 0)
+		return rc;
+
+	if (buflen == old)
+		return 0;
+	common->buflen = buflen;
+	if (!common->buffhds)
+		return 0;
+
+	/* Reallocate the existing buffers with the new size */
+	rc = fsg_common_set_num_buffers(common, common->fsg_num_buffers);
+	if (rc)
+		common->buflen = old;
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_buflen);
+
+/*
+ * Same as fsg_common_set_num_buffers() and fsg_common_set_buflen() at
+ * once, for a function which may be bound: the thread switches to the
+ * new ring between two commands.  0 keeps the current (or already
+ * requested) value.
+ */
+int fsg_common_resize_buffers(struct fsg_common *common, unsigned int n,
+			      unsigned int buflen)
+{
+	int rc;
+
+	spin_lock_irq(&common->lock);
+	if (!common->thread_task) {
+		spin_unlock_irq(&common->lock);
+		rc = buflen ? fsg_common_set_buflen(common, buflen) : 0;
+		if (!rc && n)
+			rc = fsg_common_set_num_buffers(common, n);
+		return rc;
+	}
+
+	if (!n)
+		n = common->resize_num_buffers ?: common->fsg_num_buffers;
+	if (!buflen)
+		buflen = common->resize_num_buffers ?
+			common->resize_buflen : common->buflen;
+	rc = fsg_num_buffers_validate(n) ?: fsg_buflen_validate(buflen);
+	if (!rc) {
+		common->resize_num_buffers = n;
+		common->resize_buflen = buflen;
+		wakeup_thread(common);
+	}
+	spin_unlock_irq(&common->lock);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_common_resize_buffers);
+
+/* Takes effect at the next bind; alternate setting 1 then offers UAS */
+void fsg_common_set_uas(struct fsg_common *common, bool uas)
+{
+	common->uas_capable = uas;
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_uas);
+
+/* Takes effect the next time the interface is enabled */
+void fsg_common_set_premap(struct fsg_common *common, bool premap)
+{
+	common->premap = premap;
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_premap);
+
+void fsg_common_set_autotune(struct fsg_common *common, bool autotune)
+{
+	spin_lock_irq(&common->lock);
+	common->tune.enabled = autotune;
+	spin_unlock_irq(&common->lock);
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_autotune);
+
+/* The auto-tuner keeps fsg_num_buffers within min..max */
+int fsg_common_set_autotune_bounds(struct fsg_common *common,
+				   unsigned int min, unsigned int max)
+{
+	int	rc;
+
+	rc = fsg_num_buffers_validate(min) ?: fsg_num_buffers_validate(max);
+	if (rc)
+		return rc;
+	if (min > max)
+		return -EINVAL;
+
+	spin_lock_irq(&common->lock);
+	common->tune.min = min;
+	common->tune.max = max;
+	spin_unlock_irq(&common->lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_autotune_bounds);
+
+/* Release the buffers after ms of waiting for a command, 0 for never */
+void fsg_common_set_idle_timeout(struct fsg_common *common, unsigned int ms)
+{
+	spin_lock_irq(&common->lock);
+	common->idle_timeout = ms;
+	spin_unlock_irq(&common->lock);
+}
+EXPORT_SYMBOL_GPL(fsg_common_set_idle_timeout);
+
 void fsg_common_remove_lun(struct fsg_lun *lun)
 {
 	if (device_is_registered(&lun->dev))
 		device_unregister(&lun->dev);
 	fsg_lun_close(lun);
+	kfree(lun->base);
+	kfree(lun->cache_file);
 	kfree(lun);
 }
 EXPORT_SYMBOL_GPL(fsg_common_remove_lun);
@@ -2821,6 +5534,10 @@ static struct attribute *fsg_lun_dev_attrs[] = {
 	&dev_attr_ro.attr,
 	&dev_attr_file.attr,
 	&dev_attr_nofua.attr,
+	&dev_attr_readahead.attr,
+	&dev_attr_readahead_stats.attr,
+	&dev_attr_backend_stats.attr,
+	&dev_attr_cache_stats.attr,
 	NULL
 };
 
@@ -2876,6 +5593,7 @@ int fsg_common_create_lun(struct fsg_common *common, struct fsg_lun_config *cfg,
 	lun->ro = cfg->cdrom || cfg->ro;
 	lun->initially_ro = lun->ro;
 	lun->removable = !!cfg->removable;
+	lun->direct = !!cfg->direct;
 
 	if (!common->sysfs) {
 		/* we DON'T own the name!*/
@@ -2908,7 +5626,9 @@ int fsg_common_create_lun(struct fsg_common *common, struct fsg_lun_config *cfg,
 	p = "(no medium)";
 	if (fsg_lun_is_open(lun)) {
 		p = "(error)";
-		if (pathbuf) {
+		if (!lun->filp) {
+			p = (char *)cfg->filename;
+		} else if (pathbuf) {
 			p = file_path(lun->filp, pathbuf, PATH_MAX);
 			if (IS_ERR(p))
 				p = "(error)";
@@ -2998,6 +5718,7 @@ static void fsg_common_release(struct kref *ref)
 	}
 
 	_fsg_common_free_buffers(common->buffhds, common->fsg_num_buffers);
+	destroy_workqueue(common->wb_wq);
 	if (common->free_storage_on_release)
 		kfree(common);
 }
@@ -3005,6 +5726,47 @@ static void fsg_common_release(struct kref *ref)
 
 /*-------------------------------------------------------------------------*/
 
+/* Find the UAS command and status endpoints and set up their descriptors */
+static int fsg_uas_bind(struct fsg_dev *fsg, struct usb_gadget *gadget,
+			unsigned max_burst)
+{
+	struct usb_ep	*ep;
+	unsigned	streams = 0;
+
+	ep = usb_ep_autoconfig(gadget, &fsg_fs_uas_cmd_desc);
+	if (!ep)
+		return -ENOTSUPP;
+	fsg->cmd_out = ep;
+
+	ep = usb_ep_autoconfig(gadget, &fsg_fs_uas_status_desc);
+	if (!ep)
+		return -ENOTSUPP;
+	fsg->status_in = ep;
+
+	fsg_hs_uas_cmd_desc.bEndpointAddress =
+		fsg_fs_uas_cmd_desc.bEndpointAddress;
+	fsg_ss_uas_cmd_desc.bEndpointAddress =
+		fsg_fs_uas_cmd_desc.bEndpointAddress;
+	fsg_hs_uas_status_desc.bEndpointAddress =
+		fsg_fs_uas_status_desc.bEndpointAddress;
+	fsg_ss_uas_status_desc.bEndpointAddress =
+		fsg_fs_uas_status_desc.bEndpointAddress;
+
+	/* Streams need all three endpoints that carry per-command traffic */
+	if (gadget_is_superspeed(gadget)) {
+		streams = min_t(unsigned, FSG_UAS_LOG_STREAMS,
+				fsg->bulk_in->max_streams);
+		streams = min_t(unsigned, streams, fsg->bulk_out->max_streams);
+		streams = min_t(unsigned, streams, fsg->status_in->max_streams);
+	}
+	fsg_ss_uas_status_comp_desc.bmAttributes = streams;
+	fsg_ss_uas_bulk_in_comp_desc.bmAttributes = streams;
+	fsg_ss_uas_bulk_out_comp_desc.bmAttributes = streams;
+	fsg_ss_uas_bulk_in_comp_desc.bMaxBurst = max_burst;
+	fsg_ss_uas_bulk_out_comp_desc.bMaxBurst = max_burst;
+	return 0;
+}
+
 static int fsg_bind(struct usb_configuration *c, struct usb_function *f)
 {
 	struct fsg_dev		*fsg = fsg_from_func(f);
@@ -3054,6 +5816,7 @@ static int fsg_bind(struct usb_configuration *c, struct usb_function *f)
 	if (i < 0)
 		goto fail;
 	fsg_intf_desc.bInterfaceNumber = i;
+	fsg_uas_intf_desc.bInterfaceNumber = i;
 	fsg->interface_number = i;
 
 	/* Find all the endpoints we will use */
@@ -3074,7 +5837,7 @@ static int fsg_bind(struct usb_configuration *c, struct usb_function *f)
 		fsg_fs_bulk_out_desc.bEndpointAddress;
 
 	/* Calculate bMaxBurst, we know packet size is 1024 */
-	max_burst = min_t(unsigned, FSG_BUFLEN / 1024, 15);
+	max_burst = min_t(unsigned, common->buflen / 1024, 15);
 
 	fsg_ss_bulk_in_desc.bEndpointAddress =
 		fsg_fs_bulk_in_desc.bEndpointAddress;
@@ -3084,8 +5847,16 @@ static int fsg_bind(struct usb_configuration *c, struct usb_function *f)
 		fsg_fs_bulk_out_desc.bEndpointAddress;
 	fsg_ss_bulk_out_comp_desc.bMaxBurst = max_burst;
 
-	ret = usb_assign_descriptors(f, fsg_fs_function, fsg_hs_function,
-			fsg_ss_function);
+	if (common->uas_capable) {
+		ret = fsg_uas_bind(fsg, gadget, max_burst);
+		if (ret)
+			goto autoconf_fail;
+		ret = usb_assign_descriptors(f, fsg_fs_uas_function,
+				fsg_hs_uas_function, fsg_ss_uas_function);
+	} else {
+		ret = usb_assign_descriptors(f, fsg_fs_function,
+				fsg_hs_function, fsg_ss_function);
+	}
 	if (ret)
 		goto autoconf_fail;
 
@@ -3158,70 +5929,317 @@ static ssize_t fsg_lun_opts_file_store(struct config_item *item,
 	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
 	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
 
-	return fsg_store_file(opts->lun, &fsg_opts->common->filesem, page, len);
+	return fsg_store_file(opts->lun, &fsg_opts->common->filesem, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, file);
+
+static ssize_t fsg_lun_opts_ro_show(struct config_item *item, char *page)
+{
+	return fsg_show_ro(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_ro_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_ro(opts->lun, &fsg_opts->common->filesem, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, ro);
+
+static ssize_t fsg_lun_opts_removable_show(struct config_item *item,
+					   char *page)
+{
+	return fsg_show_removable(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_removable_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	return fsg_store_removable(to_fsg_lun_opts(item)->lun, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, removable);
+
+static ssize_t fsg_lun_opts_cdrom_show(struct config_item *item, char *page)
+{
+	return fsg_show_cdrom(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_cdrom_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_cdrom(opts->lun, &fsg_opts->common->filesem, page,
+			       len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, cdrom);
+
+static ssize_t fsg_lun_opts_nofua_show(struct config_item *item, char *page)
+{
+	return fsg_show_nofua(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_nofua_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	return fsg_store_nofua(to_fsg_lun_opts(item)->lun, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, nofua);
+
+static ssize_t fsg_lun_opts_readahead_show(struct config_item *item,
+					   char *page)
+{
+	return fsg_show_readahead(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_readahead_store(struct config_item *item,
+					    const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_readahead(opts->lun, &fsg_opts->common->filesem,
+				   page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, readahead);
+
+static ssize_t fsg_lun_opts_readahead_stats_show(struct config_item *item,
+						 char *page)
+{
+	return fsg_show_readahead_stats(to_fsg_lun_opts(item)->lun, page);
+}
+
+CONFIGFS_ATTR_RO(fsg_lun_opts_, readahead_stats);
+
+static ssize_t fsg_lun_opts_zero_copy_show(struct config_item *item,
+					   char *page)
+{
+	return fsg_show_zero_copy(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_zero_copy_store(struct config_item *item,
+					    const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_zero_copy(opts->lun, &fsg_opts->common->filesem,
+				   page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, zero_copy);
+
+static ssize_t fsg_lun_opts_direct_show(struct config_item *item, char *page)
+{
+	return fsg_show_direct(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_direct_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_direct(opts->lun, &fsg_opts->common->filesem, page,
+				len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, direct);
+
+static ssize_t fsg_lun_opts_bio_show(struct config_item *item, char *page)
+{
+	return fsg_show_bio(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_bio_store(struct config_item *item,
+				      const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_bio(opts->lun, &fsg_opts->common->filesem, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, bio);
+
+static ssize_t fsg_lun_opts_zero_copy_write_show(struct config_item *item,
+						 char *page)
+{
+	return fsg_show_zero_copy_write(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_zero_copy_write_store(struct config_item *item,
+						  const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_zero_copy_write(opts->lun, &fsg_opts->common->filesem,
+					 page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, zero_copy_write);
+
+static ssize_t fsg_lun_opts_wb_depth_show(struct config_item *item,
+					  char *page)
+{
+	return fsg_show_wb_depth(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_wb_depth_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_wb_depth(opts->lun, &fsg_opts->common->filesem,
+				  page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, wb_depth);
+
+static ssize_t fsg_lun_opts_wb_dirty_show(struct config_item *item,
+					  char *page)
+{
+	return fsg_show_wb_dirty(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_wb_dirty_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_wb_dirty(opts->lun, &fsg_opts->common->filesem,
+				  page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, wb_dirty);
+
+static ssize_t fsg_lun_opts_base_show(struct config_item *item, char *page)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_show_base(opts->lun, &fsg_opts->common->filesem, page);
+}
+
+static ssize_t fsg_lun_opts_base_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_base(opts->lun, &fsg_opts->common->filesem, page, len);
+}
+
+CONFIGFS_ATTR(fsg_lun_opts_, base);
+
+static ssize_t fsg_lun_opts_offset_show(struct config_item *item, char *page)
+{
+	return fsg_show_offset(to_fsg_lun_opts(item)->lun, page);
+}
+
+static ssize_t fsg_lun_opts_offset_store(struct config_item *item,
+					 const char *page, size_t len)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_offset(opts->lun, &fsg_opts->common->filesem,
+				page, len);
 }
 
-CONFIGFS_ATTR(fsg_lun_opts_, file);
+CONFIGFS_ATTR(fsg_lun_opts_, offset);
 
-static ssize_t fsg_lun_opts_ro_show(struct config_item *item, char *page)
+static ssize_t fsg_lun_opts_size_show(struct config_item *item, char *page)
 {
-	return fsg_show_ro(to_fsg_lun_opts(item)->lun, page);
+	return fsg_show_size(to_fsg_lun_opts(item)->lun, page);
 }
 
-static ssize_t fsg_lun_opts_ro_store(struct config_item *item,
+static ssize_t fsg_lun_opts_size_store(struct config_item *item,
 				       const char *page, size_t len)
 {
 	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
 	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
 
-	return fsg_store_ro(opts->lun, &fsg_opts->common->filesem, page, len);
+	return fsg_store_size(opts->lun, &fsg_opts->common->filesem, page, len);
 }
 
-CONFIGFS_ATTR(fsg_lun_opts_, ro);
+CONFIGFS_ATTR(fsg_lun_opts_, size);
 
-static ssize_t fsg_lun_opts_removable_show(struct config_item *item,
-					   char *page)
+static ssize_t fsg_lun_opts_backend_stats_show(struct config_item *item,
+					       char *page)
 {
-	return fsg_show_removable(to_fsg_lun_opts(item)->lun, page);
-}
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
 
-static ssize_t fsg_lun_opts_removable_store(struct config_item *item,
-				       const char *page, size_t len)
-{
-	return fsg_store_removable(to_fsg_lun_opts(item)->lun, page, len);
+	return fsg_show_backend_stats(opts->lun, &fsg_opts->common->filesem,
+				      page);
 }
 
-CONFIGFS_ATTR(fsg_lun_opts_, removable);
+CONFIGFS_ATTR_RO(fsg_lun_opts_, backend_stats);
 
-static ssize_t fsg_lun_opts_cdrom_show(struct config_item *item, char *page)
+static ssize_t fsg_lun_opts_cache_size_show(struct config_item *item,
+					    char *page)
 {
-	return fsg_show_cdrom(to_fsg_lun_opts(item)->lun, page);
+	return fsg_show_cache_size(to_fsg_lun_opts(item)->lun, page);
 }
 
-static ssize_t fsg_lun_opts_cdrom_store(struct config_item *item,
-				       const char *page, size_t len)
+static ssize_t fsg_lun_opts_cache_size_store(struct config_item *item,
+					     const char *page, size_t len)
 {
 	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
 	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
 
-	return fsg_store_cdrom(opts->lun, &fsg_opts->common->filesem, page,
-			       len);
+	return fsg_store_cache_size(opts->lun, &fsg_opts->common->filesem,
+				    page, len);
 }
 
-CONFIGFS_ATTR(fsg_lun_opts_, cdrom);
+CONFIGFS_ATTR(fsg_lun_opts_, cache_size);
 
-static ssize_t fsg_lun_opts_nofua_show(struct config_item *item, char *page)
+static ssize_t fsg_lun_opts_cache_file_show(struct config_item *item,
+					    char *page)
 {
-	return fsg_show_nofua(to_fsg_lun_opts(item)->lun, page);
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_show_cache_file(opts->lun, &fsg_opts->common->filesem,
+				   page);
 }
 
-static ssize_t fsg_lun_opts_nofua_store(struct config_item *item,
-				       const char *page, size_t len)
+static ssize_t fsg_lun_opts_cache_file_store(struct config_item *item,
+					     const char *page, size_t len)
 {
-	return fsg_store_nofua(to_fsg_lun_opts(item)->lun, page, len);
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_store_cache_file(opts->lun, &fsg_opts->common->filesem,
+				    page, len);
 }
 
-CONFIGFS_ATTR(fsg_lun_opts_, nofua);
+CONFIGFS_ATTR(fsg_lun_opts_, cache_file);
+
+static ssize_t fsg_lun_opts_cache_stats_show(struct config_item *item,
+					     char *page)
+{
+	struct fsg_lun_opts *opts = to_fsg_lun_opts(item);
+	struct fsg_opts *fsg_opts = to_fsg_opts(opts->group.cg_item.ci_parent);
+
+	return fsg_show_cache_stats(opts->lun, &fsg_opts->common->filesem,
+				    page);
+}
+
+CONFIGFS_ATTR_RO(fsg_lun_opts_, cache_stats);
 
 static struct configfs_attribute *fsg_lun_attrs[] = {
 	&fsg_lun_opts_attr_file,
@@ -3229,6 +6247,21 @@ static struct configfs_attribute *fsg_lun_attrs[] = {
 	&fsg_lun_opts_attr_removable,
 	&fsg_lun_opts_attr_cdrom,
 	&fsg_lun_opts_attr_nofua,
+	&fsg_lun_opts_attr_readahead,
+	&fsg_lun_opts_attr_readahead_stats,
+	&fsg_lun_opts_attr_zero_copy,
+	&fsg_lun_opts_attr_zero_copy_write,
+	&fsg_lun_opts_attr_direct,
+	&fsg_lun_opts_attr_bio,
+	&fsg_lun_opts_attr_wb_depth,
+	&fsg_lun_opts_attr_wb_dirty,
+	&fsg_lun_opts_attr_base,
+	&fsg_lun_opts_attr_offset,
+	&fsg_lun_opts_attr_size,
+	&fsg_lun_opts_attr_backend_stats,
+	&fsg_lun_opts_attr_cache_size,
+	&fsg_lun_opts_attr_cache_file,
+	&fsg_lun_opts_attr_cache_stats,
 	NULL,
 };
 
@@ -3391,10 +6424,6 @@ static ssize_t fsg_opts_num_buffers_store(struct config_item *item,
 	u8 num;
 
 	mutex_lock(&opts->lock);
-	if (opts->refcnt) {
-		ret = -EBUSY;
-		goto end;
-	}
 	ret = kstrtou8(page, 0, &num);
 	if (ret)
 		goto end;
@@ -3403,7 +6432,11 @@ static ssize_t fsg_opts_num_buffers_store(struct config_item *item,
 	if (ret)
 		goto end;
 
-	fsg_common_set_num_buffers(opts->common, num);
+	/* A bound function switches rings between two commands */
+	ret = fsg_common_resize_buffers(opts->common, num, 0);
+	if (ret)
+		goto end;
+
 	ret = len;
 
 end:
@@ -3414,11 +6447,302 @@ end:
 CONFIGFS_ATTR(fsg_opts_, num_buffers);
 #endif
 
+static ssize_t fsg_opts_buflen_show(struct config_item *item, char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%u", opts->common->buflen);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_buflen_store(struct config_item *item,
+				     const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	u32 buflen;
+
+	mutex_lock(&opts->lock);
+	ret = kstrtou32(page, 0, &buflen);
+	if (ret)
+		goto end;
+
+	ret = fsg_buflen_validate(buflen) ?:
+		fsg_common_resize_buffers(opts->common, 0, buflen);
+	if (ret)
+		goto end;
+
+	ret = len;
+
+end:
+	mutex_unlock(&opts->lock);
+	return ret;
+}
+
+CONFIGFS_ATTR(fsg_opts_, buflen);
+
+static ssize_t fsg_opts_uas_show(struct config_item *item, char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%d", opts->common->uas_capable);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_uas_store(struct config_item *item, const char *page,
+				  size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	bool uas;
+
+	mutex_lock(&opts->lock);
+
+	if (opts->refcnt) {
+		mutex_unlock(&opts->lock);
+		return -EBUSY;
+	}
+
+	ret = strtobool(page, &uas);
+	if (!ret) {
+		fsg_common_set_uas(opts->common, uas);
+		ret = len;
+	}
+
+	mutex_unlock(&opts->lock);
+
+	return ret;
+}
+
+CONFIGFS_ATTR(fsg_opts_, uas);
+
+static ssize_t fsg_opts_premap_show(struct config_item *item, char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%d", opts->common->premap);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_premap_store(struct config_item *item,
+				     const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	bool premap;
+
+	mutex_lock(&opts->lock);
+
+	if (opts->refcnt) {
+		mutex_unlock(&opts->lock);
+		return -EBUSY;
+	}
+
+	ret = strtobool(page, &premap);
+	if (!ret) {
+		fsg_common_set_premap(opts->common, premap);
+		ret = len;
+	}
+
+	mutex_unlock(&opts->lock);
+
+	return ret;
+}
+
+CONFIGFS_ATTR(fsg_opts_, premap);
+
+static ssize_t fsg_opts_autotune_show(struct config_item *item, char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%d", opts->common->tune.enabled);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_autotune_store(struct config_item *item,
+				       const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	bool autotune;
+
+	mutex_lock(&opts->lock);
+	ret = strtobool(page, &autotune);
+	if (!ret) {
+		fsg_common_set_autotune(opts->common, autotune);
+		ret = len;
+	}
+	mutex_unlock(&opts->lock);
+
+	return ret;
+}
+
+CONFIGFS_ATTR(fsg_opts_, autotune);
+
+static ssize_t fsg_opts_autotune_min_show(struct config_item *item,
+					  char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%u", opts->common->tune.min);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_autotune_min_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	u8 num;
+
+	mutex_lock(&opts->lock);
+	ret = kstrtou8(page, 0, &num);
+	if (!ret)
+		ret = fsg_common_set_autotune_bounds(opts->common, num,
+						     opts->common->tune.max);
+	mutex_unlock(&opts->lock);
+
+	return ret ?: len;
+}
+
+CONFIGFS_ATTR(fsg_opts_, autotune_min);
+
+static ssize_t fsg_opts_autotune_max_show(struct config_item *item,
+					  char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%u", opts->common->tune.max);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_autotune_max_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	u8 num;
+
+	mutex_lock(&opts->lock);
+	ret = kstrtou8(page, 0, &num);
+	if (!ret)
+		ret = fsg_common_set_autotune_bounds(opts->common,
+						     opts->common->tune.min,
+						     num);
+	mutex_unlock(&opts->lock);
+
+	return ret ?: len;
+}
+
+CONFIGFS_ATTR(fsg_opts_, autotune_max);
+
+static ssize_t fsg_opts_autotune_stats_show(struct config_item *item,
+					    char *page)
+{
+	struct fsg_common *common = to_fsg_opts(item)->common;
+	struct fsg_autotune *t = &common->tune;
+	int result;
+
+	spin_lock_irq(&common->lock);
+	result = sprintf(page, "buffers %u windows %u grown %u shrunk %u reverted %u wait %u%% rate %llu kB/s last %s\n",
+			 common->fsg_num_buffers, t->windows, t->grown,
+			 t->shrunk, t->reverted, t->wait_pct,
+			 (unsigned long long)t->rate, t->last ?: "none");
+	spin_unlock_irq(&common->lock);
+
+	return result;
+}
+
+CONFIGFS_ATTR_RO(fsg_opts_, autotune_stats);
+
+static ssize_t fsg_opts_idle_timeout_show(struct config_item *item,
+					  char *page)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int result;
+
+	mutex_lock(&opts->lock);
+	result = sprintf(page, "%u", opts->common->idle_timeout);
+	mutex_unlock(&opts->lock);
+
+	return result;
+}
+
+static ssize_t fsg_opts_idle_timeout_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct fsg_opts *opts = to_fsg_opts(item);
+	int ret;
+	unsigned int ms;
+
+	mutex_lock(&opts->lock);
+	ret = kstrtouint(page, 0, &ms);
+	if (!ret) {
+		fsg_common_set_idle_timeout(opts->common, ms);
+		ret = len;
+	}
+	mutex_unlock(&opts->lock);
+
+	return ret;
+}
+
+CONFIGFS_ATTR(fsg_opts_, idle_timeout);
+
+static ssize_t fsg_opts_idle_stats_show(struct config_item *item, char *page)
+{
+	struct fsg_common *common = to_fsg_opts(item)->common;
+	int result;
+
+	spin_lock_irq(&common->lock);
+	result = sprintf(page, "parked %d parks %u unparks %u wake %llu us max %llu us\n",
+			 common->parked, common->parks, common->unparks,
+			 div_u64(common->unpark_ns, NSEC_PER_USEC),
+			 div_u64(common->unpark_max_ns, NSEC_PER_USEC));
+	spin_unlock_irq(&common->lock);
+
+	return result;
+}
+
+CONFIGFS_ATTR_RO(fsg_opts_, idle_stats);
+
 static struct configfs_attribute *fsg_attrs[] = {
 	&fsg_opts_attr_stall,
 #ifdef CONFIG_USB_GADGET_DEBUG_FILES
 	&fsg_opts_attr_num_buffers,
 #endif
+	&fsg_opts_attr_buflen,
+	&fsg_opts_attr_uas,
+	&fsg_opts_attr_premap,
+	&fsg_opts_attr_autotune,
+	&fsg_opts_attr_autotune_min,
+	&fsg_opts_attr_autotune_max,
+	&fsg_opts_attr_autotune_stats,
+	&fsg_opts_attr_idle_timeout,
+	&fsg_opts_attr_idle_stats,
 	NULL,
 };
 
@@ -3463,7 +6787,7 @@ static struct usb_function_instance *fsg_alloc_inst(void)
 	rc = fsg_common_set_num_buffers(opts->common,
 					CONFIG_USB_GADGET_STORAGE_NUM_BUFFERS);
 	if (rc)
-		goto release_opts;
+		goto release_wq;
 
 	pr_info(FSG_DRIVER_DESC ", version: " FSG_DRIVER_VERSION "\n");
 
@@ -3486,6 +6810,8 @@ static struct usb_function_instance *fsg_alloc_inst(void)
 
 release_buffers:
 	fsg_common_free_buffers(opts->common);
+release_wq:
+	destroy_workqueue(opts->common->wb_wq);
 release_opts:
 	kfree(opts);
 	return ERR_PTR(rc);
@@ -3525,6 +6851,7 @@ static struct usb_function *fsg_alloc(struct usb_function_instance *fi)
 	fsg->function.unbind	= fsg_unbind;
 	fsg->function.setup	= fsg_setup;
 	fsg->function.set_alt	= fsg_set_alt;
+	fsg->function.get_alt	= fsg_get_alt;
 	fsg->function.disable	= fsg_disable;
 	fsg->function.free_func	= fsg_free;
 
@@ -3555,6 +6882,7 @@ void fsg_config_from_params(struct fsg_config *cfg,
 		lun->ro = !!params->ro[i];
 		lun->cdrom = !!params->cdrom[i];
 		lun->removable = !!params->removable[i];
+		lun->direct = !!params->direct[i];
 		lun->filename =
 			params->file_count > i && params->file[i][0]
 			? params->file[i]
@@ -3571,5 +6899,10 @@ void fsg_config_from_params(struct fsg_config *cfg,
 	/* Finalise */
 	cfg->can_stall = params->stall;
 	cfg->fsg_num_buffers = fsg_num_buffers;
+	cfg->buflen = params->buflen ?: FSG_BUFLEN;
+	cfg->uas = params->uas;
+	cfg->premap = params->premap;
+	cfg->autotune = params->autotune;
+	cfg->idle_timeout = params->idle_timeout;
 }
 EXPORT_SYMBOL_GPL(fsg_config_from_params);
@@ -10,11 +10,17 @@ struct fsg_module_parameters {
 	bool		removable[FSG_MAX_LUNS];
 	bool		cdrom[FSG_MAX_LUNS];
 	bool		nofua[FSG_MAX_LUNS];
+	bool		direct[FSG_MAX_LUNS];
 
 	unsigned int	file_count, ro_count, removable_count, cdrom_count;
-	unsigned int	nofua_count;
+	unsigned int	nofua_count, direct_count;
 	unsigned int	luns;	/* nluns */
 	bool		stall;	/* can_stall */
+	unsigned int	buflen;
+	bool		uas;	/* uas_capable */
+	bool		premap;
+	bool		autotune;
+	unsigned int	idle_timeout;
 };
 
 #define _FSG_MODULE_PARAM_ARRAY(prefix, params, name, type, desc)	\
@@ -39,10 +45,22 @@ struct fsg_module_parameters {
 				"true to simulate CD-ROM instead of disk"); \
 	_FSG_MODULE_PARAM_ARRAY(prefix, params, nofua, bool,		\
 				"true to ignore SCSI WRITE(10,12) FUA bit"); \
+	_FSG_MODULE_PARAM_ARRAY(prefix, params, direct, bool,		\
+				"true to bypass the page cache (O_DIRECT)"); \
 	_FSG_MODULE_PARAM(prefix, params, luns, uint,			\
 			  "number of LUNs");				\
 	_FSG_MODULE_PARAM(prefix, params, stall, bool,			\
-			  "false to prevent bulk stalls")
+			  "false to prevent bulk stalls");		\
+	_FSG_MODULE_PARAM(prefix, params, buflen, uint,			\
+			  "size of each pipeline buffer in bytes");	\
+	_FSG_MODULE_PARAM(prefix, params, uas, bool,			\
+			  "true to offer USB Attached SCSI");		\
+	_FSG_MODULE_PARAM(prefix, params, premap, bool,			\
+			  "true to DMA-map pipeline buffers only once");	\
+	_FSG_MODULE_PARAM(prefix, params, autotune, bool,		\
+			  "true to tune the number of pipeline buffers");	\
+	_FSG_MODULE_PARAM(prefix, params, idle_timeout, uint,		\
+			  "ms idle before freeing pipeline buffers, 0=never")
 
 #ifdef CONFIG_USB_GADGET_DEBUG_FILES
 
@@ -89,6 +107,7 @@ struct fsg_lun_config {
 	char removable;
 	char cdrom;
 	char nofua;
+	char direct;
 	char inquiry_string[INQUIRY_STRING_LEN];
 };
 
@@ -106,6 +125,11 @@ struct fsg_config {
 
 	char			can_stall;
 	unsigned int		fsg_num_buffers;
+	unsigned int		buflen;
+	char			uas;
+	char			premap;
+	char			autotune;
+	unsigned int		idle_timeout;
 };
 
 static inline struct fsg_opts *
@@ -122,6 +146,22 @@ void fsg_common_set_sysfs(struct fsg_common *common, bool sysfs);
 
 int fsg_common_set_num_buffers(struct fsg_common *common, unsigned int n);
 
+int fsg_common_set_buflen(struct fsg_common *common, unsigned int buflen);
+
+int fsg_common_resize_buffers(struct fsg_common *common, unsigned int n,
+			      unsigned int buflen);
+
+void fsg_common_set_uas(struct fsg_common *common, bool uas);
+
+void fsg_common_set_premap(struct fsg_common *common, bool premap);
+
+void fsg_common_set_autotune(struct fsg_common *common, bool autotune);
+
+int fsg_common_set_autotune_bounds(struct fsg_common *common,
+				   unsigned int min, unsigned int max);
+
+void fsg_common_set_idle_timeout(struct fsg_common *common, unsigned int ms);
+
 void fsg_common_free_buffers(struct fsg_common *common);
 
 int fsg_common_set_cdev(struct fsg_common *common,
@@ -0,0 +1,71 @@
+/*
+ * fsg_user.h -- Interface between the userspace LUN backend and its daemon
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef FSG_USER_H
+#define FSG_USER_H
+
+#include <linux/types.h>
+
+/*
+ * A LUN opened as "user:<size>" has its I/O served by a daemon through
+ * a character device, /dev/fsg-user<n>.  Only one daemon can have it
+ * open at a time; it maps FSG_USER_AREA_SIZE bytes of the device:
+ *
+ *	0			struct fsg_user_mailbox
+ *	cmd_offset		struct fsg_user_cmd[ring_size]
+ *	data_offset		ring_size data slots of slot_size bytes
+ *
+ * The kernel posts command n in cmds[n % ring_size], with its data in
+ * slot n % ring_size, and then advances cmd_head.  The daemon completes
+ * commands in order: it fills in result, advances cmd_tail past them
+ * and writes anything to the device to ring the doorbell.  One write
+ * covers all the commands completed so far, and a transfer larger than
+ * a slot is posted as a batch of commands at once.  poll() reports
+ * POLLIN while cmd_head and cmd_tail differ.
+ *
+ * Commands still pending when the daemon closes the device fail; the
+ * next daemon starts with an empty ring.
+ */
+
+#define FSG_USER_VERSION	1
+#define FSG_USER_RING_SIZE	16
+#define FSG_USER_SLOT_SIZE	(64 * 1024)
+#define FSG_USER_DATA_OFFSET	4096
+#define FSG_USER_AREA_SIZE	(FSG_USER_DATA_OFFSET + \
+				 FSG_USER_RING_SIZE * FSG_USER_SLOT_SIZE)
+
+enum fsg_user_op {
+	FSG_USER_OP_READ = 1,	/* Fill the slot from offset */
+	FSG_USER_OP_WRITE,	/* Store the slot at offset */
+	FSG_USER_OP_FLUSH,	/* Make earlier writes durable */
+	FSG_USER_OP_DISCARD,	/* Range must read back as zeroes */
+};
+
+struct fsg_user_mailbox {
+	__u32	version;
+	__u32	ring_size;
+	__u32	slot_size;
+	__u32	cmd_offset;
+	__u32	data_offset;
+	__u32	reserved;
+	__u64	size;		/* Of the LUN, in bytes */
+	__u32	cmd_head;	/* Written by the kernel */
+	__u32	cmd_tail;	/* Written by the daemon */
+};
+
+struct fsg_user_cmd {
+	__u32	id;		/* Sequence number, n */
+	__u16	op;		/* enum fsg_user_op */
+	__u16	slot;		/* Data slot, n % ring_size */
+	__u64	offset;		/* In the LUN, in bytes */
+	__u32	length;		/* In bytes */
+	__s32	result;		/* Bytes done or -errno, from the daemon */
+};
+
+#endif /* FSG_USER_H */
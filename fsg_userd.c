@@ -0,0 +1,149 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -I. -o fsg_userd fsg_userd.c */
+
+/*
+ * fsg_userd.c -- Sample daemon for the userspace LUN backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Serves a "user:<size>" LUN from a plain image file, which is enough to
+ * try the backend out with dummy_hcd:
+ *
+ *	echo user:64M > .../functions/mass_storage.0/lun.0/file
+ *	truncate -s 64M disk.img
+ *	./fsg_userd /dev/fsg-user0 disk.img
+ *
+ * Reads and writes go straight between the image and the shared data
+ * slots.  All the commands found pending are served before the doorbell
+ * is rung once for them.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fsg_user.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE	0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+
+static int serve(int img, struct fsg_user_mailbox *mb, char *area,
+		 struct fsg_user_cmd *cmd)
+{
+	char	*slot = area + mb->data_offset +
+			(size_t)cmd->slot * mb->slot_size;
+	ssize_t	rc;
+
+	if (cmd->slot >= mb->ring_size ||
+	    ((cmd->op == FSG_USER_OP_READ || cmd->op == FSG_USER_OP_WRITE) &&
+	     cmd->length > mb->slot_size))
+		return -EINVAL;
+
+	switch (cmd->op) {
+	case FSG_USER_OP_READ:
+		rc = pread(img, slot, cmd->length, cmd->offset);
+		if (rc >= 0 && rc < cmd->length) {
+			/* Past the end of a short image reads as zeroes */
+			memset(slot + rc, 0, cmd->length - rc);
+			rc = cmd->length;
+		}
+		break;
+	case FSG_USER_OP_WRITE:
+		rc = pwrite(img, slot, cmd->length, cmd->offset);
+		break;
+	case FSG_USER_OP_FLUSH:
+		rc = fdatasync(img);
+		break;
+	case FSG_USER_OP_DISCARD:
+		rc = fallocate(img, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       cmd->offset, cmd->length);
+		break;
+	default:
+		return -EINVAL;
+	}
+	return rc < 0 ? -errno : (int)rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct fsg_user_mailbox	*mb;
+	struct fsg_user_cmd	*cmds, *cmd;
+	struct pollfd		pfd;
+	uint32_t		tail, head;
+	char			*area;
+	int			dev, img;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s /dev/fsg-userN image\n", argv[0]);
+		return 2;
+	}
+
+	dev = open(argv[1], O_RDWR);
+	if (dev < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	img = open(argv[2], O_RDWR);
+	if (img < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	area = mmap(NULL, FSG_USER_AREA_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, dev, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	mb = (struct fsg_user_mailbox *)area;
+	if (mb->version != FSG_USER_VERSION) {
+		fprintf(stderr, "unknown interface version %u\n", mb->version);
+		return 1;
+	}
+	cmds = (struct fsg_user_cmd *)(area + mb->cmd_offset);
+	printf("serving %llu bytes from %s\n",
+	       (unsigned long long)mb->size, argv[2]);
+
+	pfd.fd = dev;
+	pfd.events = POLLIN;
+	tail = __atomic_load_n(&mb->cmd_tail, __ATOMIC_ACQUIRE);
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		head = __atomic_load_n(&mb->cmd_head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			continue;
+		for (; tail != head; ++tail) {
+			cmd = &cmds[tail % mb->ring_size];
+			cmd->result = serve(img, mb, area, cmd);
+		}
+		__atomic_store_n(&mb->cmd_tail, tail, __ATOMIC_RELEASE);
+
+		/* One doorbell for the whole batch */
+		if (write(dev, &tail, sizeof(tail)) < 0) {
+			perror("doorbell");
+			return 1;
+		}
+	}
+}
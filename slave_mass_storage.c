@@ -83,7 +83,8 @@ static struct usb_function *f_msg;
 /****************************** Configurations ******************************/
 
 static struct fsg_module_parameters mod_data = {
-        .stall = 1
+        .stall = 1,
+        .buflen = FSG_BUFLEN
 };
 
 #ifdef CONFIG_USB_GADGET_DEBUG_FILES
@@ -207,12 +208,19 @@ static int msg_bind(struct usb_composite_dev *cdev)
 	fsg_config_from_params(&config, &mod_data, fsg_num_buffers);
 	opts = fsg_opts_from_func_inst(fi_msg);
 	opts->no_configfs = true;
+	status = fsg_common_set_buflen(opts->common, config.buflen);
+	if (status)
+                goto fail;
 	status = fsg_common_set_num_buffers(opts->common, fsg_num_buffers);
 	if (status)
                 goto fail;
 	status = fsg_common_set_cdev(opts->common, cdev, config.can_stall);
 	if (status)
                 goto fail_set_cdev;
+	fsg_common_set_uas(opts->common, config.uas);
+	fsg_common_set_premap(opts->common, config.premap);
+	fsg_common_set_autotune(opts->common, config.autotune);
+	fsg_common_set_idle_timeout(opts->common, config.idle_timeout);
 	fsg_common_set_sysfs(opts->common, true);
         status = fsg_common_create_luns(opts->common, &config);
         if (status)
@@ -0,0 +1,530 @@
+/*
+ * storage_cache.c -- Fast tier in front of a LUN's backing storage
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Hosts keep going back to the same few blocks of a filesystem (FAT
+ * tables, directories) while most of the rest is read or written once.
+ * On slow media it pays to keep those hot blocks somewhere faster: a
+ * LUN with a cache_size and/or a cache_file gets a tier of page-sized
+ * lines in memory, or in the cache file, in front of its backing file
+ * or backend.
+ *
+ * Lines are promoted by access frequency.  Each access to a line which
+ * isn't in the tier is counted in a small direct-mapped table, and the
+ * line is copied up on its FSG_CACHE_PROMOTE'th access, so a single
+ * sequential pass over the medium doesn't flush the tier.  Runs of
+ * lines which aren't in the tier go to the slow tier in one call, and
+ * data being transferred anyway is what gets copied up.  Victims are
+ * found with the CLOCK algorithm.
+ *
+ * Writes to lines in the tier only dirty them; dirty lines are written
+ * back by a worker FSG_CACHE_WB_DELAY later, sooner if half the tier is
+ * dirty, and on SYNCHRONIZE CACHE or when the medium is ejected.  FUA
+ * writes go through to the slow tier at once.  The
+ * cache file is scratch space: nothing in it is kept across openings.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "storage_common.h"
+
+#define FSG_CACHE_MIN_LINES	16
+#define FSG_CACHE_PROMOTE	3	/* Accesses before a line is copied up */
+#define FSG_CACHE_MAX_FREQ	3	/* CLOCK sweeps a line survives */
+#define FSG_CACHE_WB_DELAY	HZ
+
+struct fsg_cache_slot {
+	struct hlist_node	node;
+	loff_t			line;		/* -1 while unused */
+	void			*data;		/* RAM tier, NULL until used */
+	unsigned int		freq;
+	bool			dirty;
+};
+
+/* Access counts of lines not in the tier */
+struct fsg_cache_ghost {
+	loff_t			line;
+	unsigned int		count;
+};
+
+struct fsg_cache {
+	struct fsg_lun		*curlun;
+	struct mutex		lock;		/* Everything below */
+	struct file		*filp;		/* Fast tier, NULL for RAM */
+	void			*bounce;	/* One line, with a cache file */
+	loff_t			num_lines;	/* Whole lines in the LUN */
+	unsigned int		num_slots;
+	unsigned int		hash_bits;
+	unsigned int		hand;		/* CLOCK */
+	unsigned int		num_dirty;
+	int			error;		/* From a background write-back */
+	struct fsg_cache_slot	*slots;
+	struct hlist_head	*hash;
+	struct fsg_cache_ghost	*ghosts;
+	struct delayed_work	writeback;
+
+	unsigned long		hits;		/* In lines */
+	unsigned long		misses;
+	unsigned long		promotions;
+	unsigned long		writebacks;
+};
+
+static struct fsg_cache_slot *fsg_cache_lookup(struct fsg_cache *c,
+					       loff_t line)
+{
+	struct fsg_cache_slot	*s;
+
+	hlist_for_each_entry(s, &c->hash[hash_64(line, c->hash_bits)], node)
+		if (s->line == line)
+			return s;
+	return NULL;
+}
+
+/* Copy between a line in the tier and memory */
+static int fsg_cache_copy(struct fsg_cache *c, struct fsg_cache_slot *s,
+			  void *buf, size_t offset, size_t len, bool store)
+{
+	loff_t	pos;
+	ssize_t	rc;
+
+	if (!c->filp) {
+		if (store)
+			memcpy(s->data + offset, buf, len);
+		else
+			memcpy(buf, s->data + offset, len);
+		return 0;
+	}
+
+	pos = ((loff_t)(s - c->slots) << PAGE_SHIFT) + offset;
+	if (store)
+		rc = kernel_write(c->filp, buf, len, pos);
+	else
+		rc = kernel_read(c->filp, pos, buf, len);
+	if (rc < 0)
+		return rc;
+	return rc < len ? -EIO : 0;
+}
+
+/* The caller must have set the address limit to KERNEL_DS */
+static int fsg_cache_write_back(struct fsg_cache *c, struct fsg_cache_slot *s)
+{
+	void	*data = c->filp ? c->bounce : s->data;
+	loff_t	pos = s->line << PAGE_SHIFT;
+	ssize_t	rc;
+
+	if (c->filp) {
+		rc = fsg_cache_copy(c, s, data, 0, PAGE_SIZE, false);
+		if (rc)
+			return rc;
+	}
+	rc = fsg_lun_backing_rw(c->curlun, data, PAGE_SIZE, &pos, true);
+	if (rc < 0)
+		return rc;
+	if (rc < PAGE_SIZE)
+		return -EIO;
+
+	s->dirty = false;
+	--c->num_dirty;
+	++c->writebacks;
+	return 0;
+}
+
+static int fsg_cache_write_back_all(struct fsg_cache *c)
+{
+	unsigned int	i;
+	int		rc, ret = 0;
+
+	for (i = 0; i < c->num_slots && c->num_dirty; ++i) {
+		if (!c->slots[i].dirty)
+			continue;
+		rc = fsg_cache_write_back(c, &c->slots[i]);
+		if (rc && !ret)
+			ret = rc;
+	}
+	return ret;
+}
+
+static void fsg_cache_writeback_work(struct work_struct *work)
+{
+	struct fsg_cache	*c = container_of(to_delayed_work(work),
+						  struct fsg_cache, writeback);
+	mm_segment_t		old_fs;
+	int			rc;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+	mutex_lock(&c->lock);
+	rc = fsg_cache_write_back_all(c);
+	if (rc && !c->error)
+		c->error = rc;
+	mutex_unlock(&c->lock);
+	set_fs(old_fs);
+}
+
+static void fsg_cache_drop(struct fsg_cache *c, struct fsg_cache_slot *s)
+{
+	hlist_del(&s->node);
+	s->line = -1;
+	s->freq = 0;
+	if (s->dirty) {
+		s->dirty = false;
+		--c->num_dirty;
+	}
+}
+
+/* Find a slot to reuse, writing its line back if need be */
+static struct fsg_cache_slot *fsg_cache_victim(struct fsg_cache *c)
+{
+	struct fsg_cache_slot	*s;
+
+	for (;;) {
+		s = &c->slots[c->hand];
+		c->hand = (c->hand + 1) % c->num_slots;
+		if (s->line < 0)
+			break;
+		if (s->freq) {
+			--s->freq;
+			continue;
+		}
+		if (s->dirty && fsg_cache_write_back(c, s))
+			return NULL;
+		fsg_cache_drop(c, s);
+		break;
+	}
+
+	if (!c->filp && !s->data) {
+		s->data = (void *)__get_free_page(GFP_KERNEL);
+		if (!s->data)
+			return NULL;
+	}
+	return s;
+}
+
+/*
+ * Copy a line up into the tier, from data the caller has at hand or else
+ * from the slow tier.
+ */
+static void fsg_cache_promote(struct fsg_cache *c, loff_t line,
+			      void *data)
+{
+	struct fsg_cache_slot	*s;
+	loff_t			pos;
+	ssize_t			rc;
+
+	s = fsg_cache_victim(c);
+	if (!s)
+		return;
+
+	if (!data) {
+		data = c->filp ? c->bounce : s->data;
+		pos = line << PAGE_SHIFT;
+		rc = fsg_lun_backing_rw(c->curlun, data, PAGE_SIZE, &pos,
+					false);
+		if (rc != PAGE_SIZE)
+			return;
+		if (data == s->data)
+			data = NULL;
+	}
+	if (data && fsg_cache_copy(c, s, data, 0, PAGE_SIZE, true))
+		return;
+
+	s->line = line;
+	s->freq = 1;
+	hlist_add_head(&s->node, &c->hash[hash_64(line, c->hash_bits)]);
+	++c->promotions;
+}
+
+/*
+ * Count an access to a line which isn't in the tier and copy it up once
+ * it has been seen often enough.  buf holds the whole line if it isn't
+ * NULL.
+ */
+static void fsg_cache_note(struct fsg_cache *c, loff_t line, void *buf)
+{
+	struct fsg_cache_ghost	*g;
+
+	++c->misses;
+	if (line >= c->num_lines)
+		return;
+
+	g = &c->ghosts[hash_64(line, c->hash_bits)];
+	if (g->line != line) {
+		g->line = line;
+		g->count = 0;
+	}
+	if (++g->count < FSG_CACHE_PROMOTE)
+		return;
+
+	g->line = -1;
+	fsg_cache_promote(c, line, buf);
+}
+
+/* Length of the run of lines from pos on which aren't in the tier */
+static size_t fsg_cache_miss_run(struct fsg_cache *c, loff_t pos,
+				 size_t amount)
+{
+	loff_t	end = pos + amount;
+	loff_t	next = round_down(pos, (loff_t)PAGE_SIZE) + PAGE_SIZE;
+
+	while (next < end && !fsg_cache_lookup(c, next >> PAGE_SHIFT))
+		next += PAGE_SIZE;
+	return min(next, end) - pos;
+}
+
+static void fsg_cache_dirty(struct fsg_cache *c, struct fsg_cache_slot *s)
+{
+	if (s->dirty)
+		return;
+	s->dirty = true;
+	if (++c->num_dirty > c->num_slots / 2)
+		mod_delayed_work(system_long_wq, &c->writeback, 0);
+	else
+		queue_delayed_work(system_long_wq, &c->writeback,
+				   FSG_CACHE_WB_DELAY);
+}
+
+/*
+ * Same conventions as fsg_lun_read() and fsg_lun_write(), which call this
+ * for LUNs with a cache.
+ */
+ssize_t fsg_cache_rw(struct fsg_lun *curlun, void *buf, size_t amount,
+		     loff_t *pos, bool write)
+{
+	struct fsg_cache	*c = curlun->cache;
+	struct fsg_cache_slot	*s;
+	size_t			done = 0, part, offset;
+	loff_t			p, tmp, line;
+	ssize_t			rc = 0;
+
+	mutex_lock(&c->lock);
+	while (done < amount) {
+		p = *pos + done;
+		line = p >> PAGE_SHIFT;
+		offset = p & ~PAGE_MASK;
+		s = fsg_cache_lookup(c, line);
+		if (s) {
+			part = min(amount - done, PAGE_SIZE - offset);
+			rc = fsg_cache_copy(c, s, buf + done, offset, part,
+					    write);
+			if (rc)
+				break;
+			/* FUA data must not wait in the tier */
+			if (write && curlun->fua) {
+				if (!s->dirty) {
+					s->dirty = true;
+					++c->num_dirty;
+				}
+				rc = fsg_cache_write_back(c, s);
+			} else if (write) {
+				fsg_cache_dirty(c, s);
+			}
+			if (rc)
+				break;
+			if (s->freq < FSG_CACHE_MAX_FREQ)
+				++s->freq;
+			++c->hits;
+			done += part;
+			continue;
+		}
+
+		part = fsg_cache_miss_run(c, p, amount - done);
+		tmp = p;
+		rc = fsg_lun_backing_rw(curlun, buf + done, part, &tmp, write);
+		if (rc <= 0)
+			break;
+
+		/* Only whole lines which were transferred come from buf */
+		for (tmp = p; tmp < p + rc; tmp = (line + 1) << PAGE_SHIFT) {
+			line = tmp >> PAGE_SHIFT;
+			fsg_cache_note(c, line,
+				       !(tmp & ~PAGE_MASK) &&
+				       tmp + PAGE_SIZE <= p + rc ?
+				       buf + done + (tmp - p) : NULL);
+		}
+		done += rc;
+		if (rc < part)
+			break;
+		rc = 0;
+	}
+	mutex_unlock(&c->lock);
+
+	*pos += done;
+	return done ? done : rc;
+}
+
+/* Discarded lines leave the tier, the rest of a partial one written back */
+int fsg_cache_discard(struct fsg_lun *curlun, loff_t offset, loff_t length)
+{
+	struct fsg_cache	*c = curlun->cache;
+	struct fsg_cache_slot	*s;
+	loff_t			line, last = (offset + length - 1) >> PAGE_SHIFT;
+	int			rc = 0;
+
+	mutex_lock(&c->lock);
+	for (line = offset >> PAGE_SHIFT; line <= last && !rc; ++line) {
+		s = fsg_cache_lookup(c, line);
+		if (!s)
+			continue;
+		if (s->dirty && (line << PAGE_SHIFT < offset ||
+				 (line + 1) << PAGE_SHIFT > offset + length))
+			rc = fsg_cache_write_back(c, s);
+		if (!rc)
+			fsg_cache_drop(c, s);
+	}
+	mutex_unlock(&c->lock);
+	return rc;
+}
+
+/* Write back every dirty line, reporting any background failure too */
+static int fsg_cache_sync(struct fsg_cache *c)
+{
+	mm_segment_t	old_fs;
+	int		rc;
+
+	old_fs = get_fs();
+	set_fs(get_ds());
+	mutex_lock(&c->lock);
+	rc = fsg_cache_write_back_all(c);
+	if (!rc)
+		rc = c->error;
+	c->error = 0;
+	mutex_unlock(&c->lock);
+	set_fs(old_fs);
+	return rc;
+}
+
+int fsg_cache_flush(struct fsg_lun *curlun)
+{
+	return fsg_cache_sync(curlun->cache);
+}
+
+ssize_t fsg_cache_stats(struct fsg_lun *curlun, char *buf)
+{
+	struct fsg_cache	*c = curlun->cache;
+	ssize_t			rc;
+
+	mutex_lock(&c->lock);
+	rc = sprintf(buf, "hits %lu misses %lu promotions %lu writebacks %lu dirty %u\n",
+		     c->hits, c->misses, c->promotions, c->writebacks,
+		     c->num_dirty);
+	mutex_unlock(&c->lock);
+	return rc;
+}
+
+static void fsg_cache_free(struct fsg_cache *c)
+{
+	unsigned int	i;
+
+	if (c->slots && !c->filp)
+		for (i = 0; i < c->num_slots; ++i)
+			free_page((unsigned long)c->slots[i].data);
+	vfree(c->slots);
+	vfree(c->hash);
+	vfree(c->ghosts);
+	if (c->bounce)
+		free_page((unsigned long)c->bounce);
+	if (c->filp)
+		fput(c->filp);
+	kfree(c);
+}
+
+/*
+ * The tier holds cache_size bytes, by default all of the cache file if
+ * there is one.  size is that of the LUN.
+ */
+struct fsg_cache *fsg_cache_create(struct fsg_lun *curlun, loff_t size)
+{
+	struct fsg_cache	*c;
+	loff_t			tier = curlun->cache_size;
+	unsigned int		i, n;
+	int			rc;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+	c->curlun = curlun;
+	mutex_init(&c->lock);
+	INIT_DELAYED_WORK(&c->writeback, fsg_cache_writeback_work);
+	c->num_lines = size >> PAGE_SHIFT;
+
+	if (curlun->cache_file) {
+		c->filp = filp_open(curlun->cache_file, O_RDWR | O_LARGEFILE,
+				    0);
+		if (IS_ERR(c->filp)) {
+			rc = PTR_ERR(c->filp);
+			c->filp = NULL;
+			LINFO(curlun, "unable to open cache file: %s\n",
+			      curlun->cache_file);
+			goto fail;
+		}
+		if (!tier)
+			tier = i_size_read(file_inode(c->filp)->i_mapping->host);
+		c->bounce = (void *)__get_free_page(GFP_KERNEL);
+		if (!c->bounce) {
+			rc = -ENOMEM;
+			goto fail;
+		}
+	} else if ((tier >> PAGE_SHIFT) > totalram_pages / 2) {
+		LINFO(curlun, "cache larger than half of memory\n");
+		rc = -EINVAL;
+		goto fail;
+	}
+
+	/* More would never be used */
+	tier = min(tier >> PAGE_SHIFT, c->num_lines);
+	if (tier < FSG_CACHE_MIN_LINES || tier > UINT_MAX / 2) {
+		LINFO(curlun, "invalid cache size: %lld lines\n",
+		      (long long)tier);
+		rc = -EINVAL;
+		goto fail;
+	}
+	c->num_slots = tier;
+	c->hash_bits = ilog2(roundup_pow_of_two(c->num_slots));
+	n = 1 << c->hash_bits;
+
+	rc = -ENOMEM;
+	c->slots = vzalloc(c->num_slots * sizeof(*c->slots));
+	c->hash = vmalloc(n * sizeof(*c->hash));
+	c->ghosts = vmalloc(n * sizeof(*c->ghosts));
+	if (!c->slots || !c->hash || !c->ghosts)
+		goto fail;
+	for (i = 0; i < c->num_slots; ++i)
+		c->slots[i].line = -1;
+	for (i = 0; i < n; ++i) {
+		INIT_HLIST_HEAD(&c->hash[i]);
+		c->ghosts[i].line = -1;
+		c->ghosts[i].count = 0;
+	}
+
+	LDBG(curlun, "%u line cache in %s\n", c->num_slots,
+	     c->filp ? curlun->cache_file : "memory");
+	return c;
+
+fail:
+	fsg_cache_free(c);
+	return ERR_PTR(rc);
+}
+
+/* Dirty lines are written back first, while the slow tier is still there */
+void fsg_cache_destroy(struct fsg_cache *c)
+{
+	cancel_delayed_work_sync(&c->writeback);
+	if (c->num_dirty && fsg_cache_sync(c))
+		LERROR(c->curlun, "cache write-back failed, data lost\n");
+	fsg_cache_free(c);
+}
@@ -21,17 +21,28 @@
  * When USB_GADGET_DEBUG_FILES is defined the module param num_buffers
  * sets the number of pipeline buffers (length of the fsg_buffhd array).
  * The valid range of num_buffers is: num >= 2 && num <= 4.
+ *
+ * The size of each buffer defaults to FSG_BUFLEN and can be changed with
+ * the buflen module param or configfs attribute, anywhere from
+ * FSG_MIN_BUFLEN to FSG_MAX_BUFLEN in multiples of FSG_MIN_BUFLEN.
  */
 
 #include <linux/module.h>
 #include <linux/blkdev.h>
+#include <linux/falloc.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <linux/usb/composite.h>
 
 #include "storage_common.h"
 
-/* There is only one interface. */
+/*
+ * There is only one interface, with the Bulk-Only Transport as alternate
+ * setting 0 and, optionally, USB Attached SCSI as alternate setting 1.
+ */
 
 struct usb_interface_descriptor fsg_intf_desc = {
 	.bLength =		sizeof fsg_intf_desc,
@@ -163,9 +174,222 @@ struct usb_descriptor_header *fsg_ss_function[] = {
 };
 EXPORT_SYMBOL_GPL(fsg_ss_function);
 
+/*
+ * Alternate setting 1: USB Attached SCSI.  The data pipes are the bulk
+ * endpoints of the Bulk-Only setting, the command and status pipes have
+ * endpoints of their own.  Each endpoint is followed by a pipe usage
+ * descriptor telling the host which pipe it is.
+ */
+struct usb_interface_descriptor fsg_uas_intf_desc = {
+	.bLength =		sizeof fsg_uas_intf_desc,
+	.bDescriptorType =	USB_DT_INTERFACE,
+
+	.bAlternateSetting =	FSG_UAS_ALT,
+	.bNumEndpoints =	4,
+	.bInterfaceClass =	USB_CLASS_MASS_STORAGE,
+	.bInterfaceSubClass =	USB_SC_SCSI,
+	.bInterfaceProtocol =	USB_PR_UAS,
+	.iInterface =		FSG_STRING_INTERFACE,
+};
+EXPORT_SYMBOL_GPL(fsg_uas_intf_desc);
+
+struct usb_pipe_usage_descriptor fsg_uas_cmd_pipe_desc = {
+	.bLength =		sizeof fsg_uas_cmd_pipe_desc,
+	.bDescriptorType =	USB_DT_PIPE_USAGE,
+	.bPipeID =		CMD_PIPE_ID,
+};
+EXPORT_SYMBOL_GPL(fsg_uas_cmd_pipe_desc);
+
+struct usb_pipe_usage_descriptor fsg_uas_status_pipe_desc = {
+	.bLength =		sizeof fsg_uas_status_pipe_desc,
+	.bDescriptorType =	USB_DT_PIPE_USAGE,
+	.bPipeID =		STATUS_PIPE_ID,
+};
+EXPORT_SYMBOL_GPL(fsg_uas_status_pipe_desc);
+
+struct usb_pipe_usage_descriptor fsg_uas_data_in_pipe_desc = {
+	.bLength =		sizeof fsg_uas_data_in_pipe_desc,
+	.bDescriptorType =	USB_DT_PIPE_USAGE,
+	.bPipeID =		DATA_IN_PIPE_ID,
+};
+EXPORT_SYMBOL_GPL(fsg_uas_data_in_pipe_desc);
+
+struct usb_pipe_usage_descriptor fsg_uas_data_out_pipe_desc = {
+	.bLength =		sizeof fsg_uas_data_out_pipe_desc,
+	.bDescriptorType =	USB_DT_PIPE_USAGE,
+	.bPipeID =		DATA_OUT_PIPE_ID,
+};
+EXPORT_SYMBOL_GPL(fsg_uas_data_out_pipe_desc);
+
+struct usb_endpoint_descriptor fsg_fs_uas_cmd_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	.bEndpointAddress =	USB_DIR_OUT,
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	/* wMaxPacketSize set by autoconfiguration */
+};
+EXPORT_SYMBOL_GPL(fsg_fs_uas_cmd_desc);
+
+struct usb_endpoint_descriptor fsg_fs_uas_status_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	.bEndpointAddress =	USB_DIR_IN,
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	/* wMaxPacketSize set by autoconfiguration */
+};
+EXPORT_SYMBOL_GPL(fsg_fs_uas_status_desc);
+
+struct usb_descriptor_header *fsg_fs_uas_function[] = {
+	(struct usb_descriptor_header *) &fsg_intf_desc,
+	(struct usb_descriptor_header *) &fsg_fs_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_fs_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_uas_intf_desc,
+	(struct usb_descriptor_header *) &fsg_fs_uas_cmd_desc,
+	(struct usb_descriptor_header *) &fsg_uas_cmd_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_fs_uas_status_desc,
+	(struct usb_descriptor_header *) &fsg_uas_status_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_fs_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_in_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_fs_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_out_pipe_desc,
+	NULL,
+};
+EXPORT_SYMBOL_GPL(fsg_fs_uas_function);
+
+struct usb_endpoint_descriptor fsg_hs_uas_cmd_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	/* bEndpointAddress copied from fs_uas_cmd_desc during fsg_bind() */
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize =	cpu_to_le16(512),
+};
+EXPORT_SYMBOL_GPL(fsg_hs_uas_cmd_desc);
+
+struct usb_endpoint_descriptor fsg_hs_uas_status_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	/* bEndpointAddress copied from fs_uas_status_desc during fsg_bind() */
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize =	cpu_to_le16(512),
+};
+EXPORT_SYMBOL_GPL(fsg_hs_uas_status_desc);
+
+struct usb_descriptor_header *fsg_hs_uas_function[] = {
+	(struct usb_descriptor_header *) &fsg_intf_desc,
+	(struct usb_descriptor_header *) &fsg_hs_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_hs_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_uas_intf_desc,
+	(struct usb_descriptor_header *) &fsg_hs_uas_cmd_desc,
+	(struct usb_descriptor_header *) &fsg_uas_cmd_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_hs_uas_status_desc,
+	(struct usb_descriptor_header *) &fsg_uas_status_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_hs_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_in_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_hs_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_out_pipe_desc,
+	NULL,
+};
+EXPORT_SYMBOL_GPL(fsg_hs_uas_function);
+
+struct usb_endpoint_descriptor fsg_ss_uas_cmd_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	/* bEndpointAddress copied from fs_uas_cmd_desc during fsg_bind() */
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize =	cpu_to_le16(1024),
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_cmd_desc);
+
+struct usb_ss_ep_comp_descriptor fsg_ss_uas_cmd_comp_desc = {
+	.bLength =		sizeof(fsg_ss_uas_cmd_comp_desc),
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_cmd_comp_desc);
+
+struct usb_endpoint_descriptor fsg_ss_uas_status_desc = {
+	.bLength =		USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType =	USB_DT_ENDPOINT,
+
+	/* bEndpointAddress copied from fs_uas_status_desc during fsg_bind() */
+	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize =	cpu_to_le16(1024),
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_status_desc);
+
+/* The status and data pipes use streams, set up during fsg_bind() */
+struct usb_ss_ep_comp_descriptor fsg_ss_uas_status_comp_desc = {
+	.bLength =		sizeof(fsg_ss_uas_status_comp_desc),
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+
+	/*.bmAttributes =	DYNAMIC, */
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_status_comp_desc);
+
+struct usb_ss_ep_comp_descriptor fsg_ss_uas_bulk_in_comp_desc = {
+	.bLength =		sizeof(fsg_ss_uas_bulk_in_comp_desc),
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+
+	/*.bMaxBurst =		DYNAMIC, */
+	/*.bmAttributes =	DYNAMIC, */
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_bulk_in_comp_desc);
+
+struct usb_ss_ep_comp_descriptor fsg_ss_uas_bulk_out_comp_desc = {
+	.bLength =		sizeof(fsg_ss_uas_bulk_out_comp_desc),
+	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
+
+	/*.bMaxBurst =		DYNAMIC, */
+	/*.bmAttributes =	DYNAMIC, */
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_bulk_out_comp_desc);
+
+struct usb_descriptor_header *fsg_ss_uas_function[] = {
+	(struct usb_descriptor_header *) &fsg_intf_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_in_comp_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_out_comp_desc,
+	(struct usb_descriptor_header *) &fsg_uas_intf_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_cmd_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_cmd_comp_desc,
+	(struct usb_descriptor_header *) &fsg_uas_cmd_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_status_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_status_comp_desc,
+	(struct usb_descriptor_header *) &fsg_uas_status_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_in_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_bulk_in_comp_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_in_pipe_desc,
+	(struct usb_descriptor_header *) &fsg_ss_bulk_out_desc,
+	(struct usb_descriptor_header *) &fsg_ss_uas_bulk_out_comp_desc,
+	(struct usb_descriptor_header *) &fsg_uas_data_out_pipe_desc,
+	NULL,
+};
+EXPORT_SYMBOL_GPL(fsg_ss_uas_function);
+
 
  /*-------------------------------------------------------------------------*/
 
+/* Backends for a file in a format of their own, chosen by "name:<file>" */
+static const struct fsg_backend *fsg_file_backends[] = {
+	&fsg_sparse_backend,
+	&fsg_compressed_backend,
+};
+
+/* Backends without a backing file, chosen by a "name:args" filename */
+static const struct fsg_backend *fsg_fileless_backends[] = {
+	&fsg_ram_backend,
+	&fsg_null_backend,
+	&fsg_pattern_backend,
+	&fsg_user_backend,
+	&fsg_stripe_backend,
+	&fsg_mirror_backend,
+};
+
 /*
  * If the next two routines are called while the gadget is registered,
  * the caller must own fsg->filesem for writing.
@@ -173,6 +397,19 @@ EXPORT_SYMBOL_GPL(fsg_ss_function);
 
 void fsg_lun_close(struct fsg_lun *curlun)
 {
+	if (curlun->cache) {
+		fsg_cache_destroy(curlun->cache);
+		curlun->cache = NULL;
+	}
+	if (curlun->backend) {
+		curlun->backend->close(curlun->backend_data);
+		curlun->backend = NULL;
+		curlun->backend_data = NULL;
+	}
+	kfree(curlun->spec);
+	curlun->spec = NULL;
+	curlun->unmap = 0;
+	curlun->unmap_zeroes = 0;
 	if (curlun->filp) {
 		LDBG(curlun, "close backing file\n");
 		fput(curlun->filp);
@@ -181,34 +418,75 @@ void fsg_lun_close(struct fsg_lun *curlun)
 }
 EXPORT_SYMBOL_GPL(fsg_lun_close);
 
-int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
+/* Forget any sequential stream seen so far */
+static void fsg_lun_reset_readahead(struct fsg_lun *curlun)
 {
-	int				ro;
-	struct file			*filp = NULL;
-	int				rc = -EINVAL;
-	struct inode			*inode = NULL;
-	loff_t				size;
-	loff_t				num_sectors;
-	loff_t				min_sectors;
-	unsigned int			blkbits;
-	unsigned int			blksize;
+	curlun->ra_next = -1;
+	curlun->ra_start = 0;
+	curlun->ra_end = 0;
+	if (curlun->filp)
+		file_ra_state_init(&curlun->ra_state,
+				   curlun->filp->f_mapping);
+}
 
-	/* R/W if we can, R/O if we must */
-	ro = curlun->initially_ro;
-	if (!ro) {
-		filp = filp_open(filename, O_RDWR | O_LARGEFILE, 0);
+static const struct fsg_backend *
+fsg_lun_match_backend(const char *filename, const char **args,
+		      const struct fsg_backend **backends, unsigned int n)
+{
+	size_t		len;
+	unsigned int	i;
+
+	for (i = 0; i < n; ++i) {
+		len = strlen(backends[i]->name);
+		if (!strncmp(filename, backends[i]->name, len) &&
+		    filename[len] == ':') {
+			*args = filename + len + 1;
+			return backends[i];
+		}
+	}
+	return NULL;
+}
+
+/* Find the backend named by a "name:args" filename, if there is one */
+static const struct fsg_backend *fsg_lun_find_backend(const char *filename,
+						      const char **args)
+{
+	const struct fsg_backend	*backend;
+
+	backend = fsg_lun_match_backend(filename, args, fsg_fileless_backends,
+					ARRAY_SIZE(fsg_fileless_backends));
+	if (!backend)
+		backend = fsg_lun_match_backend(filename, args,
+						fsg_file_backends,
+						ARRAY_SIZE(fsg_file_backends));
+	return backend;
+}
+
+/* Open the backing file R/W if we can, R/O if we must */
+static struct file *fsg_lun_open_file(struct fsg_lun *curlun,
+				      const char *filename, int *ro)
+{
+	struct file	*filp = NULL;
+	struct inode	*inode;
+	int		flags = O_LARGEFILE;
+
+	if (curlun->direct)
+		flags |= O_DIRECT;
+
+	if (!*ro) {
+		filp = filp_open(filename, O_RDWR | flags, 0);
 		if (PTR_ERR(filp) == -EROFS || PTR_ERR(filp) == -EACCES)
-			ro = 1;
+			*ro = 1;
 	}
-	if (ro)
-		filp = filp_open(filename, O_RDONLY | O_LARGEFILE, 0);
+	if (*ro)
+		filp = filp_open(filename, O_RDONLY | flags, 0);
 	if (IS_ERR(filp)) {
 		LINFO(curlun, "unable to open backing file: %s\n", filename);
-		return PTR_ERR(filp);
+		return filp;
 	}
 
 	if (!(filp->f_mode & FMODE_WRITE))
-		ro = 1;
+		*ro = 1;
 
 	inode = file_inode(filp);
 	if ((!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode))) {
@@ -225,24 +503,203 @@ int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 		goto out;
 	}
 	if (!(filp->f_mode & FMODE_CAN_WRITE))
+		*ro = 1;
+	return filp;
+
+out:
+	fput(filp);
+	return ERR_PTR(-EINVAL);
+}
+
+/*
+ * Open one of the files a backend is built on, with the LUN's read-only
+ * setting: unlike the backing file it doesn't fall back to read-only.
+ */
+struct file *fsg_backend_open_member(struct fsg_lun *curlun,
+				     const char *name, loff_t *size)
+{
+	struct file	*filp;
+	struct inode	*inode;
+
+	filp = filp_open(name, (curlun->initially_ro ? O_RDONLY : O_RDWR) |
+			 O_LARGEFILE, 0);
+	if (IS_ERR(filp)) {
+		LINFO(curlun, "unable to open member file: %s\n", name);
+		return filp;
+	}
+
+	inode = file_inode(filp);
+	if ((!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode)) ||
+	    !(filp->f_mode & FMODE_CAN_READ) ||
+	    (!curlun->initially_ro && !(filp->f_mode & FMODE_CAN_WRITE))) {
+		LINFO(curlun, "invalid member file: %s\n", name);
+		fput(filp);
+		return ERR_PTR(-EINVAL);
+	}
+	*size = i_size_read(inode->i_mapping->host);
+	return filp;
+}
+
+/*
+ * Open the file with the backend the filename asked for, if any.  Never
+ * pick one by what the file holds: for a flat LUN the host decides that.
+ * Returns NULL for a flat file.  The backends read their headers with
+ * small unaligned reads, so O_DIRECT (already checked by filp_open()) is
+ * off here and only goes back on in fsg_lun_open().
+ */
+static const struct fsg_backend *
+fsg_lun_open_backend(struct fsg_lun *curlun, struct file *filp,
+		     const struct fsg_backend *backend, loff_t *size,
+		     void **data)
+{
+	if (curlun->direct) {
+		spin_lock(&filp->f_lock);
+		filp->f_flags &= ~O_DIRECT;
+		spin_unlock(&filp->f_lock);
+	}
+	if (curlun->base && backend) {
+		LINFO(curlun, "%s backend can't be used with an overlay\n",
+		      backend->name);
+		return ERR_PTR(-EINVAL);
+	}
+	if (backend) {
+		*data = backend->open(curlun, filp, size);
+		if (PTR_ERR(*data) == -ENOEXEC) {
+			LINFO(curlun, "not a %s image\n", backend->name);
+			return ERR_PTR(-EINVAL);
+		}
+		if (IS_ERR(*data))
+			return ERR_CAST(*data);
+		LDBG(curlun, "%s backend, size %lld\n", backend->name,
+		     (long long) *size);
+		return backend;
+	}
+	if (curlun->base) {
+		/* The file is an overlay's delta, whatever is in it */
+		*data = fsg_overlay_backend.open(curlun, filp, size);
+		if (IS_ERR(*data))
+			return ERR_CAST(*data);
+		LDBG(curlun, "overlay of %s, size %lld\n", curlun->base,
+		     (long long) *size);
+		return &fsg_overlay_backend;
+	}
+	*data = NULL;
+	return NULL;
+}
+
+/*
+ * Not every filesystem with ->fallocate can punch holes.  Ask for one
+ * past the end of the file, which changes nothing where it is supported.
+ */
+static bool fsg_lun_can_punch(struct file *filp)
+{
+	loff_t	end = round_up(i_size_read(file_inode(filp)), PAGE_SIZE);
+
+	if (!filp->f_op->fallocate)
+		return false;
+	return vfs_fallocate(filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			     end, PAGE_SIZE) == 0;
+}
+
+int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
+{
+	int				ro;
+	struct file			*filp = NULL;
+	int				rc = -EINVAL;
+	struct inode			*inode = NULL;
+	loff_t				size;
+	loff_t				num_sectors;
+	loff_t				min_sectors;
+	unsigned int			blkbits;
+	unsigned int			blksize;
+	unsigned int			dio_align = 0;
+	unsigned int			pblksize;
+	bool				unmap, unmap_zeroes;
+	const struct fsg_backend	*backend;
+	void				*backend_data = NULL;
+	const char			*args;
+	char				*spec = NULL;
+	struct fsg_cache		*cache = NULL;
+
+	ro = curlun->initially_ro;
+	backend = fsg_lun_find_backend(filename, &args);
+	if (backend) {
+		/* The name is kept for the file attribute */
+		spec = kstrdup(filename, GFP_KERNEL);
+		if (!spec)
+			return -ENOMEM;
+	}
+	if (backend && backend->create) {
+		/* No backing file */
+		backend_data = backend->create(curlun, args, &size);
+		if (IS_ERR(backend_data)) {
+			kfree(spec);
+			return PTR_ERR(backend_data);
+		}
+	} else {
+		if (backend)
+			filename = args;
+		filp = fsg_lun_open_file(curlun, filename, &ro);
+		if (IS_ERR(filp)) {
+			kfree(spec);
+			return PTR_ERR(filp);
+		}
+		inode = file_inode(filp);
+
+		size = i_size_read(inode->i_mapping->host);
+		if (size < 0) {
+			LINFO(curlun, "unable to find file size: %s\n",
+			      filename);
+			rc = (int) size;
+			goto out;
+		}
+
+		backend = fsg_lun_open_backend(curlun, filp, backend, &size,
+						&backend_data);
+		if (IS_ERR(backend)) {
+			rc = PTR_ERR(backend);
+			backend = NULL;
+			goto out;
+		}
+	}
+	if (backend && !backend->write)
 		ro = 1;
 
-	size = i_size_read(inode->i_mapping->host);
-	if (size < 0) {
-		LINFO(curlun, "unable to find file size: %s\n", filename);
-		rc = (int) size;
-		goto out;
+	/* Only part of a flat file may be exported */
+	if (curlun->win_offset || curlun->win_size) {
+		if (backend) {
+			LINFO(curlun, "offset and size not supported by the %s backend\n",
+			      backend->name);
+			goto out;
+		}
+		if (curlun->win_offset > size ||
+		    curlun->win_size > size - curlun->win_offset) {
+			LINFO(curlun, "window past the end of file: %s\n",
+			      filename);
+			goto out;
+		}
+		size = curlun->win_size ? : size - curlun->win_offset;
 	}
 
 	if (curlun->cdrom) {
 		blksize = 2048;
 		blkbits = 11;
-	} else if (inode->i_bdev) {
+		pblksize = blksize;
+	} else if (inode && inode->i_bdev) {
 		blksize = bdev_logical_block_size(inode->i_bdev);
 		blkbits = blksize_bits(blksize);
+		pblksize = bdev_physical_block_size(inode->i_bdev);
 	} else {
 		blksize = 512;
 		blkbits = 9;
+		/* Whole filesystem blocks avoid read-modify-write cycles */
+		pblksize = inode ? inode->i_sb->s_blocksize : PAGE_SIZE;
+	}
+
+	if (!IS_ALIGNED(curlun->win_offset, blksize)) {
+		LINFO(curlun, "offset not a multiple of %u: %s\n",
+		      blksize, filename);
+		goto out;
 	}
 
 	num_sectors = size >> blkbits; /* File size in logic-block-size blocks */
@@ -262,6 +719,54 @@ int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 		goto out;
 	}
 
+	/*
+	 * O_DIRECT transfers must be aligned to the logical block size of
+	 * the device underneath.  Smaller requests are bounced, but the
+	 * last block of the file must be a whole one or writing it would
+	 * extend the file.
+	 */
+	if (curlun->direct && backend) {
+		LINFO(curlun, "O_DIRECT not supported by the %s backend\n",
+		      backend->name);
+	} else if (curlun->direct) {
+		if (inode->i_bdev)
+			dio_align = bdev_logical_block_size(inode->i_bdev);
+		else if (inode->i_sb->s_bdev)
+			dio_align = bdev_logical_block_size(inode->i_sb->s_bdev);
+		else
+			dio_align = 512;
+		if (!IS_ALIGNED(num_sectors << blkbits, dio_align)) {
+			LINFO(curlun, "size not a multiple of %u for O_DIRECT: %s\n",
+			      dio_align, filename);
+			goto out;
+		}
+		spin_lock(&filp->f_lock);
+		filp->f_flags |= O_DIRECT;
+		spin_unlock(&filp->f_lock);
+	}
+
+	/* Holes read back as zeroes; discarded blocks may not */
+	if (backend) {
+		unmap = backend->discard != NULL;
+		unmap_zeroes = true;
+	} else if (inode->i_bdev) {
+		unmap = blk_queue_discard(bdev_get_queue(inode->i_bdev));
+		unmap_zeroes = bdev_discard_zeroes_data(inode->i_bdev);
+	} else {
+		unmap = !ro && fsg_lun_can_punch(filp);
+		unmap_zeroes = true;
+	}
+	unmap = unmap && !ro && !curlun->cdrom;
+
+	if (curlun->cache_size || curlun->cache_file) {
+		cache = fsg_cache_create(curlun, num_sectors << blkbits);
+		if (IS_ERR(cache)) {
+			rc = PTR_ERR(cache);
+			cache = NULL;
+			goto out;
+		}
+	}
+
 	if (fsg_lun_is_open(curlun))
 		fsg_lun_close(curlun);
 
@@ -271,11 +776,28 @@ int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 	curlun->filp = filp;
 	curlun->file_length = size;
 	curlun->num_sectors = num_sectors;
+	curlun->dio_align = dio_align;
+	/* READ CAPACITY(16) has four bits for the exponent */
+	curlun->pblk_exp = pblksize > blksize ?
+		min(ilog2(pblksize) - blkbits, 15u) : 0;
+	curlun->unmap = unmap;
+	curlun->unmap_zeroes = unmap && unmap_zeroes;
+	curlun->backend = backend;
+	curlun->backend_data = backend_data;
+	curlun->spec = spec;
+	curlun->cache = cache;
+	fsg_lun_reset_readahead(curlun);
 	LDBG(curlun, "open backing file: %s\n", filename);
 	return 0;
 
 out:
-	fput(filp);
+	if (cache)
+		fsg_cache_destroy(cache);
+	if (backend)
+		backend->close(backend_data);
+	if (filp)
+		fput(filp);
+	kfree(spec);
 	return rc;
 }
 EXPORT_SYMBOL_GPL(fsg_lun_open);
@@ -290,13 +812,255 @@ EXPORT_SYMBOL_GPL(fsg_lun_open);
 int fsg_lun_fsync_sub(struct fsg_lun *curlun)
 {
 	struct file	*filp = curlun->filp;
+	int		rc;
 
-	if (curlun->ro || !filp)
+	if (curlun->ro || !fsg_lun_is_open(curlun))
+		return 0;
+	if (curlun->cache) {
+		rc = fsg_cache_flush(curlun);
+		if (rc)
+			return rc;
+	}
+	if (curlun->backend && curlun->backend->fsync)
+		return curlun->backend->fsync(curlun);
+	if (!filp)
 		return 0;
 	return vfs_fsync(filp, 1);
 }
 EXPORT_SYMBOL_GPL(fsg_lun_fsync_sub);
 
+/*
+ * Deallocate part of the backing file: punch a hole in a regular file
+ * or discard the blocks of a block device.  -EOPNOTSUPP means the data
+ * was left in place.
+ */
+int fsg_lun_discard(struct fsg_lun *curlun, loff_t offset, loff_t length)
+{
+	struct file	*filp = curlun->filp;
+	struct inode	*inode;
+	int		rc;
+
+	if (!curlun->unmap)
+		return -EOPNOTSUPP;
+	if (curlun->cache) {
+		rc = fsg_cache_discard(curlun, offset, length);
+		if (rc)
+			return rc;
+	}
+	if (curlun->backend)
+		return curlun->backend->discard(curlun, offset, length);
+	offset = fsg_lun_file_offset(curlun, offset);
+	inode = file_inode(filp);
+	if (!S_ISBLK(inode->i_mode))
+		return vfs_fallocate(filp,
+				     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				     offset, length);
+
+	/* Like BLKDISCARD, don't leave stale data in the page cache */
+	truncate_inode_pages_range(filp->f_mapping, offset,
+				   offset + length - 1);
+	return blkdev_issue_discard(inode->i_bdev, offset >> 9, length >> 9,
+				    GFP_KERNEL, 0);
+}
+EXPORT_SYMBOL_GPL(fsg_lun_discard);
+
+/*
+ * Largest bounce buffer used for O_DIRECT transfers which aren't aligned
+ * to the backing device's logical block size.
+ */
+#define FSG_DIO_BOUNCE_LEN	SZ_64K
+
+static bool fsg_lun_dio_aligned(struct fsg_lun *curlun, const void *buf,
+				size_t amount, loff_t pos)
+{
+	unsigned int	mask = curlun->dio_align - 1;
+
+	return !(((unsigned long)buf | amount) & mask) && !(pos & mask);
+}
+
+/*
+ * O_DIRECT transfers to and from a kernel buffer.  vfs_read() and
+ * vfs_write() would hand direct I/O the buffer as a user iovec, for
+ * get_user_pages() to look up in a thread without a user mm; it gets the
+ * buffer's pages in a bvec instead, like the async reads of f_mass_storage.
+ */
+static ssize_t fsg_dio_rw(struct file *filp, void *buf, size_t amount,
+			  loff_t *pos, bool write)
+{
+	struct bio_vec	*bvec;
+	struct iov_iter	iter;
+	struct kiocb	kiocb;
+	unsigned int	n, off, len;
+	size_t		done;
+	ssize_t		rc;
+	void		*p;
+
+	n = DIV_ROUND_UP(offset_in_page(buf) + amount, PAGE_SIZE);
+	bvec = kmalloc_array(n, sizeof(*bvec), GFP_KERNEL);
+	if (!bvec)
+		return -ENOMEM;
+	for (n = 0, done = 0; done < amount; ++n, done += len) {
+		p = buf + done;
+		off = offset_in_page(p);
+		len = min_t(size_t, amount - done, PAGE_SIZE - off);
+		bvec[n].bv_page = is_vmalloc_addr(p) ? vmalloc_to_page(p) :
+			virt_to_page(p);
+		bvec[n].bv_offset = off;
+		bvec[n].bv_len = len;
+	}
+	iov_iter_bvec(&iter, ITER_BVEC | (write ? WRITE : READ), bvec, n,
+		      amount);
+
+	init_sync_kiocb(&kiocb, filp);
+	kiocb.ki_pos = *pos;
+	kiocb.ki_flags |= IOCB_DIRECT;
+	if (write) {
+		file_start_write(filp);
+		rc = filp->f_op->write_iter(&kiocb, &iter);
+		file_end_write(filp);
+	} else {
+		rc = filp->f_op->read_iter(&kiocb, &iter);
+	}
+	if (rc > 0)
+		*pos += rc;
+	kfree(bvec);
+	return rc;
+}
+
+/*
+ * Slow path for unaligned O_DIRECT transfers: go through an aligned bounce
+ * buffer covering whole logical blocks of the backing device.  For a
+ * write the partial blocks at either end are read in first.
+ */
+static ssize_t fsg_lun_bounce(struct fsg_lun *curlun, void *buf,
+			      size_t amount, loff_t *pos, bool write)
+{
+	struct file	*filp = curlun->filp;
+	unsigned int	align = curlun->dio_align;
+	size_t		bounce_len = max_t(size_t, FSG_DIO_BOUNCE_LEN, align);
+	size_t		done = 0, head, part, span;
+	loff_t		start, tmp;
+	ssize_t		rc = 0;
+	void		*bounce;
+
+	bounce = alloc_pages_exact(bounce_len, GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	while (done < amount) {
+		start = round_down(*pos + done, (loff_t)align);
+		head = *pos + done - start;
+		part = min(amount - done, bounce_len - head);
+		span = round_up(head + part, align);
+
+		if (write && head) {
+			tmp = start;
+			rc = fsg_dio_rw(filp, bounce, align, &tmp, false);
+			if (rc < 0)
+				break;
+		}
+		if (write && (head + part) % align &&
+		    (!head || span > align)) {
+			tmp = start + span - align;
+			rc = fsg_dio_rw(filp, bounce + span - align, align,
+					&tmp, false);
+			if (rc < 0)
+				break;
+		}
+
+		tmp = start;
+		if (write) {
+			memcpy(bounce + head, buf + done, part);
+			rc = fsg_dio_rw(filp, bounce, span, &tmp, true);
+		} else {
+			rc = fsg_dio_rw(filp, bounce, span, &tmp, false);
+		}
+		if (rc <= (ssize_t)head) {
+			rc = min_t(ssize_t, rc, 0);
+			break;
+		}
+		rc = min_t(size_t, rc - head, part);
+		if (!write)
+			memcpy(buf + done, bounce + head, rc);
+		done += rc;
+		if (rc < part)
+			break;
+	}
+
+	free_pages_exact(bounce, bounce_len);
+	*pos += done;
+	return done ? done : rc;
+}
+
+static ssize_t fsg_backend_rw(struct fsg_lun *curlun, void *buf,
+			      size_t amount, loff_t *pos, bool write)
+{
+	ssize_t	rc;
+
+	if (write && !curlun->backend->write)
+		rc = -EROFS;
+	else if (write)
+		rc = curlun->backend->write(curlun, buf, amount, *pos);
+	else
+		rc = curlun->backend->read(curlun, buf, amount, *pos);
+	if (rc > 0)
+		*pos += rc;
+	return rc;
+}
+
+static ssize_t fsg_flat_rw(struct fsg_lun *curlun, void *buf,
+			   size_t amount, loff_t *pos, bool write)
+{
+	loff_t	file_pos = fsg_lun_file_offset(curlun, *pos);
+	ssize_t	rc;
+
+	if (curlun->dio_align &&
+	    !fsg_lun_dio_aligned(curlun, buf, amount, file_pos))
+		rc = fsg_lun_bounce(curlun, buf, amount, &file_pos, write);
+	else if (curlun->dio_align)
+		rc = fsg_dio_rw(curlun->filp, buf, amount, &file_pos, write);
+	else if (write)
+		rc = vfs_write(curlun->filp, (const char __user *)buf, amount,
+			       &file_pos);
+	else
+		rc = vfs_read(curlun->filp, (char __user *)buf, amount,
+			      &file_pos);
+	*pos = file_pos - curlun->win_offset;
+	return rc;
+}
+
+/* The slow tier, for the cache: the backend or else the file itself */
+ssize_t fsg_lun_backing_rw(struct fsg_lun *curlun, void *buf, size_t amount,
+			   loff_t *pos, bool write)
+{
+	if (curlun->backend)
+		return fsg_backend_rw(curlun, buf, amount, pos, write);
+	return fsg_flat_rw(curlun, buf, amount, pos, write);
+}
+
+/*
+ * Read from and write to the backing file, with the same conventions as
+ * vfs_read() and vfs_write().  The caller must have set the address limit
+ * to KERNEL_DS.
+ */
+ssize_t fsg_lun_read(struct fsg_lun *curlun, void *buf, size_t amount,
+		     loff_t *pos)
+{
+	if (curlun->cache)
+		return fsg_cache_rw(curlun, buf, amount, pos, false);
+	return fsg_lun_backing_rw(curlun, buf, amount, pos, false);
+}
+EXPORT_SYMBOL_GPL(fsg_lun_read);
+
+ssize_t fsg_lun_write(struct fsg_lun *curlun, const void *buf, size_t amount,
+		      loff_t *pos)
+{
+	if (curlun->cache)
+		return fsg_cache_rw(curlun, (void *)buf, amount, pos, true);
+	return fsg_lun_backing_rw(curlun, (void *)buf, amount, pos, true);
+}
+EXPORT_SYMBOL_GPL(fsg_lun_write);
+
 void store_cdrom_address(u8 *dest, int msf, u32 addr)
 {
 	if (msf) {
@@ -340,7 +1104,9 @@ ssize_t fsg_show_file(struct fsg_lun *curlun, struct rw_semaphore *filesem,
 	ssize_t		rc;
 
 	down_read(filesem);
-	if (fsg_lun_is_open(curlun)) {	/* Get the complete pathname */
+	if (fsg_lun_is_open(curlun) && curlun->spec) {
+		rc = snprintf(buf, PAGE_SIZE, "%s\n", curlun->spec);
+	} else if (fsg_lun_is_open(curlun)) {	/* Get the complete pathname */
 		p = file_path(curlun->filp, buf, PAGE_SIZE - 1);
 		if (IS_ERR(p))
 			rc = PTR_ERR(p);
@@ -371,6 +1137,124 @@ ssize_t fsg_show_removable(struct fsg_lun *curlun, char *buf)
 }
 EXPORT_SYMBOL_GPL(fsg_show_removable);
 
+ssize_t fsg_show_readahead(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->ra_chunks);
+}
+EXPORT_SYMBOL_GPL(fsg_show_readahead);
+
+ssize_t fsg_show_readahead_stats(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "hits %lu misses %lu\n",
+		       curlun->ra_hits, curlun->ra_misses);
+}
+EXPORT_SYMBOL_GPL(fsg_show_readahead_stats);
+
+ssize_t fsg_show_zero_copy(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->zero_copy);
+}
+EXPORT_SYMBOL_GPL(fsg_show_zero_copy);
+
+ssize_t fsg_show_zero_copy_write(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->zero_copy_write);
+}
+EXPORT_SYMBOL_GPL(fsg_show_zero_copy_write);
+
+ssize_t fsg_show_direct(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->direct);
+}
+EXPORT_SYMBOL_GPL(fsg_show_direct);
+
+ssize_t fsg_show_bio(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->bio);
+}
+EXPORT_SYMBOL_GPL(fsg_show_bio);
+
+ssize_t fsg_show_wb_depth(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->wb_depth);
+}
+EXPORT_SYMBOL_GPL(fsg_show_wb_depth);
+
+ssize_t fsg_show_wb_dirty(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%u\n", curlun->wb_dirty);
+}
+EXPORT_SYMBOL_GPL(fsg_show_wb_dirty);
+
+ssize_t fsg_show_base(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		      char *buf)
+{
+	ssize_t		rc;
+
+	down_read(filesem);
+	rc = curlun->base ? sprintf(buf, "%s\n", curlun->base) : 0;
+	up_read(filesem);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_show_base);
+
+ssize_t fsg_show_offset(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%llu\n", (unsigned long long)curlun->win_offset);
+}
+EXPORT_SYMBOL_GPL(fsg_show_offset);
+
+ssize_t fsg_show_size(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%llu\n", (unsigned long long)curlun->win_size);
+}
+EXPORT_SYMBOL_GPL(fsg_show_size);
+
+ssize_t fsg_show_cache_size(struct fsg_lun *curlun, char *buf)
+{
+	return sprintf(buf, "%llu\n", (unsigned long long)curlun->cache_size);
+}
+EXPORT_SYMBOL_GPL(fsg_show_cache_size);
+
+ssize_t fsg_show_cache_file(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem, char *buf)
+{
+	ssize_t		rc;
+
+	down_read(filesem);
+	rc = curlun->cache_file ?
+		sprintf(buf, "%s\n", curlun->cache_file) : 0;
+	up_read(filesem);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_show_cache_file);
+
+ssize_t fsg_show_cache_stats(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem, char *buf)
+{
+	ssize_t		rc = 0;
+
+	down_read(filesem);
+	if (curlun->cache)
+		rc = fsg_cache_stats(curlun, buf);
+	up_read(filesem);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_show_cache_stats);
+
+ssize_t fsg_show_backend_stats(struct fsg_lun *curlun,
+			       struct rw_semaphore *filesem, char *buf)
+{
+	ssize_t		rc = 0;
+
+	down_read(filesem);
+	if (curlun->backend && curlun->backend->stats)
+		rc = curlun->backend->stats(curlun, buf);
+	up_read(filesem);
+	return rc;
+}
+EXPORT_SYMBOL_GPL(fsg_show_backend_stats);
+
 /*
  * The caller must hold fsg->filesem for reading when calling this function.
  */
@@ -485,6 +1369,269 @@ ssize_t fsg_store_cdrom(struct fsg_lun *curlun, struct rw_semaphore *filesem,
 }
 EXPORT_SYMBOL_GPL(fsg_store_cdrom);
 
+ssize_t fsg_store_readahead(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem,
+			    const char *buf, size_t count)
+{
+	unsigned int	chunks;
+	int		ret;
+
+	ret = kstrtouint(buf, 0, &chunks);
+	if (ret)
+		return ret;
+	if (chunks > FSG_MAX_RA_CHUNKS)
+		return -EINVAL;
+
+	/* Writing the attribute also clears the hit/miss counters */
+	down_write(filesem);
+	curlun->ra_chunks = chunks;
+	curlun->ra_hits = 0;
+	curlun->ra_misses = 0;
+	fsg_lun_reset_readahead(curlun);
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_readahead);
+
+ssize_t fsg_store_zero_copy(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem,
+			    const char *buf, size_t count)
+{
+	bool		zero_copy;
+	int		ret;
+
+	ret = strtobool(buf, &zero_copy);
+	if (ret)
+		return ret;
+
+	down_write(filesem);
+	curlun->zero_copy = zero_copy;
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_zero_copy);
+
+ssize_t fsg_store_zero_copy_write(struct fsg_lun *curlun,
+				  struct rw_semaphore *filesem,
+				  const char *buf, size_t count)
+{
+	bool		zero_copy_write;
+	int		ret;
+
+	ret = strtobool(buf, &zero_copy_write);
+	if (ret)
+		return ret;
+
+	down_write(filesem);
+	curlun->zero_copy_write = zero_copy_write;
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_zero_copy_write);
+
+/*
+ * The backing file is opened with O_DIRECT or not, so this can only be
+ * changed while no medium is loaded.
+ */
+ssize_t fsg_store_direct(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			 const char *buf, size_t count)
+{
+	bool		direct;
+	int		ret;
+
+	ret = strtobool(buf, &direct);
+	if (ret)
+		return ret;
+
+	down_read(filesem);
+	if (fsg_lun_is_open(curlun)) {
+		LDBG(curlun, "direct mode change prevented\n");
+		ret = -EBUSY;
+	} else {
+		curlun->direct = direct;
+		ret = count;
+	}
+	up_read(filesem);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(fsg_store_direct);
+
+/* Only takes effect when the backing file is a block device */
+ssize_t fsg_store_bio(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		      const char *buf, size_t count)
+{
+	bool		bio;
+	int		ret;
+
+	ret = strtobool(buf, &bio);
+	if (ret)
+		return ret;
+
+	down_write(filesem);
+	curlun->bio = bio;
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_bio);
+
+/*
+ * The write-behind queue only holds data while a WRITE command is being
+ * processed, which happens with filesem held for reading.  Taking it for
+ * writing here makes sure the limits don't change under a command.
+ */
+ssize_t fsg_store_wb_depth(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			   const char *buf, size_t count)
+{
+	unsigned int	depth;
+	int		ret;
+
+	ret = kstrtouint(buf, 0, &depth);
+	if (ret)
+		return ret;
+
+	down_write(filesem);
+	curlun->wb_depth = depth;
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_wb_depth);
+
+ssize_t fsg_store_wb_dirty(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			   const char *buf, size_t count)
+{
+	unsigned int	dirty;
+	int		ret;
+
+	ret = kstrtouint(buf, 0, &dirty);
+	if (ret)
+		return ret;
+
+	down_write(filesem);
+	curlun->wb_dirty = dirty;
+	up_write(filesem);
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(fsg_store_wb_dirty);
+
+/* Set a file name used when the medium is loaded, an empty one unsets it */
+static ssize_t fsg_store_path(struct fsg_lun *curlun,
+			      struct rw_semaphore *filesem,
+			      const char *buf, size_t count, char **path)
+{
+	char		*name = NULL;
+	ssize_t		ret = count;
+
+	/* Remove a trailing newline */
+	if (count > 0 && buf[count-1] == '\n')
+		--count;
+	if (count > 0) {
+		name = kstrndup(buf, count, GFP_KERNEL);
+		if (!name)
+			return -ENOMEM;
+	}
+
+	down_write(filesem);
+	if (fsg_lun_is_open(curlun)) {
+		LDBG(curlun, "file name change prevented\n");
+		ret = -EBUSY;
+	} else {
+		swap(*path, name);
+	}
+	up_write(filesem);
+
+	kfree(name);
+	return ret;
+}
+
+/*
+ * With a base image set, the backing file is opened as the delta of a
+ * copy-on-write overlay.  Like "direct" this only changes while no
+ * medium is loaded; an empty string goes back to plain backing files.
+ */
+ssize_t fsg_store_base(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		       const char *buf, size_t count)
+{
+	return fsg_store_path(curlun, filesem, buf, count, &curlun->base);
+}
+EXPORT_SYMBOL_GPL(fsg_store_base);
+
+/* Set a size or offset used when the medium is loaded */
+static ssize_t fsg_store_loff(struct fsg_lun *curlun,
+			      struct rw_semaphore *filesem,
+			      const char *buf, size_t count, loff_t *val)
+{
+	unsigned long long	v;
+	int			ret;
+
+	ret = kstrtoull(buf, 0, &v);
+	if (ret)
+		return ret;
+	if (v > LLONG_MAX)
+		return -EINVAL;
+
+	down_write(filesem);
+	if (fsg_lun_is_open(curlun)) {
+		LDBG(curlun, "size change prevented\n");
+		ret = -EBUSY;
+	} else {
+		*val = v;
+		ret = count;
+	}
+	up_write(filesem);
+
+	return ret;
+}
+
+/*
+ * offset and size export only that window of the backing file, a size
+ * of 0 meaning up to its end.  Both are checked when the file is opened
+ * and, like "direct", can only change while no medium is loaded.
+ */
+ssize_t fsg_store_offset(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			 const char *buf, size_t count)
+{
+	return fsg_store_loff(curlun, filesem, buf, count,
+			      &curlun->win_offset);
+}
+EXPORT_SYMBOL_GPL(fsg_store_offset);
+
+ssize_t fsg_store_size(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		       const char *buf, size_t count)
+{
+	return fsg_store_loff(curlun, filesem, buf, count, &curlun->win_size);
+}
+EXPORT_SYMBOL_GPL(fsg_store_size);
+
+/*
+ * A cache_size and/or a cache_file put a fast tier in front of the LUN
+ * when the medium is loaded: cache_size bytes of memory, or of the cache
+ * file, all of it by default.
+ */
+ssize_t fsg_store_cache_size(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem,
+			     const char *buf, size_t count)
+{
+	return fsg_store_loff(curlun, filesem, buf, count,
+			      &curlun->cache_size);
+}
+EXPORT_SYMBOL_GPL(fsg_store_cache_size);
+
+ssize_t fsg_store_cache_file(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem,
+			     const char *buf, size_t count)
+{
+	return fsg_store_path(curlun, filesem, buf, count,
+			      &curlun->cache_file);
+}
+EXPORT_SYMBOL_GPL(fsg_store_cache_file);
+
 ssize_t fsg_store_removable(struct fsg_lun *curlun, const char *buf,
 			    size_t count)
 {
@@ -2,7 +2,10 @@
 #define USB_STORAGE_COMMON_H
 
 #include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/sizes.h>
 #include <linux/usb/storage.h>
+#include <linux/usb/uas.h>
 #include <scsi/scsi.h>
 #include <asm/unaligned.h>
 
@@ -73,11 +76,13 @@ do {									\
 #define SS_COMMUNICATION_FAILURE		0x040800
 #define SS_INVALID_COMMAND			0x052000
 #define SS_INVALID_FIELD_IN_CDB			0x052400
+#define SS_INVALID_FIELD_IN_PARAMETER_LIST	0x052600
 #define SS_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE	0x052100
 #define SS_LOGICAL_UNIT_NOT_SUPPORTED		0x052500
 #define SS_MEDIUM_NOT_PRESENT			0x023a00
 #define SS_MEDIUM_REMOVAL_PREVENTED		0x055302
 #define SS_NOT_READY_TO_READY_TRANSITION	0x062800
+#define SS_PARAMETER_LIST_LENGTH_ERROR		0x051a00
 #define SS_RESET_OCCURRED			0x062900
 #define SS_SAVING_PARAMETERS_NOT_SUPPORTED	0x053900
 #define SS_UNRECOVERED_READ_ERROR		0x031100
@@ -94,6 +99,67 @@ do {									\
  */
 #define INQUIRY_STRING_LEN ((size_t) (8 + 16 + 4 + 1))
 
+struct fsg_lun;
+
+/*
+ * A backend maps the LUN's block addresses onto its backing storage when
+ * that isn't simply the same offsets in filp.  Backends with open() are
+ * chosen by a "name:<file>" filename and get the opened file; open()
+ * returns ERR_PTR(-ENOEXEC) for files that aren't in its format, or else
+ * its private data and the size of the LUN in *size.  read() and write() return the number of
+ * bytes transferred or an error, like vfs_read() and vfs_write().
+ * fsync() and discard() are optional; discarded blocks must read back
+ * as zeroes.  Without write() the LUN is read-only.  stats(), also
+ * optional, fills in the LUN's backend_stats attribute.
+ *
+ * Backends with create() instead of open() need no file at all: they are
+ * chosen by a "name:args" filename and filp stays NULL.  Those built on
+ * several files open them with fsg_backend_open_member().
+ *
+ * Zero-copy, read-ahead, O_DIRECT and the bio engine all work on filp's
+ * page cache or device directly, so they are off for such LUNs.
+ */
+struct fsg_backend {
+	const char	*name;
+	void		*(*open)(struct fsg_lun *curlun, struct file *filp,
+				 loff_t *size);
+	void		*(*create)(struct fsg_lun *curlun, const char *args,
+				   loff_t *size);
+	void		(*close)(void *data);
+	ssize_t		(*read)(struct fsg_lun *curlun, void *buf,
+				size_t amount, loff_t pos);
+	ssize_t		(*write)(struct fsg_lun *curlun, const void *buf,
+				 size_t amount, loff_t pos);
+	int		(*fsync)(struct fsg_lun *curlun);
+	int		(*discard)(struct fsg_lun *curlun, loff_t offset,
+				   loff_t length);
+	ssize_t		(*stats)(struct fsg_lun *curlun, char *buf);
+};
+
+struct file *fsg_backend_open_member(struct fsg_lun *curlun,
+				     const char *name, loff_t *size);
+
+extern const struct fsg_backend fsg_sparse_backend;
+extern const struct fsg_backend fsg_compressed_backend;
+extern const struct fsg_backend fsg_overlay_backend;
+extern const struct fsg_backend fsg_ram_backend;
+extern const struct fsg_backend fsg_null_backend;
+extern const struct fsg_backend fsg_pattern_backend;
+extern const struct fsg_backend fsg_user_backend;
+extern const struct fsg_backend fsg_stripe_backend;
+extern const struct fsg_backend fsg_mirror_backend;
+
+/* Fast tier in front of the backing file or backend, see storage_cache.c */
+struct fsg_cache;
+
+struct fsg_cache *fsg_cache_create(struct fsg_lun *curlun, loff_t size);
+void fsg_cache_destroy(struct fsg_cache *cache);
+ssize_t fsg_cache_rw(struct fsg_lun *curlun, void *buf, size_t amount,
+		     loff_t *pos, bool write);
+int fsg_cache_discard(struct fsg_lun *curlun, loff_t offset, loff_t length);
+int fsg_cache_flush(struct fsg_lun *curlun);
+ssize_t fsg_cache_stats(struct fsg_lun *curlun, char *buf);
+
 struct fsg_lun {
 	struct file	*filp;
 	loff_t		file_length;
@@ -107,6 +173,13 @@ struct fsg_lun {
 	unsigned int	registered:1;
 	unsigned int	info_valid:1;
 	unsigned int	nofua:1;
+	unsigned int	fua:1;		/* The WRITE in progress is FUA */
+	unsigned int	zero_copy:1;	/* READ straight from the page cache */
+	unsigned int	zero_copy_write:1; /* WRITE straight into it */
+	unsigned int	direct:1;	/* Open the backing file O_DIRECT */
+	unsigned int	bio:1;		/* Use the bio engine on block devices */
+	unsigned int	unmap:1;	/* Blocks can be deallocated */
+	unsigned int	unmap_zeroes:1;	/* and then read back as zeroes */
 
 	u32		sense_data;
 	u32		sense_data_info;
@@ -115,6 +188,34 @@ struct fsg_lun {
 	unsigned int	blkbits; /* Bits of logical block size
 						       of bound block device */
 	unsigned int	blksize; /* logical block size of bound block device */
+	unsigned int	dio_align; /* O_DIRECT alignment, see fsg_lun_read() */
+	unsigned int	pblk_exp; /* Logical blocks per physical block, log2 */
+
+	const struct fsg_backend *backend; /* NULL for a flat file */
+	void		*backend_data;
+	char		*base;		/* Overlay base image, filp is the delta */
+	char		*spec;		/* "name:args" of a file-less LUN */
+	loff_t		win_offset;	/* Window of a flat filp exported */
+	loff_t		win_size;	/* as the LUN, 0 = to its end */
+
+	/* Fast tier, see storage_cache.c */
+	loff_t		cache_size;	/* Bytes, 0 = all of cache_file */
+	char		*cache_file;	/* NULL to keep the tier in memory */
+	struct fsg_cache *cache;	/* NULL without a tier */
+
+	/* Sequential read-ahead, see fsg_lun_readahead() */
+	unsigned int	ra_chunks;	/* Buffers' worth to prefetch */
+	loff_t		ra_next;	/* Where a sequential READ would start */
+	loff_t		ra_start;	/* Prefetched window [ra_start, ra_end) */
+	loff_t		ra_end;
+	unsigned long	ra_hits;
+	unsigned long	ra_misses;
+	struct file_ra_state ra_state;
+
+	/* Write-behind stage, see do_write() */
+	unsigned int	wb_depth;	/* Max buffers queued, 0 = inline */
+	unsigned int	wb_dirty;	/* Max bytes queued, 0 = no limit */
+
 	struct device	dev;
 	const char	*name;		/* "lun.name" */
 	const char	**name_pfx;	/* "function.name" */
@@ -123,23 +224,64 @@ struct fsg_lun {
 
 static inline bool fsg_lun_is_open(struct fsg_lun *curlun)
 {
-	return curlun->filp != NULL;
+	return curlun->filp != NULL || curlun->backend != NULL;
+}
+
+/* Block addresses map straight onto offsets in filp, with nothing above */
+static inline bool fsg_lun_is_flat(struct fsg_lun *curlun)
+{
+	return !curlun->backend && !curlun->cache;
+}
+
+/* Offset in filp of an offset in a flat LUN */
+static inline loff_t fsg_lun_file_offset(struct fsg_lun *curlun,
+					 loff_t offset)
+{
+	return curlun->win_offset + offset;
+}
+
+/*
+ * Report the block that failed in the sense data.  The fixed format has
+ * only 32 bits for it, so a block past that is left out.
+ */
+static inline void fsg_lun_set_sense_info(struct fsg_lun *curlun, u64 lba)
+{
+	curlun->sense_data_info = lba;
+	curlun->info_valid = lba <= U32_MAX;
 }
 
 /* Default size of buffer length. */
 #define FSG_BUFLEN	((u32)16384)
 
+/* Range accepted for a configured buffer length, see fsg_buflen_validate() */
+#define FSG_MIN_BUFLEN	((u32)SZ_4K)
+#define FSG_MAX_BUFLEN	((u32)SZ_1M)
+
+/* Upper bound for the per-LUN read-ahead depth, in buffers */
+#define FSG_MAX_RA_CHUNKS	64
+
 /* Maximal number of LUNs supported in mass storage function */
 #define FSG_MAX_LUNS	16
 
+/* USB Attached SCSI: alternate setting and command queue depth */
+#define FSG_UAS_ALT		1
+#define FSG_UAS_LOG_STREAMS	4
+#define FSG_UAS_NUM_CMDS	(1 << FSG_UAS_LOG_STREAMS)
+/* Command IUs are short, but a request must take a full packet */
+#define FSG_UAS_CMD_BUFLEN	1024
+
 enum fsg_buffer_state {
 	BUF_STATE_EMPTY = 0,
 	BUF_STATE_FULL,
 	BUF_STATE_BUSY
 };
 
+struct fsg_common;
+
 struct fsg_buffhd {
 	void				*buf;
+	unsigned int			buflen;
+	struct fsg_common		*common;
 	enum fsg_buffer_state		state;
 	struct fsg_buffhd		*next;
 
@@ -150,10 +292,43 @@ struct fsg_buffhd {
 	 */
 	unsigned int			bulk_out_intended_length;
 
+	/*
+	 * Page-cache pages pinned for a zero-copy bulk-in transfer, or
+	 * locked by write_begin for a zero-copy bulk-out transfer, and the
+	 * scatter-gather list describing them.  See fsg_read_pages() and
+	 * fsg_write_begin_pages().
+	 */
+	struct scatterlist		*sg;
+	struct page			**pages;
+	void				**fsdata;
+	unsigned int			num_pages;
+	unsigned int			zc_write:1;
+	loff_t				zc_offset;
+
 	struct usb_request		*inreq;
 	int				inreq_busy;
 	struct usb_request		*outreq;
 	int				outreq_busy;
+
+	/* buf's mapping for the UDC while premapped, see fsg_bh_map() */
+	struct device			*dma_dev;
+	dma_addr_t			dma;
+
+	/* Pending write-behind of this buffer, see do_write() */
+	struct list_head		wb_list;
+	struct fsg_lun			*wb_lun;
+	loff_t				wb_offset;
+	unsigned int			wb_amount;
+
+	/*
+	 * Bio or kiocb in flight on this buffer, see fsg_bio_submit() and
+	 * fsg_aio_submit()
+	 */
+	int				bio_pending;
+	int				bio_error;
+	unsigned int			bio_amount;
+	struct kiocb			iocb;
+	struct bio_vec			*bvec;	/* The pages of buf */
 };
 
 enum fsg_state {
@@ -209,9 +384,38 @@ extern struct usb_endpoint_descriptor fsg_ss_bulk_out_desc;
 extern struct usb_ss_ep_comp_descriptor fsg_ss_bulk_out_comp_desc;
 extern struct usb_descriptor_header *fsg_ss_function[];
 
+extern struct usb_interface_descriptor fsg_uas_intf_desc;
+extern struct usb_pipe_usage_descriptor fsg_uas_cmd_pipe_desc;
+extern struct usb_pipe_usage_descriptor fsg_uas_status_pipe_desc;
+extern struct usb_pipe_usage_descriptor fsg_uas_data_in_pipe_desc;
+extern struct usb_pipe_usage_descriptor fsg_uas_data_out_pipe_desc;
+
+extern struct usb_endpoint_descriptor fsg_fs_uas_cmd_desc;
+extern struct usb_endpoint_descriptor fsg_fs_uas_status_desc;
+extern struct usb_descriptor_header *fsg_fs_uas_function[];
+
+extern struct usb_endpoint_descriptor fsg_hs_uas_cmd_desc;
+extern struct usb_endpoint_descriptor fsg_hs_uas_status_desc;
+extern struct usb_descriptor_header *fsg_hs_uas_function[];
+
+extern struct usb_endpoint_descriptor fsg_ss_uas_cmd_desc;
+extern struct usb_ss_ep_comp_descriptor fsg_ss_uas_cmd_comp_desc;
+extern struct usb_endpoint_descriptor fsg_ss_uas_status_desc;
+extern struct usb_ss_ep_comp_descriptor fsg_ss_uas_status_comp_desc;
+extern struct usb_ss_ep_comp_descriptor fsg_ss_uas_bulk_in_comp_desc;
+extern struct usb_ss_ep_comp_descriptor fsg_ss_uas_bulk_out_comp_desc;
+extern struct usb_descriptor_header *fsg_ss_uas_function[];
+
 void fsg_lun_close(struct fsg_lun *curlun);
 int fsg_lun_open(struct fsg_lun *curlun, const char *filename);
 int fsg_lun_fsync_sub(struct fsg_lun *curlun);
+int fsg_lun_discard(struct fsg_lun *curlun, loff_t offset, loff_t length);
+ssize_t fsg_lun_read(struct fsg_lun *curlun, void *buf, size_t amount,
+		     loff_t *pos);
+ssize_t fsg_lun_write(struct fsg_lun *curlun, const void *buf, size_t amount,
+		      loff_t *pos);
+ssize_t fsg_lun_backing_rw(struct fsg_lun *curlun, void *buf, size_t amount,
+			   loff_t *pos, bool write);
 void store_cdrom_address(u8 *dest, int msf, u32 addr);
 ssize_t fsg_show_ro(struct fsg_lun *curlun, char *buf);
 ssize_t fsg_show_nofua(struct fsg_lun *curlun, char *buf);
@@ -220,6 +424,25 @@ ssize_t fsg_show_file(struct fsg_lun *curlun, struct rw_semaphore *filesem,
 ssize_t fsg_show_inquiry_string(struct fsg_lun *curlun, char *buf);
 ssize_t fsg_show_cdrom(struct fsg_lun *curlun, char *buf);
 ssize_t fsg_show_removable(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_readahead(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_readahead_stats(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_zero_copy(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_zero_copy_write(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_direct(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_bio(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_wb_depth(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_wb_dirty(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_base(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		      char *buf);
+ssize_t fsg_show_backend_stats(struct fsg_lun *curlun,
+			       struct rw_semaphore *filesem, char *buf);
+ssize_t fsg_show_cache_size(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_cache_file(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem, char *buf);
+ssize_t fsg_show_cache_stats(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem, char *buf);
+ssize_t fsg_show_offset(struct fsg_lun *curlun, char *buf);
+ssize_t fsg_show_size(struct fsg_lun *curlun, char *buf);
 ssize_t fsg_store_ro(struct fsg_lun *curlun, struct rw_semaphore *filesem,
 		     const char *buf, size_t count);
 ssize_t fsg_store_nofua(struct fsg_lun *curlun, const char *buf, size_t count);
@@ -231,6 +454,35 @@ ssize_t fsg_store_removable(struct fsg_lun *curlun, const char *buf,
 			    size_t count);
 ssize_t fsg_store_inquiry_string(struct fsg_lun *curlun, const char *buf,
 				 size_t count);
+ssize_t fsg_store_readahead(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem,
+			    const char *buf, size_t count);
+ssize_t fsg_store_zero_copy(struct fsg_lun *curlun,
+			    struct rw_semaphore *filesem,
+			    const char *buf, size_t count);
+ssize_t fsg_store_zero_copy_write(struct fsg_lun *curlun,
+				  struct rw_semaphore *filesem,
+				  const char *buf, size_t count);
+ssize_t fsg_store_direct(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			 const char *buf, size_t count);
+ssize_t fsg_store_bio(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		      const char *buf, size_t count);
+ssize_t fsg_store_wb_depth(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			   const char *buf, size_t count);
+ssize_t fsg_store_wb_dirty(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			   const char *buf, size_t count);
+ssize_t fsg_store_base(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		       const char *buf, size_t count);
+ssize_t fsg_store_offset(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+			 const char *buf, size_t count);
+ssize_t fsg_store_size(struct fsg_lun *curlun, struct rw_semaphore *filesem,
+		       const char *buf, size_t count);
+ssize_t fsg_store_cache_size(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem,
+			     const char *buf, size_t count);
+ssize_t fsg_store_cache_file(struct fsg_lun *curlun,
+			     struct rw_semaphore *filesem,
+			     const char *buf, size_t count);
 
 #endif /* USB_STORAGE_COMMON_H */
 
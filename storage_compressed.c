@@ -0,0 +1,285 @@
+/*
+ * storage_compressed.c -- Compressed read-only image backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A compressed image stores the LUN in fixed-size blocks, each compressed
+ * on its own so that any of them can be read back without the others.
+ * It is opened with the filename "compressed:<file>" and starts with a
+ * header, all fields little-endian:
+ *
+ *	0	magic		"FSGCOMPR"
+ *	8	version		1
+ *	12	block_bits	log2 of the block size, 12 (4 KiB) to 20
+ *	16	size		size of the LUN in bytes
+ *	24	algorithm	crypto API compressor ("deflate", "lzo",
+ *				...), NUL-padded to 16 bytes
+ *	40	index_offset	where the block index starts
+ *
+ * The index holds one __le64 image offset per block plus one for the end
+ * of the last block, so block i takes up index[i] to index[i + 1].  A
+ * block as large as the block size is stored uncompressed, and an empty
+ * one reads back as zeroes.
+ *
+ * Decompressed blocks are kept in a small LRU cache, so that sequential
+ * READs smaller than a block only decompress it once.  Images are always
+ * read-only.
+ */
+
+#include <linux/module.h>
+#include <linux/crypto.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "storage_common.h"
+
+#define FSG_COMPR_MAGIC			"FSGCOMPR"
+#define FSG_COMPR_VERSION		1
+#define FSG_COMPR_MIN_BLOCK_BITS	12
+#define FSG_COMPR_MAX_BLOCK_BITS	20
+
+/* Memory for decompressed blocks, but never less than two of them */
+#define FSG_COMPR_CACHE_SIZE		SZ_512K
+
+struct fsg_compr_header {
+	char	magic[8];
+	__le32	version;
+	__le32	block_bits;
+	__le64	size;
+	char	algorithm[16];
+	__le64	index_offset;
+} __packed;
+
+struct fsg_compr_block {
+	struct list_head	lru;
+	u32			index;
+	bool			valid;
+	void			*data;
+};
+
+struct fsg_compr {
+	struct file		*filp;
+	struct crypto_comp	*tfm;
+	unsigned int		block_bits;
+	u32			num_blocks;
+	u64			*index;		/* num_blocks + 1 offsets */
+	void			*cbuf;		/* One compressed block */
+
+	struct mutex		lock;		/* Protects the cache */
+	struct list_head	lru;		/* Most recently used first */
+	unsigned int		num_cached;
+	struct fsg_compr_block	cache[];
+};
+
+static void fsg_compr_free(struct fsg_compr *c)
+{
+	unsigned int	i;
+
+	for (i = 0; i < c->num_cached; ++i)
+		vfree(c->cache[i].data);
+	vfree(c->cbuf);
+	vfree(c->index);
+	if (!IS_ERR_OR_NULL(c->tfm))
+		crypto_free_comp(c->tfm);
+	kfree(c);
+}
+
+static void fsg_compr_close(void *data)
+{
+	fsg_compr_free(data);
+}
+
+static int fsg_compr_load_index(struct fsg_lun *curlun, struct fsg_compr *c,
+				loff_t index_offset, loff_t image_size)
+{
+	size_t	len = ((size_t)c->num_blocks + 1) * sizeof(__le64);
+	size_t	block_size = 1 << c->block_bits;
+	u32	i;
+	int	rc;
+
+	c->index = vmalloc(len);
+	if (!c->index)
+		return -ENOMEM;
+	rc = kernel_read(c->filp, index_offset, (char *)c->index, len);
+	if (rc < 0)
+		return rc;
+	if (rc != len) {
+		LINFO(curlun, "compressed image index truncated\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i <= c->num_blocks; ++i) {
+		c->index[i] = le64_to_cpu((__force __le64)c->index[i]);
+		if (c->index[i] > image_size ||
+		    (i && (c->index[i] < c->index[i - 1] ||
+			   c->index[i] - c->index[i - 1] > block_size))) {
+			LINFO(curlun, "invalid compressed block %u\n", i);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static void *fsg_compr_open(struct fsg_lun *curlun, struct file *filp,
+			    loff_t *size)
+{
+	struct fsg_compr_header	hdr;
+	struct fsg_compr	*c;
+	loff_t			lun_size, block_mask;
+	unsigned int		block_bits, num_cached, i;
+	int			rc;
+
+	if (*size < sizeof(hdr))
+		return ERR_PTR(-ENOEXEC);
+	rc = kernel_read(filp, 0, (char *)&hdr, sizeof(hdr));
+	if (rc < 0)
+		return ERR_PTR(rc);
+	if (rc != sizeof(hdr) ||
+	    memcmp(hdr.magic, FSG_COMPR_MAGIC, sizeof(hdr.magic)))
+		return ERR_PTR(-ENOEXEC);
+
+	block_bits = le32_to_cpu(hdr.block_bits);
+	lun_size = le64_to_cpu(hdr.size);
+	if (le32_to_cpu(hdr.version) != FSG_COMPR_VERSION) {
+		LINFO(curlun, "unknown compressed image version %u\n",
+		      le32_to_cpu(hdr.version));
+		return ERR_PTR(-EINVAL);
+	}
+	if (block_bits < FSG_COMPR_MIN_BLOCK_BITS ||
+	    block_bits > FSG_COMPR_MAX_BLOCK_BITS || lun_size <= 0 ||
+	    ((lun_size - 1) >> block_bits) >= U32_MAX ||
+	    /* num_blocks + 1 index entries must fit in memory, on 32-bit too */
+	    ((lun_size - 1) >> block_bits) >= SIZE_MAX / sizeof(__le64) - 1) {
+		LINFO(curlun, "invalid compressed image geometry\n");
+		return ERR_PTR(-EINVAL);
+	}
+	hdr.algorithm[sizeof(hdr.algorithm) - 1] = 0;
+
+	num_cached = max(FSG_COMPR_CACHE_SIZE >> block_bits, 2);
+	c = kzalloc(sizeof(*c) + num_cached * sizeof(c->cache[0]),
+		    GFP_KERNEL);
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+	c->filp = filp;
+	c->block_bits = block_bits;
+	block_mask = (1 << block_bits) - 1;
+	c->num_blocks = (lun_size + block_mask) >> block_bits;
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->lru);
+
+	c->tfm = crypto_alloc_comp(hdr.algorithm, 0, 0);
+	if (IS_ERR(c->tfm)) {
+		LINFO(curlun, "no \"%s\" decompressor\n", hdr.algorithm);
+		rc = PTR_ERR(c->tfm);
+		goto fail;
+	}
+
+	rc = fsg_compr_load_index(curlun, c, le64_to_cpu(hdr.index_offset),
+				  *size);
+	if (rc)
+		goto fail;
+
+	rc = -ENOMEM;
+	c->cbuf = vmalloc(1 << block_bits);
+	if (!c->cbuf)
+		goto fail;
+	for (i = 0; i < num_cached; ++i) {
+		c->cache[i].data = vmalloc(1 << block_bits);
+		if (!c->cache[i].data)
+			goto fail;
+		list_add_tail(&c->cache[i].lru, &c->lru);
+		c->num_cached++;
+	}
+
+	*size = lun_size;
+	return c;
+
+fail:
+	fsg_compr_free(c);
+	return ERR_PTR(rc);
+}
+
+/* Find a block in the cache, or decompress it into the oldest entry */
+static struct fsg_compr_block *fsg_compr_get_block(struct fsg_lun *curlun,
+						   struct fsg_compr *c,
+						   u32 index)
+{
+	struct fsg_compr_block	*b;
+	size_t			block_size = 1 << c->block_bits;
+	size_t			len = c->index[index + 1] - c->index[index];
+	unsigned int		dlen = block_size;
+	int			rc;
+
+	list_for_each_entry(b, &c->lru, lru) {
+		if (b->valid && b->index == index)
+			goto found;
+	}
+
+	b = list_last_entry(&c->lru, struct fsg_compr_block, lru);
+	b->valid = false;
+	if (len == 0) {
+		dlen = 0;
+	} else {
+		/* Blocks which didn't shrink are stored as they are */
+		rc = kernel_read(c->filp, c->index[index],
+				 len == block_size ? b->data : c->cbuf, len);
+		if (rc != len)
+			return ERR_PTR(rc < 0 ? rc : -EIO);
+		if (len < block_size) {
+			rc = crypto_comp_decompress(c->tfm, c->cbuf, len,
+						    b->data, &dlen);
+			if (rc) {
+				LERROR(curlun, "bad compressed block %u: %d\n",
+				       index, rc);
+				return ERR_PTR(-EIO);
+			}
+		}
+	}
+	memset(b->data + dlen, 0, block_size - dlen);
+	b->index = index;
+	b->valid = true;
+
+found:
+	list_move(&b->lru, &c->lru);
+	return b;
+}
+
+static ssize_t fsg_compr_read(struct fsg_lun *curlun, void *buf,
+			      size_t amount, loff_t pos)
+{
+	struct fsg_compr	*c = curlun->backend_data;
+	struct fsg_compr_block	*b;
+	size_t			block_size = 1 << c->block_bits;
+	size_t			done = 0, offset, part;
+
+	mutex_lock(&c->lock);
+	while (done < amount) {
+		b = fsg_compr_get_block(curlun, c,
+					(pos + done) >> c->block_bits);
+		if (IS_ERR(b)) {
+			mutex_unlock(&c->lock);
+			return done ? done : PTR_ERR(b);
+		}
+		offset = (pos + done) & (block_size - 1);
+		part = min(amount - done, block_size - offset);
+		memcpy(buf + done, b->data + offset, part);
+		done += part;
+	}
+	mutex_unlock(&c->lock);
+	return done;
+}
+
+const struct fsg_backend fsg_compressed_backend = {
+	.name		= "compressed",
+	.open		= fsg_compr_open,
+	.close		= fsg_compr_close,
+	.read		= fsg_compr_read,
+};
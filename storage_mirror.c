@@ -0,0 +1,540 @@
+/*
+ * storage_mirror.c -- Mirrored multi-file backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A mirrored LUN keeps the same data on several backing files or devices,
+ * RAID-1 style.  It is opened with the filename
+ *
+ *	mirror:<file>,<file>[,...]
+ *
+ * and is as large as the smallest member.  Writes go to all the members
+ * at once, each from a worker of its own.  Reads of FSG_MIRROR_SPLIT or
+ * more are split into slices read from all the members in parallel;
+ * smaller ones go to the member whose last transfer ended closest to
+ * where they start, which keeps sequential streams on one member.
+ *
+ * The last FSG_MIRROR_META_SIZE bytes of every member (rounded down to
+ * that size) hold the mirror's state rather than data, all fields
+ * little-endian:
+ *
+ *	0	magic		"FSGMIRR0"
+ *	8	version		1
+ *	12	uuid		identifies the mirror, 16 bytes
+ *	28	events		bumped whenever a member is dropped
+ *
+ * Members without it get it when the mirror is first set up.  A member
+ * which fails a transfer is dropped from the mirror, and reads it failed
+ * are retried on another one; the LUN keeps going as long as one member
+ * is left.  The members still in use then get a higher events count, so
+ * that the dropped one, which missed the writes since, isn't used again
+ * when the medium is loaded next.  To re-add it, copy a member still in
+ * use over it, state and all, and load the medium again.  Per-member
+ * counts and latencies show up in the LUN's backend_stats attribute,
+ * which is the place to spot a slow or dropped card.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/uuid.h>
+#include <linux/workqueue.h>
+
+#include "storage_common.h"
+
+#define FSG_MIRROR_MAX_MEMBERS	4
+#define FSG_MIRROR_MAGIC	"FSGMIRR0"
+#define FSG_MIRROR_VERSION	1
+#define FSG_MIRROR_META_SIZE	4096
+
+struct fsg_mirror_meta {
+	char	magic[8];
+	__le32	version;
+	u8	uuid[16];
+	__le64	events;
+} __packed;
+
+/* Reads at least this large are spread over all the members */
+#define FSG_MIRROR_SPLIT	SZ_64K
+
+struct fsg_mirror;
+
+struct fsg_mirror_member {
+	struct fsg_mirror	*mirror;
+	struct file		*filp;
+	struct work_struct	work;
+	bool			failed;
+	loff_t			meta_pos;	/* Where its state is kept */
+	loff_t			next_pos;	/* Where the last transfer ended */
+
+	/* The current transfer */
+	void			*buf;
+	size_t			amount;
+	loff_t			pos;
+	bool			write;
+	ssize_t			result;
+
+	unsigned long		reads;
+	unsigned long		writes;
+	unsigned long		errors;
+	u64			read_ns;
+	u64			write_ns;
+	u64			max_ns;
+};
+
+struct fsg_mirror {
+	unsigned int		num_members;
+	u8			uuid[16];
+	u64			events;
+	struct workqueue_struct	*wq;
+	atomic_t		pending;
+	struct completion	done;
+	struct mutex		lock;		/* One transfer at a time */
+	struct fsg_mirror_member members[FSG_MIRROR_MAX_MEMBERS];
+};
+
+static void fsg_mirror_free(struct fsg_mirror *mr)
+{
+	unsigned int	i;
+
+	for (i = 0; i < mr->num_members; ++i)
+		fput(mr->members[i].filp);
+	if (mr->wq)
+		destroy_workqueue(mr->wq);
+	kfree(mr);
+}
+
+static void fsg_mirror_close(void *data)
+{
+	fsg_mirror_free(data);
+}
+
+static void fsg_mirror_work(struct work_struct *work);
+
+/*
+ * Write the state, with events bumped, to the members in use.  One which
+ * fails that is dropped too, and the others get yet another count.
+ * Read-only members are left alone.
+ */
+static int fsg_mirror_mark(struct fsg_lun *curlun, struct fsg_mirror *mr)
+{
+	struct fsg_mirror_member	*m;
+	struct fsg_mirror_meta		meta;
+	unsigned int			i, left;
+	bool				again;
+	int				rc;
+
+	memcpy(meta.magic, FSG_MIRROR_MAGIC, sizeof(meta.magic));
+	meta.version = cpu_to_le32(FSG_MIRROR_VERSION);
+	memcpy(meta.uuid, mr->uuid, sizeof(meta.uuid));
+	do {
+		meta.events = cpu_to_le64(++mr->events);
+		again = false;
+		left = 0;
+		for (i = 0; i < mr->num_members; ++i) {
+			m = &mr->members[i];
+			if (m->failed)
+				continue;
+			if (!(m->filp->f_mode & FMODE_WRITE)) {
+				++left;
+				continue;
+			}
+			rc = kernel_write(m->filp, (char *)&meta, sizeof(meta),
+					  m->meta_pos);
+			if (rc == sizeof(meta)) {
+				++left;
+				continue;
+			}
+			++m->errors;
+			m->failed = true;
+			again = true;
+			LERROR(curlun, "mirror member %u dropped: %d\n", i, rc);
+		}
+	} while (again && left);
+	return left ? 0 : -EIO;
+}
+
+/* Find out which members are up to date, or set a new mirror up */
+static int fsg_mirror_load(struct fsg_lun *curlun, struct fsg_mirror *mr)
+{
+	struct fsg_mirror_member	*m;
+	struct fsg_mirror_meta		meta;
+	u64				events[FSG_MIRROR_MAX_MEMBERS];
+	bool				found = false;
+	unsigned int			i, left = 0;
+	int				rc;
+
+	for (i = 0; i < mr->num_members; ++i) {
+		m = &mr->members[i];
+		events[i] = 0;
+		rc = kernel_read(m->filp, m->meta_pos, (char *)&meta,
+				 sizeof(meta));
+		if (rc < 0)
+			return rc;
+		if (rc != sizeof(meta) ||
+		    memcmp(meta.magic, FSG_MIRROR_MAGIC, sizeof(meta.magic)) ||
+		    le32_to_cpu(meta.version) != FSG_MIRROR_VERSION)
+			continue;
+		if (!found) {
+			memcpy(mr->uuid, meta.uuid, sizeof(mr->uuid));
+			found = true;
+		} else if (memcmp(mr->uuid, meta.uuid, sizeof(mr->uuid))) {
+			LINFO(curlun, "mirror member %u is from another mirror\n",
+			      i);
+			return -EINVAL;
+		}
+		events[i] = le64_to_cpu(meta.events);
+		mr->events = max(mr->events, events[i]);
+	}
+
+	if (!found) {
+		generate_random_uuid(mr->uuid);
+		return fsg_mirror_mark(curlun, mr);
+	}
+
+	for (i = 0; i < mr->num_members; ++i) {
+		if (events[i] == mr->events) {
+			++left;
+			continue;
+		}
+		mr->members[i].failed = true;
+		LERROR(curlun, "mirror member %u missed writes, not used\n", i);
+	}
+	if (left < mr->num_members)
+		return fsg_mirror_mark(curlun, mr);
+	return 0;
+}
+
+static void *fsg_mirror_create(struct fsg_lun *curlun, const char *args,
+			       loff_t *size)
+{
+	struct fsg_mirror_member	*m;
+	struct fsg_mirror		*mr;
+	loff_t				member_size, min_size = -1;
+	char				*names, *p, *name;
+	int				rc;
+
+	names = kstrdup(args, GFP_KERNEL);
+	mr = kzalloc(sizeof(*mr), GFP_KERNEL);
+	if (!names || !mr) {
+		rc = -ENOMEM;
+		goto fail;
+	}
+	mutex_init(&mr->lock);
+	init_completion(&mr->done);
+
+	p = names;
+	while ((name = strsep(&p, ",")) != NULL) {
+		if (mr->num_members == FSG_MIRROR_MAX_MEMBERS) {
+			LINFO(curlun, "too many mirror members\n");
+			rc = -EINVAL;
+			goto fail;
+		}
+		m = &mr->members[mr->num_members];
+		m->filp = fsg_backend_open_member(curlun, name, &member_size);
+		if (IS_ERR(m->filp)) {
+			rc = PTR_ERR(m->filp);
+			goto fail;
+		}
+		m->mirror = mr;
+		INIT_WORK(&m->work, fsg_mirror_work);
+		++mr->num_members;
+		m->meta_pos = round_down(member_size,
+					 (loff_t)FSG_MIRROR_META_SIZE) -
+			FSG_MIRROR_META_SIZE;
+		if (min_size < 0 || m->meta_pos < min_size)
+			min_size = max_t(loff_t, m->meta_pos, 0);
+	}
+	if (mr->num_members < 2 || min_size <= 0) {
+		LINFO(curlun, "a mirror needs two or more members over %u bytes\n",
+		      FSG_MIRROR_META_SIZE);
+		rc = -EINVAL;
+		goto fail;
+	}
+
+	rc = fsg_mirror_load(curlun, mr);
+	if (rc)
+		goto fail;
+
+	rc = -ENOMEM;
+	mr->wq = alloc_workqueue("fsg-mirror", WQ_UNBOUND, mr->num_members);
+	if (!mr->wq)
+		goto fail;
+
+	kfree(names);
+	*size = min_size;
+	return mr;
+
+fail:
+	kfree(names);
+	if (mr)
+		fsg_mirror_free(mr);
+	return ERR_PTR(rc);
+}
+
+/* Do one member's transfer and account for it */
+static void fsg_mirror_io(struct fsg_mirror_member *m)
+{
+	ktime_t		start = ktime_get();
+	size_t		done = 0;
+	ssize_t		rc = 0;
+	u64		ns;
+
+	while (done < m->amount) {
+		if (m->write)
+			rc = kernel_write(m->filp, m->buf + done,
+					  m->amount - done, m->pos + done);
+		else
+			rc = kernel_read(m->filp, m->pos + done, m->buf + done,
+					 m->amount - done);
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	m->result = done ? done : rc;
+	m->next_pos = m->pos + done;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (m->write) {
+		++m->writes;
+		m->write_ns += ns;
+	} else {
+		++m->reads;
+		m->read_ns += ns;
+	}
+	m->max_ns = max(m->max_ns, ns);
+}
+
+static void fsg_mirror_work(struct work_struct *work)
+{
+	struct fsg_mirror_member *m =
+		container_of(work, struct fsg_mirror_member, work);
+
+	fsg_mirror_io(m);
+	if (atomic_dec_and_test(&m->mirror->pending))
+		complete(&m->mirror->done);
+}
+
+static void fsg_mirror_fail(struct fsg_lun *curlun,
+			    struct fsg_mirror_member *m)
+{
+	struct fsg_mirror	*mr = m->mirror;
+
+	++m->errors;
+	if (!m->failed) {
+		m->failed = true;
+		LERROR(curlun, "mirror member %u dropped: %zd\n",
+		       (unsigned int)(m - mr->members), m->result);
+		/* So that it isn't used with the next medium load */
+		fsg_mirror_mark(curlun, mr);
+	}
+}
+
+static void fsg_mirror_set(struct fsg_mirror_member *m, void *buf,
+			   size_t amount, loff_t pos, bool write)
+{
+	m->buf = buf;
+	m->amount = amount;
+	m->pos = pos;
+	m->write = write;
+	m->result = -EIO;
+}
+
+/* Run the transfers set up on the members in mask, in parallel */
+static void fsg_mirror_run(struct fsg_mirror *mr, unsigned long mask)
+{
+	unsigned int	i;
+
+	reinit_completion(&mr->done);
+	atomic_set(&mr->pending, hweight_long(mask));
+	for_each_set_bit(i, &mask, mr->num_members)
+		queue_work(mr->wq, &mr->members[i].work);
+	wait_for_completion(&mr->done);
+}
+
+static unsigned long fsg_mirror_active(struct fsg_mirror *mr)
+{
+	unsigned long	mask = 0;
+	unsigned int	i;
+
+	for (i = 0; i < mr->num_members; ++i)
+		if (!mr->members[i].failed)
+			mask |= BIT(i);
+	return mask;
+}
+
+/* The active member whose last transfer ended nearest to pos */
+static struct fsg_mirror_member *fsg_mirror_pick(struct fsg_mirror *mr,
+						 loff_t pos)
+{
+	struct fsg_mirror_member	*m, *best = NULL;
+	unsigned int			i;
+	loff_t				dist, best_dist = 0;
+
+	for (i = 0; i < mr->num_members; ++i) {
+		m = &mr->members[i];
+		if (m->failed)
+			continue;
+		dist = abs64(m->next_pos - pos);
+		if (!best || dist < best_dist) {
+			best = m;
+			best_dist = dist;
+		}
+	}
+	return best;
+}
+
+/* Read a range from one member, falling back on the others */
+static ssize_t fsg_mirror_read_one(struct fsg_lun *curlun,
+				   struct fsg_mirror *mr, void *buf,
+				   size_t amount, loff_t pos)
+{
+	struct fsg_mirror_member	*m;
+
+	while ((m = fsg_mirror_pick(mr, pos)) != NULL) {
+		fsg_mirror_set(m, buf, amount, pos, false);
+		fsg_mirror_io(m);
+		if (m->result == amount)
+			return amount;
+		fsg_mirror_fail(curlun, m);
+	}
+	return -EIO;
+}
+
+static ssize_t fsg_mirror_read(struct fsg_lun *curlun, void *buf,
+			       size_t amount, loff_t pos)
+{
+	struct fsg_mirror	*mr = curlun->backend_data;
+	struct fsg_mirror_member *m;
+	unsigned long		mask;
+	unsigned int		i, n;
+	size_t			slice, done;
+	ssize_t			rc = amount;
+
+	mutex_lock(&mr->lock);
+	mask = fsg_mirror_active(mr);
+	n = hweight_long(mask);
+	if (amount < FSG_MIRROR_SPLIT || n < 2) {
+		rc = fsg_mirror_read_one(curlun, mr, buf, amount, pos);
+		goto out;
+	}
+
+	/* Page-sized slices, one per member */
+	slice = round_up(DIV_ROUND_UP(amount, n), PAGE_SIZE);
+	done = 0;
+	for_each_set_bit(i, &mask, mr->num_members) {
+		if (done >= amount) {
+			mask &= ~BIT(i);
+			continue;
+		}
+		fsg_mirror_set(&mr->members[i], buf + done,
+			       min(slice, amount - done), pos + done, false);
+		done += slice;
+	}
+	fsg_mirror_run(mr, mask);
+
+	for_each_set_bit(i, &mask, mr->num_members) {
+		m = &mr->members[i];
+		if (m->result == m->amount)
+			continue;
+		fsg_mirror_fail(curlun, m);
+		if (fsg_mirror_read_one(curlun, mr, m->buf, m->amount,
+					m->pos) < 0)
+			rc = -EIO;
+	}
+out:
+	mutex_unlock(&mr->lock);
+	return rc;
+}
+
+static ssize_t fsg_mirror_write(struct fsg_lun *curlun, const void *buf,
+				size_t amount, loff_t pos)
+{
+	struct fsg_mirror	*mr = curlun->backend_data;
+	struct fsg_mirror_member *m;
+	unsigned long		mask;
+	unsigned int		i;
+	ssize_t			rc = -EIO;
+
+	mutex_lock(&mr->lock);
+	mask = fsg_mirror_active(mr);
+	for_each_set_bit(i, &mask, mr->num_members)
+		fsg_mirror_set(&mr->members[i], (void *)buf, amount, pos,
+			       true);
+	fsg_mirror_run(mr, mask);
+
+	/* Done if any member has the data, and the others are dropped */
+	for_each_set_bit(i, &mask, mr->num_members) {
+		m = &mr->members[i];
+		if (m->result == amount)
+			rc = amount;
+		else
+			fsg_mirror_fail(curlun, m);
+	}
+	mutex_unlock(&mr->lock);
+	return rc;
+}
+
+static int fsg_mirror_fsync(struct fsg_lun *curlun)
+{
+	struct fsg_mirror		*mr = curlun->backend_data;
+	struct fsg_mirror_member	*m;
+	unsigned int			i;
+	int				rc = -EIO;
+
+	mutex_lock(&mr->lock);
+	for (i = 0; i < mr->num_members; ++i) {
+		m = &mr->members[i];
+		if (m->failed)
+			continue;
+		m->result = vfs_fsync(m->filp, 1);
+		if (m->result)
+			fsg_mirror_fail(curlun, m);
+		else
+			rc = 0;
+	}
+	mutex_unlock(&mr->lock);
+	return rc;
+}
+
+static u64 fsg_mirror_avg_us(u64 ns, unsigned long count)
+{
+	return count ? div64_u64(ns, (u64)count * NSEC_PER_USEC) : 0;
+}
+
+static ssize_t fsg_mirror_stats(struct fsg_lun *curlun, char *buf)
+{
+	struct fsg_mirror		*mr = curlun->backend_data;
+	struct fsg_mirror_member	*m;
+	unsigned int			i;
+	ssize_t				len = 0;
+
+	for (i = 0; i < mr->num_members; ++i) {
+		m = &mr->members[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"member %u %s reads %lu writes %lu errors %lu "
+			"read_us %llu write_us %llu max_us %llu\n",
+			i, m->failed ? "dropped" : "ok",
+			m->reads, m->writes, m->errors,
+			fsg_mirror_avg_us(m->read_ns, m->reads),
+			fsg_mirror_avg_us(m->write_ns, m->writes),
+			div_u64(m->max_ns, NSEC_PER_USEC));
+	}
+	return len;
+}
+
+const struct fsg_backend fsg_mirror_backend = {
+	.name		= "mirror",
+	.create		= fsg_mirror_create,
+	.close		= fsg_mirror_close,
+	.read		= fsg_mirror_read,
+	.write		= fsg_mirror_write,
+	.fsync		= fsg_mirror_fsync,
+	.stats		= fsg_mirror_stats,
+};
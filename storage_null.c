@@ -0,0 +1,195 @@
+/*
+ * storage_null.c -- Null and pattern generator backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Two file-less backends for soak tests, both opened with a filename
+ * giving the size of the LUN, like the RAM disk:
+ *
+ *	null:<size>	Writes are thrown away and reads return zeroes.
+ *
+ *	pattern:<size>	Reads return a fixed pattern seeded by the block
+ *			address, and writes are checked against the same
+ *			pattern.  Each 64-bit little-endian word holds its
+ *			own byte offset in the LUN (the LBA times the block
+ *			size plus its place in the block) XORed with
+ *			FSG_PATTERN_SEED, so a host can build the expected
+ *			data for any block without reading it first.
+ *
+ * Logical blocks written with anything but the pattern are counted, and
+ * the count and the first such block show up in the LUN's backend_stats
+ * attribute.  The pattern is generated and compared a word at a time,
+ * which keeps both well ahead of the USB link.
+ */
+
+#include <linux/module.h>
+#include <linux/atomic.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "storage_common.h"
+
+#define FSG_PATTERN_SEED	0x46534750415454ULL	/* "FSGPATT" */
+
+struct fsg_null {
+	atomic_long_t	mismatches;	/* Blocks which failed the check */
+	loff_t		first_mismatch;	/* Offset of the first of them */
+};
+
+static void *fsg_null_create(struct fsg_lun *curlun, const char *args,
+			     loff_t *size)
+{
+	struct fsg_null		*null;
+	unsigned long long	len;
+	char			*end;
+
+	len = memparse(args, &end);
+	if (end == args || *end || !len || len > LLONG_MAX) {
+		LINFO(curlun, "invalid LUN size: %s\n", args);
+		return ERR_PTR(-EINVAL);
+	}
+
+	null = kzalloc(sizeof(*null), GFP_KERNEL);
+	if (!null)
+		return ERR_PTR(-ENOMEM);
+	atomic_long_set(&null->mismatches, 0);
+	null->first_mismatch = -1;
+
+	*size = len;
+	return null;
+}
+
+static void fsg_null_close(void *data)
+{
+	kfree(data);
+}
+
+static ssize_t fsg_null_read(struct fsg_lun *curlun, void *buf,
+			     size_t amount, loff_t pos)
+{
+	memset(buf, 0, amount);
+	return amount;
+}
+
+static ssize_t fsg_null_write(struct fsg_lun *curlun, const void *buf,
+			      size_t amount, loff_t pos)
+{
+	return amount;
+}
+
+/* Nothing is stored, so there's nothing to give back either */
+static int fsg_null_discard(struct fsg_lun *curlun, loff_t offset,
+			    loff_t length)
+{
+	return 0;
+}
+
+const struct fsg_backend fsg_null_backend = {
+	.name		= "null",
+	.create		= fsg_null_create,
+	.close		= fsg_null_close,
+	.read		= fsg_null_read,
+	.write		= fsg_null_write,
+	.discard	= fsg_null_discard,
+};
+
+static inline u64 fsg_pattern_word(loff_t pos)
+{
+	return (u64)pos ^ FSG_PATTERN_SEED;
+}
+
+/* The pattern byte at any offset, for transfers which aren't aligned */
+static inline u8 fsg_pattern_byte(loff_t pos)
+{
+	return fsg_pattern_word(pos & ~7LL) >> (8 * (pos & 7));
+}
+
+static inline bool fsg_pattern_aligned(const void *buf, size_t amount,
+				       loff_t pos)
+{
+	return !(((unsigned long)buf | amount | pos) & 7);
+}
+
+static void fsg_pattern_fill(void *buf, size_t amount, loff_t pos)
+{
+	__le64	*p = buf;
+	size_t	i;
+
+	if (!fsg_pattern_aligned(buf, amount, pos)) {
+		for (i = 0; i < amount; ++i)
+			((u8 *)buf)[i] = fsg_pattern_byte(pos + i);
+		return;
+	}
+	for (i = 0; i < amount / 8; ++i, pos += 8)
+		p[i] = cpu_to_le64(fsg_pattern_word(pos));
+}
+
+static bool fsg_pattern_check(const void *buf, size_t amount, loff_t pos)
+{
+	const __le64	*p = buf;
+	size_t		i;
+
+	if (!fsg_pattern_aligned(buf, amount, pos)) {
+		for (i = 0; i < amount; ++i)
+			if (((const u8 *)buf)[i] != fsg_pattern_byte(pos + i))
+				return false;
+		return true;
+	}
+	for (i = 0; i < amount / 8; ++i, pos += 8)
+		if (p[i] != cpu_to_le64(fsg_pattern_word(pos)))
+			return false;
+	return true;
+}
+
+static ssize_t fsg_pattern_read(struct fsg_lun *curlun, void *buf,
+				size_t amount, loff_t pos)
+{
+	fsg_pattern_fill(buf, amount, pos);
+	return amount;
+}
+
+static ssize_t fsg_pattern_write(struct fsg_lun *curlun, const void *buf,
+				 size_t amount, loff_t pos)
+{
+	struct fsg_null	*null = curlun->backend_data;
+	size_t		done = 0, part;
+
+	while (done < amount) {
+		part = min_t(size_t, amount - done,
+			     curlun->blksize - ((pos + done) &
+						(curlun->blksize - 1)));
+		if (!fsg_pattern_check(buf + done, part, pos + done)) {
+			if (atomic_long_inc_return(&null->mismatches) == 1)
+				null->first_mismatch = pos + done;
+			LDBG(curlun, "pattern mismatch in block %llu\n",
+			     (unsigned long long)
+			     ((pos + done) >> curlun->blkbits));
+		}
+		done += part;
+	}
+	return amount;
+}
+
+static ssize_t fsg_pattern_stats(struct fsg_lun *curlun, char *buf)
+{
+	struct fsg_null	*null = curlun->backend_data;
+	loff_t		first = null->first_mismatch;
+
+	return sprintf(buf, "mismatches %lu first %lld\n",
+		       atomic_long_read(&null->mismatches),
+		       first < 0 ? -1LL : (long long) (first >> curlun->blkbits));
+}
+
+const struct fsg_backend fsg_pattern_backend = {
+	.name		= "pattern",
+	.create		= fsg_null_create,
+	.close		= fsg_null_close,
+	.read		= fsg_pattern_read,
+	.write		= fsg_pattern_write,
+	.stats		= fsg_pattern_stats,
+};
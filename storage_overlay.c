@@ -0,0 +1,414 @@
+/*
+ * storage_overlay.c -- Copy-on-write overlay backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * An overlay LUN shows a read-only base image with the host's changes
+ * kept apart in a delta file, so that many LUNs can share one base and
+ * each be reset by truncating its delta.  The delta is the LUN's backing
+ * file and the base is given in the LUN's "base" attribute.
+ *
+ * The delta starts with a header, all fields little-endian:
+ *
+ *	0	magic		"FSGDELTA"
+ *	8	version		1
+ *	12	cluster_bits	log2 of the cluster size, 12 (4 KiB) to 24
+ *	16	size		size of the base, and of the LUN, in bytes
+ *	24	bitmap_offset	where the bitmap of written clusters starts
+ *	32	data_offset	where the LUN's data starts, aligned to the
+ *				cluster size
+ *
+ * The bitmap has one bit per cluster of the LUN, least significant bit
+ * first, set once the cluster has been copied into the delta.  Cluster
+ * data is kept at data_offset plus its offset in the LUN, so the delta is
+ * a sparse file which only takes up space for the clusters written to.
+ *
+ * An empty delta is given a new header when the LUN is opened.  Reads
+ * take each cluster from the delta if its bit is set and from the base
+ * otherwise.  The first write to a cluster copies the rest of it up from
+ * the base, then the data goes in before the bit is set on disk.
+ */
+
+#include <linux/module.h>
+#include <linux/bitops.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "storage_common.h"
+
+#define FSG_DELTA_MAGIC			"FSGDELTA"
+#define FSG_DELTA_VERSION		1
+#define FSG_DELTA_MIN_CLUSTER_BITS	12
+#define FSG_DELTA_MAX_CLUSTER_BITS	24
+
+/* Layout of a new delta */
+#define FSG_DELTA_CLUSTER_BITS		16
+#define FSG_DELTA_BITMAP_OFFSET		512
+
+struct fsg_delta_header {
+	char	magic[8];
+	__le32	version;
+	__le32	cluster_bits;
+	__le64	size;
+	__le64	bitmap_offset;
+	__le64	data_offset;
+} __packed;
+
+struct fsg_overlay {
+	struct file	*delta;
+	struct file	*base;
+	loff_t		size;
+	unsigned int	cluster_bits;
+	u32		num_clusters;
+	loff_t		bitmap_offset;
+	loff_t		data_offset;
+	unsigned long	*written;	/* Little-endian, as on disk */
+	void		*cluster;	/* Bounce buffer for copying up */
+	struct mutex	lock;		/* Serialises copying up */
+};
+
+static void fsg_overlay_free(struct fsg_overlay *ov)
+{
+	vfree(ov->cluster);
+	vfree(ov->written);
+	if (ov->base)
+		fput(ov->base);
+	kfree(ov);
+}
+
+static void fsg_overlay_close(void *data)
+{
+	fsg_overlay_free(data);
+}
+
+/* Give an empty delta a header for the base it is laid over */
+static int fsg_overlay_create(struct fsg_lun *curlun, struct file *delta,
+			      struct fsg_delta_header *hdr, loff_t base_size)
+{
+	u32	num_clusters;
+	loff_t	data_offset;
+	ssize_t	rc;
+
+	if (!(delta->f_mode & FMODE_WRITE)) {
+		LINFO(curlun, "empty delta is read-only\n");
+		return -EINVAL;
+	}
+
+	num_clusters = DIV_ROUND_UP_ULL(base_size, 1 << FSG_DELTA_CLUSTER_BITS);
+	data_offset = round_up(FSG_DELTA_BITMAP_OFFSET +
+			       DIV_ROUND_UP(num_clusters, BITS_PER_BYTE),
+			       1 << FSG_DELTA_CLUSTER_BITS);
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, FSG_DELTA_MAGIC, sizeof(hdr->magic));
+	hdr->version = cpu_to_le32(FSG_DELTA_VERSION);
+	hdr->cluster_bits = cpu_to_le32(FSG_DELTA_CLUSTER_BITS);
+	hdr->size = cpu_to_le64(base_size);
+	hdr->bitmap_offset = cpu_to_le64(FSG_DELTA_BITMAP_OFFSET);
+	hdr->data_offset = cpu_to_le64(data_offset);
+
+	rc = kernel_write(delta, (char *)hdr, sizeof(*hdr), 0);
+	if (rc < 0)
+		return rc;
+	if (rc != sizeof(*hdr))
+		return -EIO;
+	LDBG(curlun, "new delta, %u clusters\n", num_clusters);
+	return 0;
+}
+
+static int fsg_overlay_load_bitmap(struct fsg_overlay *ov)
+{
+	size_t	len = DIV_ROUND_UP(ov->num_clusters, BITS_PER_BYTE);
+	size_t	done = 0;
+	int	rc;
+
+	while (done < len) {
+		rc = kernel_read(ov->delta, ov->bitmap_offset + done,
+				 (char *)ov->written + done, len - done);
+		if (rc < 0)
+			return rc;
+		if (rc == 0)
+			break;
+		done += rc;
+	}
+	/* A bitmap cut short by the end of the delta is all zeroes */
+	memset((char *)ov->written + done, 0, len - done);
+	return 0;
+}
+
+static struct file *fsg_overlay_open_base(struct fsg_lun *curlun,
+					  loff_t *size)
+{
+	struct file	*base;
+	struct inode	*inode;
+
+	base = filp_open(curlun->base, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(base)) {
+		LINFO(curlun, "unable to open base image: %s\n", curlun->base);
+		return base;
+	}
+
+	inode = file_inode(base);
+	if ((!S_ISREG(inode->i_mode) && !S_ISBLK(inode->i_mode)) ||
+	    !(base->f_mode & FMODE_CAN_READ)) {
+		LINFO(curlun, "invalid base image: %s\n", curlun->base);
+		fput(base);
+		return ERR_PTR(-EINVAL);
+	}
+	*size = i_size_read(inode->i_mapping->host);
+	return base;
+}
+
+static void *fsg_overlay_open(struct fsg_lun *curlun, struct file *filp,
+			      loff_t *size)
+{
+	struct fsg_delta_header	hdr;
+	struct fsg_overlay	*ov;
+	loff_t			base_size, cluster_mask, bitmap_end;
+	unsigned int		cluster_bits;
+	int			rc;
+
+	ov = kzalloc(sizeof(*ov), GFP_KERNEL);
+	if (!ov)
+		return ERR_PTR(-ENOMEM);
+	ov->delta = filp;
+	mutex_init(&ov->lock);
+
+	ov->base = fsg_overlay_open_base(curlun, &base_size);
+	if (IS_ERR(ov->base)) {
+		rc = PTR_ERR(ov->base);
+		ov->base = NULL;
+		goto fail;
+	}
+
+	if (*size == 0) {
+		rc = fsg_overlay_create(curlun, filp, &hdr, base_size);
+		if (rc)
+			goto fail;
+	} else {
+		rc = kernel_read(filp, 0, (char *)&hdr, sizeof(hdr));
+		if (rc < 0)
+			goto fail;
+		if (rc != sizeof(hdr) ||
+		    memcmp(hdr.magic, FSG_DELTA_MAGIC, sizeof(hdr.magic))) {
+			LINFO(curlun, "backing file is not a delta\n");
+			rc = -EINVAL;
+			goto fail;
+		}
+	}
+
+	rc = -EINVAL;
+	if (le32_to_cpu(hdr.version) != FSG_DELTA_VERSION) {
+		LINFO(curlun, "unknown delta version %u\n",
+		      le32_to_cpu(hdr.version));
+		goto fail;
+	}
+	if (le64_to_cpu(hdr.size) != base_size) {
+		LINFO(curlun, "delta is for a base of %llu bytes, not %lld\n",
+		      le64_to_cpu(hdr.size), (long long) base_size);
+		goto fail;
+	}
+
+	cluster_bits = le32_to_cpu(hdr.cluster_bits);
+	if (cluster_bits < FSG_DELTA_MIN_CLUSTER_BITS ||
+	    cluster_bits > FSG_DELTA_MAX_CLUSTER_BITS || base_size <= 0 ||
+	    ((base_size - 1) >> cluster_bits) >= U32_MAX) {
+		LINFO(curlun, "invalid delta geometry\n");
+		goto fail;
+	}
+	ov->size = base_size;
+	ov->cluster_bits = cluster_bits;
+	cluster_mask = (1 << cluster_bits) - 1;
+	ov->num_clusters = (base_size + cluster_mask) >> cluster_bits;
+	ov->bitmap_offset = le64_to_cpu(hdr.bitmap_offset);
+	ov->data_offset = le64_to_cpu(hdr.data_offset);
+
+	bitmap_end = ov->bitmap_offset +
+		DIV_ROUND_UP(ov->num_clusters, BITS_PER_BYTE);
+	if (ov->bitmap_offset < sizeof(hdr) || ov->data_offset < bitmap_end ||
+	    (ov->data_offset & cluster_mask)) {
+		LINFO(curlun, "invalid delta layout\n");
+		goto fail;
+	}
+
+	rc = -ENOMEM;
+	ov->written = vmalloc(BITS_TO_LONGS(ov->num_clusters) *
+			      sizeof(unsigned long));
+	ov->cluster = vmalloc(1 << cluster_bits);
+	if (!ov->written || !ov->cluster)
+		goto fail;
+	rc = fsg_overlay_load_bitmap(ov);
+	if (rc)
+		goto fail;
+
+	*size = base_size;
+	return ov;
+
+fail:
+	fsg_overlay_free(ov);
+	return ERR_PTR(rc);
+}
+
+/*
+ * How much of [pos, pos + left) lies in clusters which are all in the
+ * delta, or all not, as the one at pos is.
+ */
+static size_t fsg_overlay_extent(struct fsg_overlay *ov, loff_t pos,
+				 size_t left, bool *in_delta)
+{
+	u32	cluster = pos >> ov->cluster_bits;
+	u32	next;
+
+	*in_delta = test_bit_le(cluster, ov->written);
+	if (*in_delta)
+		next = find_next_zero_bit_le(ov->written, ov->num_clusters,
+					     cluster);
+	else
+		next = find_next_bit_le(ov->written, ov->num_clusters,
+					cluster);
+	return min_t(loff_t, left, ((loff_t)next << ov->cluster_bits) - pos);
+}
+
+/* Read from one file, with anything past its end reading as zeroes */
+static ssize_t fsg_overlay_read_file(struct file *filp, void *buf,
+				     size_t amount, loff_t pos)
+{
+	int	rc;
+
+	rc = kernel_read(filp, pos, buf, amount);
+	if (rc < 0)
+		return rc;
+	memset(buf + rc, 0, amount - rc);
+	return amount;
+}
+
+static ssize_t fsg_overlay_read(struct fsg_lun *curlun, void *buf,
+				size_t amount, loff_t pos)
+{
+	struct fsg_overlay	*ov = curlun->backend_data;
+	size_t			done = 0, part;
+	bool			in_delta;
+	ssize_t			rc;
+
+	while (done < amount) {
+		part = fsg_overlay_extent(ov, pos + done, amount - done,
+					  &in_delta);
+		if (in_delta)
+			rc = fsg_overlay_read_file(ov->delta, buf + done, part,
+						   ov->data_offset + pos + done);
+		else
+			rc = fsg_overlay_read_file(ov->base, buf + done, part,
+						   pos + done);
+		if (rc < 0)
+			return done ? done : rc;
+		done += part;
+	}
+	return done;
+}
+
+static int fsg_overlay_set_written(struct fsg_overlay *ov, u32 cluster)
+{
+	u8	*byte = (u8 *)ov->written + cluster / BITS_PER_BYTE;
+	ssize_t	rc;
+
+	set_bit_le(cluster, ov->written);
+	rc = kernel_write(ov->delta, byte, 1,
+			  ov->bitmap_offset + cluster / BITS_PER_BYTE);
+	if (rc != 1) {
+		clear_bit_le(cluster, ov->written);
+		return rc < 0 ? rc : -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Write part of a cluster which isn't in the delta yet.  Unless the write
+ * covers all of it, the cluster is read from the base first.
+ */
+static ssize_t fsg_overlay_copy_up(struct fsg_lun *curlun,
+				   struct fsg_overlay *ov, const void *buf,
+				   size_t part, loff_t pos)
+{
+	u32		cluster = pos >> ov->cluster_bits;
+	loff_t		start = (loff_t)cluster << ov->cluster_bits;
+	size_t		len = min_t(loff_t, 1 << ov->cluster_bits,
+				    ov->size - start);
+	const void	*data = buf;
+	ssize_t		rc;
+
+	mutex_lock(&ov->lock);
+	if (test_bit_le(cluster, ov->written)) {
+		/* Somebody else got here first */
+		mutex_unlock(&ov->lock);
+		return kernel_write(ov->delta, buf, part,
+				    ov->data_offset + pos);
+	}
+
+	if (part < len) {
+		rc = fsg_overlay_read_file(ov->base, ov->cluster, len, start);
+		if (rc < 0)
+			goto out;
+		memcpy(ov->cluster + (pos - start), buf, part);
+		data = ov->cluster;
+	}
+
+	rc = kernel_write(ov->delta, data, len, ov->data_offset + start);
+	if (rc < 0)
+		goto out;
+	if (rc != len) {
+		rc = -EIO;
+		goto out;
+	}
+	VLDBG(curlun, "copied up cluster %u\n", cluster);
+	rc = fsg_overlay_set_written(ov, cluster);
+	if (rc == 0)
+		rc = part;
+out:
+	mutex_unlock(&ov->lock);
+	return rc;
+}
+
+static ssize_t fsg_overlay_write(struct fsg_lun *curlun, const void *buf,
+				 size_t amount, loff_t pos)
+{
+	struct fsg_overlay	*ov = curlun->backend_data;
+	size_t			cluster_size = 1 << ov->cluster_bits;
+	size_t			done = 0, part;
+	bool			in_delta;
+	ssize_t			rc;
+
+	while (done < amount) {
+		part = fsg_overlay_extent(ov, pos + done, amount - done,
+					  &in_delta);
+		if (in_delta) {
+			rc = kernel_write(ov->delta, buf + done, part,
+					  ov->data_offset + pos + done);
+		} else {
+			part = min(amount - done, cluster_size -
+				   ((pos + done) & (cluster_size - 1)));
+			rc = fsg_overlay_copy_up(curlun, ov, buf + done, part,
+						 pos + done);
+		}
+		if (rc <= 0)
+			return done ? done : rc;
+		done += rc;
+		if (rc < part)
+			break;
+	}
+	return done;
+}
+
+const struct fsg_backend fsg_overlay_backend = {
+	.name		= "overlay",
+	.open		= fsg_overlay_open,
+	.close		= fsg_overlay_close,
+	.read		= fsg_overlay_read,
+	.write		= fsg_overlay_write,
+};
@@ -0,0 +1,184 @@
+/*
+ * storage_ram.c -- RAM disk backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A RAM disk LUN keeps its data in pages of memory, with no backing file
+ * and no VFS calls in the way.  It is opened with the filename
+ * "ram:<size>", where the size takes the usual K, M and G suffixes, and
+ * is lost when the medium is ejected.
+ *
+ * Pages are only allocated when first written, so a large LUN costs
+ * nothing until the host fills it, and discarding whole pages gives them
+ * back.  Reading and writing are plain memory copies: what's left is the
+ * cost of the gadget pipeline itself.
+ */
+
+#include <linux/module.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "storage_common.h"
+
+struct fsg_ram {
+	unsigned long	num_pages;
+	struct page	**pages;	/* NULL until first written */
+	struct mutex	lock;		/* Serialises allocation and freeing */
+};
+
+static void fsg_ram_close(void *data)
+{
+	struct fsg_ram	*ram = data;
+	unsigned long	i;
+
+	for (i = 0; i < ram->num_pages; ++i)
+		if (ram->pages[i])
+			__free_page(ram->pages[i]);
+	vfree(ram->pages);
+	kfree(ram);
+}
+
+static void *fsg_ram_create(struct fsg_lun *curlun, const char *args,
+			    loff_t *size)
+{
+	struct fsg_ram		*ram;
+	unsigned long long	len;
+	char			*end;
+
+	len = memparse(args, &end);
+	if (end == args || *end || !len) {
+		LINFO(curlun, "invalid RAM disk size: %s\n", args);
+		return ERR_PTR(-EINVAL);
+	}
+	len = PAGE_ALIGN(len);
+	if ((len >> PAGE_SHIFT) > totalram_pages) {
+		LINFO(curlun, "RAM disk larger than memory: %s\n", args);
+		return ERR_PTR(-EINVAL);
+	}
+
+	ram = kzalloc(sizeof(*ram), GFP_KERNEL);
+	if (!ram)
+		return ERR_PTR(-ENOMEM);
+	ram->num_pages = len >> PAGE_SHIFT;
+	ram->pages = vzalloc(ram->num_pages * sizeof(*ram->pages));
+	if (!ram->pages) {
+		kfree(ram);
+		return ERR_PTR(-ENOMEM);
+	}
+	mutex_init(&ram->lock);
+
+	*size = len;
+	return ram;
+}
+
+static struct page *fsg_ram_alloc_page(struct fsg_ram *ram,
+				       unsigned long index)
+{
+	struct page	*page;
+
+	mutex_lock(&ram->lock);
+	page = ram->pages[index];
+	if (!page) {
+		page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+		WRITE_ONCE(ram->pages[index], page);
+	}
+	mutex_unlock(&ram->lock);
+	return page;
+}
+
+static ssize_t fsg_ram_read(struct fsg_lun *curlun, void *buf,
+			    size_t amount, loff_t pos)
+{
+	struct fsg_ram	*ram = curlun->backend_data;
+	struct page	*page;
+	size_t		done = 0, offset, part;
+	void		*p;
+
+	while (done < amount) {
+		offset = (pos + done) & ~PAGE_MASK;
+		part = min_t(size_t, amount - done, PAGE_SIZE - offset);
+		page = READ_ONCE(ram->pages[(pos + done) >> PAGE_SHIFT]);
+		if (page) {
+			p = kmap_atomic(page);
+			memcpy(buf + done, p + offset, part);
+			kunmap_atomic(p);
+		} else {
+			memset(buf + done, 0, part);
+		}
+		done += part;
+	}
+	return done;
+}
+
+static ssize_t fsg_ram_write(struct fsg_lun *curlun, const void *buf,
+			     size_t amount, loff_t pos)
+{
+	struct fsg_ram	*ram = curlun->backend_data;
+	struct page	*page;
+	unsigned long	index;
+	size_t		done = 0, offset, part;
+	void		*p;
+
+	while (done < amount) {
+		index = (pos + done) >> PAGE_SHIFT;
+		offset = (pos + done) & ~PAGE_MASK;
+		part = min_t(size_t, amount - done, PAGE_SIZE - offset);
+		page = READ_ONCE(ram->pages[index]);
+		if (!page)
+			page = fsg_ram_alloc_page(ram, index);
+		if (!page)
+			return done ? done : -ENOMEM;
+		p = kmap_atomic(page);
+		memcpy(p + offset, buf + done, part);
+		kunmap_atomic(p);
+		done += part;
+	}
+	return done;
+}
+
+static int fsg_ram_discard(struct fsg_lun *curlun, loff_t offset,
+			   loff_t length)
+{
+	struct fsg_ram	*ram = curlun->backend_data;
+	loff_t		end = offset + length;
+	unsigned long	index;
+	size_t		part;
+	struct page	*page;
+
+	mutex_lock(&ram->lock);
+	for (; offset < end; offset += part) {
+		index = offset >> PAGE_SHIFT;
+		part = min_t(loff_t, end - offset,
+			     PAGE_SIZE - (offset & ~PAGE_MASK));
+		page = ram->pages[index];
+		if (!page)
+			continue;
+
+		/* Whole pages go back to the system */
+		if (part == PAGE_SIZE) {
+			WRITE_ONCE(ram->pages[index], NULL);
+			__free_page(page);
+		} else {
+			zero_user(page, offset & ~PAGE_MASK, part);
+		}
+	}
+	mutex_unlock(&ram->lock);
+	return 0;
+}
+
+const struct fsg_backend fsg_ram_backend = {
+	.name		= "ram",
+	.create		= fsg_ram_create,
+	.close		= fsg_ram_close,
+	.read		= fsg_ram_read,
+	.write		= fsg_ram_write,
+	.discard	= fsg_ram_discard,
+};
@@ -0,0 +1,425 @@
+/*
+ * storage_sparse.c -- Thin-provisioned sparse image backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A sparse image holds only the clusters the host has written to.  It is
+ * opened with the filename "sparse:<file>" -- never just because of what
+ * the file holds, which for a flat LUN the host decides -- and starts
+ * with a header, all fields little-endian:
+ *
+ *	0	magic		"FSGSPARS"
+ *	8	version		1
+ *	12	cluster_bits	log2 of the cluster size, 12 (4 KiB) to 24
+ *	16	size		size of the LUN in bytes
+ *	24	table_offset	where the cluster table starts
+ *	32	data_offset	where the first data cluster starts, aligned
+ *				to the cluster size
+ *
+ * The cluster table has one __le32 per cluster of the LUN: the position
+ * of its data in the image, counted in clusters, or 0 for a cluster which
+ * was never written and reads back as zeroes.  New clusters are appended
+ * to the image, so provisioning a LUN of any size only takes writing the
+ * header and extending the file past the (all zero) table.
+ *
+ * The table is loaded at open time together with a bitmap of the clusters
+ * in use, which lets reads of unallocated ranges be answered without any
+ * I/O.  Discarded clusters are dropped from the table and their space is
+ * returned with a hole; the image doesn't shrink.
+ */
+
+#include <linux/module.h>
+#include <linux/bitmap.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "storage_common.h"
+
+#define FSG_SPARSE_MAGIC		"FSGSPARS"
+#define FSG_SPARSE_VERSION		1
+#define FSG_SPARSE_MIN_CLUSTER_BITS	12
+#define FSG_SPARSE_MAX_CLUSTER_BITS	24
+
+struct fsg_sparse_header {
+	char	magic[8];
+	__le32	version;
+	__le32	cluster_bits;
+	__le64	size;
+	__le64	table_offset;
+	__le64	data_offset;
+} __packed;
+
+struct fsg_sparse {
+	struct file	*filp;
+	unsigned int	cluster_bits;
+	u32		num_clusters;
+	loff_t		table_offset;
+	u32		next_cluster;	/* Where the next one gets appended */
+	u32		*table;		/* Image cluster of each LUN cluster */
+	unsigned long	*allocated;	/* LUN clusters present in the image */
+	struct mutex	lock;		/* Serialises table updates */
+};
+
+static void fsg_sparse_free(struct fsg_sparse *sp)
+{
+	vfree(sp->allocated);
+	vfree(sp->table);
+	kfree(sp);
+}
+
+static void fsg_sparse_close(void *data)
+{
+	fsg_sparse_free(data);
+}
+
+static int fsg_sparse_load_table(struct fsg_lun *curlun,
+				 struct fsg_sparse *sp, loff_t data_offset)
+{
+	size_t		len = (size_t)sp->num_clusters * sizeof(*sp->table);
+	size_t		done = 0;
+	u32		first = data_offset >> sp->cluster_bits;
+	u32		i, entry;
+	int		rc;
+
+	while (done < len) {
+		rc = kernel_read(sp->filp, sp->table_offset + done,
+				 (char *)sp->table + done, len - done);
+		if (rc < 0)
+			return rc;
+		if (rc == 0)
+			break;
+		done += rc;
+	}
+	/* A table cut short by the end of the image is all zeroes */
+	memset((char *)sp->table + done, 0, len - done);
+
+	for (i = 0; i < sp->num_clusters; ++i) {
+		entry = le32_to_cpu((__force __le32)sp->table[i]);
+		sp->table[i] = entry;
+		if (!entry)
+			continue;
+		if (entry < first) {
+			LINFO(curlun, "sparse cluster %u inside the header\n",
+			      i);
+			return -EINVAL;
+		}
+		set_bit(i, sp->allocated);
+		sp->next_cluster = max(sp->next_cluster, entry + 1);
+	}
+	return 0;
+}
+
+static void *fsg_sparse_open(struct fsg_lun *curlun, struct file *filp,
+			     loff_t *size)
+{
+	struct fsg_sparse_header	hdr;
+	struct fsg_sparse		*sp;
+	loff_t				image_size, lun_size, table_end;
+	loff_t				data_offset, cluster_mask;
+	unsigned int			cluster_bits;
+	int				rc;
+
+	image_size = *size;
+	if (image_size < sizeof(hdr))
+		return ERR_PTR(-ENOEXEC);
+	rc = kernel_read(filp, 0, (char *)&hdr, sizeof(hdr));
+	if (rc < 0)
+		return ERR_PTR(rc);
+	if (rc != sizeof(hdr) ||
+	    memcmp(hdr.magic, FSG_SPARSE_MAGIC, sizeof(hdr.magic)))
+		return ERR_PTR(-ENOEXEC);
+
+	cluster_bits = le32_to_cpu(hdr.cluster_bits);
+	lun_size = le64_to_cpu(hdr.size);
+	if (le32_to_cpu(hdr.version) != FSG_SPARSE_VERSION) {
+		LINFO(curlun, "unknown sparse image version %u\n",
+		      le32_to_cpu(hdr.version));
+		return ERR_PTR(-EINVAL);
+	}
+	if (cluster_bits < FSG_SPARSE_MIN_CLUSTER_BITS ||
+	    cluster_bits > FSG_SPARSE_MAX_CLUSTER_BITS || lun_size <= 0 ||
+	    ((lun_size - 1) >> cluster_bits) >= U32_MAX ||
+	    /* The table must fit in memory, on 32-bit too */
+	    ((lun_size - 1) >> cluster_bits) >= SIZE_MAX / sizeof(u32)) {
+		LINFO(curlun, "invalid sparse image geometry\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+	if (!sp)
+		return ERR_PTR(-ENOMEM);
+	sp->filp = filp;
+	sp->cluster_bits = cluster_bits;
+	cluster_mask = (1 << cluster_bits) - 1;
+	sp->num_clusters = (lun_size + cluster_mask) >> cluster_bits;
+	sp->table_offset = le64_to_cpu(hdr.table_offset);
+	data_offset = le64_to_cpu(hdr.data_offset);
+	mutex_init(&sp->lock);
+
+	table_end = sp->table_offset +
+		(loff_t)sp->num_clusters * sizeof(*sp->table);
+	if (sp->table_offset < sizeof(hdr) || data_offset < table_end ||
+	    (data_offset & cluster_mask)) {
+		LINFO(curlun, "invalid sparse image layout\n");
+		rc = -EINVAL;
+		goto fail;
+	}
+
+	sp->table = vmalloc((size_t)sp->num_clusters * sizeof(*sp->table));
+	sp->allocated = vzalloc(BITS_TO_LONGS(sp->num_clusters) *
+				sizeof(unsigned long));
+	if (!sp->table || !sp->allocated) {
+		rc = -ENOMEM;
+		goto fail;
+	}
+
+	/* Never hand out clusters the table or a torn append still covers */
+	sp->next_cluster = max(data_offset,
+			       image_size + cluster_mask) >> cluster_bits;
+	rc = fsg_sparse_load_table(curlun, sp, data_offset);
+	if (rc)
+		goto fail;
+
+	*size = lun_size;
+	return sp;
+
+fail:
+	fsg_sparse_free(sp);
+	return ERR_PTR(rc);
+}
+
+/* Position of a LUN offset in the image, for an allocated cluster */
+static loff_t fsg_sparse_image_offset(struct fsg_sparse *sp, loff_t pos)
+{
+	u32	cluster = pos >> sp->cluster_bits;
+
+	return ((loff_t)sp->table[cluster] << sp->cluster_bits) +
+		(pos & ((1 << sp->cluster_bits) - 1));
+}
+
+/*
+ * How much of [pos, pos + left) is stored contiguously in the image,
+ * starting with the allocated cluster at pos.
+ */
+static size_t fsg_sparse_extent(struct fsg_sparse *sp, loff_t pos,
+				size_t left)
+{
+	u32	cluster = pos >> sp->cluster_bits;
+	size_t	cluster_size = 1 << sp->cluster_bits;
+	size_t	len = cluster_size - (pos & (cluster_size - 1));
+
+	while (len < left && cluster + 1 < sp->num_clusters &&
+	       sp->table[cluster + 1] == sp->table[cluster] + 1) {
+		++cluster;
+		len += cluster_size;
+	}
+	return min(len, left);
+}
+
+static ssize_t fsg_sparse_read(struct fsg_lun *curlun, void *buf,
+			       size_t amount, loff_t pos)
+{
+	struct fsg_sparse	*sp = curlun->backend_data;
+	size_t			done = 0, part;
+	u32			cluster, next;
+	int			rc;
+
+	while (done < amount) {
+		cluster = (pos + done) >> sp->cluster_bits;
+
+		/* Unallocated clusters read as zeroes, without any I/O */
+		if (!test_bit(cluster, sp->allocated)) {
+			next = find_next_bit(sp->allocated, sp->num_clusters,
+					     cluster);
+			part = min_t(loff_t, amount - done,
+				     ((loff_t)next << sp->cluster_bits) -
+				     (pos + done));
+			memset(buf + done, 0, part);
+			done += part;
+			continue;
+		}
+
+		part = fsg_sparse_extent(sp, pos + done, amount - done);
+		rc = kernel_read(sp->filp,
+				 fsg_sparse_image_offset(sp, pos + done),
+				 buf + done, part);
+		if (rc < 0)
+			return done ? done : rc;
+
+		/* The last cluster may not have been written out in full */
+		memset(buf + done + rc, 0, part - rc);
+		done += part;
+	}
+	return done;
+}
+
+static int fsg_sparse_set_entry(struct fsg_sparse *sp, u32 cluster,
+				u32 entry)
+{
+	__le32	le = cpu_to_le32(entry);
+	ssize_t	rc;
+
+	rc = kernel_write(sp->filp, (char *)&le, sizeof(le),
+			  sp->table_offset + (loff_t)cluster * sizeof(le));
+	if (rc < 0)
+		return rc;
+	if (rc != sizeof(le))
+		return -EIO;
+
+	sp->table[cluster] = entry;
+	if (entry)
+		set_bit(cluster, sp->allocated);
+	else
+		clear_bit(cluster, sp->allocated);
+	return 0;
+}
+
+/*
+ * Append a cluster to the image for the data at pos.  The data goes in
+ * before the table entry pointing at it; the rest of a new cluster is a
+ * hole and reads back as zeroes.
+ */
+static ssize_t fsg_sparse_alloc_write(struct fsg_lun *curlun,
+				      struct fsg_sparse *sp, const void *buf,
+				      size_t part, loff_t pos)
+{
+	u32	cluster = pos >> sp->cluster_bits;
+	u32	entry;
+	ssize_t	rc;
+
+	mutex_lock(&sp->lock);
+	if (test_bit(cluster, sp->allocated)) {
+		/* Somebody else got here first */
+		mutex_unlock(&sp->lock);
+		return kernel_write(sp->filp, buf, part,
+				    fsg_sparse_image_offset(sp, pos));
+	}
+	if (sp->next_cluster == U32_MAX) {
+		rc = -ENOSPC;
+		goto out;
+	}
+
+	entry = sp->next_cluster++;
+	rc = kernel_write(sp->filp, buf, part,
+			  ((loff_t)entry << sp->cluster_bits) +
+			  (pos & ((1 << sp->cluster_bits) - 1)));
+	if (rc <= 0)
+		goto out;
+	VLDBG(curlun, "sparse cluster %u at %u\n", cluster, entry);
+	if (fsg_sparse_set_entry(sp, cluster, entry))
+		rc = -EIO;
+out:
+	mutex_unlock(&sp->lock);
+	return rc;
+}
+
+static ssize_t fsg_sparse_write(struct fsg_lun *curlun, const void *buf,
+				size_t amount, loff_t pos)
+{
+	struct fsg_sparse	*sp = curlun->backend_data;
+	size_t			cluster_size = 1 << sp->cluster_bits;
+	size_t			done = 0, part;
+	ssize_t			rc;
+
+	while (done < amount) {
+		if (test_bit((pos + done) >> sp->cluster_bits,
+			     sp->allocated)) {
+			part = fsg_sparse_extent(sp, pos + done, amount - done);
+			rc = kernel_write(sp->filp, buf + done, part,
+					  fsg_sparse_image_offset(sp,
+								  pos + done));
+		} else {
+			part = min(amount - done, cluster_size -
+				   ((pos + done) & (cluster_size - 1)));
+			rc = fsg_sparse_alloc_write(curlun, sp, buf + done,
+						    part, pos + done);
+		}
+		if (rc <= 0)
+			return done ? done : rc;
+		done += rc;
+		if (rc < part)
+			break;
+	}
+	return done;
+}
+
+/* Zero part of an allocated cluster, preferably by punching a hole */
+static int fsg_sparse_zero(struct fsg_sparse *sp, loff_t pos, size_t len)
+{
+	loff_t	offset = fsg_sparse_image_offset(sp, pos);
+	size_t	part;
+	ssize_t	rc;
+
+	rc = vfs_fallocate(sp->filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			   offset, len);
+	if (rc != -EOPNOTSUPP)
+		return rc;
+
+	while (len) {
+		part = min_t(size_t, len, PAGE_SIZE);
+		rc = kernel_write(sp->filp, page_address(ZERO_PAGE(0)), part,
+				  offset);
+		if (rc < 0)
+			return rc;
+		if (rc != part)
+			return -EIO;
+		offset += part;
+		len -= part;
+	}
+	return 0;
+}
+
+static int fsg_sparse_discard(struct fsg_lun *curlun, loff_t offset,
+			      loff_t length)
+{
+	struct fsg_sparse	*sp = curlun->backend_data;
+	size_t			cluster_size = 1 << sp->cluster_bits;
+	loff_t			end = offset + length;
+	loff_t			image_offset;
+	size_t			part;
+	u32			cluster;
+	int			rc = 0;
+
+	mutex_lock(&sp->lock);
+	for (; offset < end && !rc; offset += part) {
+		cluster = offset >> sp->cluster_bits;
+		part = min_t(loff_t, end - offset,
+			     cluster_size - (offset & (cluster_size - 1)));
+		if (!test_bit(cluster, sp->allocated))
+			continue;
+
+		if (part < cluster_size) {
+			rc = fsg_sparse_zero(sp, offset, part);
+			continue;
+		}
+
+		/* Drop the whole cluster and give its space back */
+		image_offset = fsg_sparse_image_offset(sp, offset);
+		rc = fsg_sparse_set_entry(sp, cluster, 0);
+		if (rc)
+			break;
+		vfs_fallocate(sp->filp,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      image_offset, cluster_size);
+	}
+	mutex_unlock(&sp->lock);
+	return rc;
+}
+
+const struct fsg_backend fsg_sparse_backend = {
+	.name		= "sparse",
+	.open		= fsg_sparse_open,
+	.close		= fsg_sparse_close,
+	.read		= fsg_sparse_read,
+	.write		= fsg_sparse_write,
+	.discard	= fsg_sparse_discard,
+};
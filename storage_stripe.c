@@ -0,0 +1,295 @@
+/*
+ * storage_stripe.c -- Striped multi-file backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A striped LUN spreads its blocks over several backing files or devices,
+ * RAID-0 style, so that it is bounded by their combined size and speed
+ * rather than by a single one.  It is opened with the filename
+ *
+ *	stripe:<stripe size>:<file>,<file>[,...]
+ *
+ * where the stripe size is a power of two of at least 512 bytes, given
+ * with the usual K and M suffixes.  Stripe n of the LUN is stripe
+ * n / members of member n % members.  Every member contributes as many
+ * whole stripes as the smallest one holds.
+ *
+ * Transfers are split at stripe boundaries and each member's share is
+ * handed to a worker of its own, so that the members are busy at the
+ * same time.  The members are opened read-only if the LUN is.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "storage_common.h"
+
+#define FSG_STRIPE_MAX_MEMBERS	8
+
+struct fsg_stripe;
+
+struct fsg_stripe_member {
+	struct fsg_stripe	*stripe;
+	struct file		*filp;
+	struct work_struct	work;
+
+	/* The current transfer */
+	void			*buf;
+	size_t			amount;
+	loff_t			pos;
+	bool			write;
+	loff_t			failed;		/* First offset not done */
+	int			error;
+};
+
+struct fsg_stripe {
+	unsigned int		stripe_bits;
+	unsigned int		num_members;
+	struct workqueue_struct	*wq;
+	atomic_t		pending;
+	struct completion	done;
+	struct mutex		lock;		/* One transfer at a time */
+	struct fsg_stripe_member members[FSG_STRIPE_MAX_MEMBERS];
+};
+
+static void fsg_stripe_free(struct fsg_stripe *st)
+{
+	unsigned int	i;
+
+	for (i = 0; i < st->num_members; ++i)
+		fput(st->members[i].filp);
+	if (st->wq)
+		destroy_workqueue(st->wq);
+	kfree(st);
+}
+
+static void fsg_stripe_close(void *data)
+{
+	fsg_stripe_free(data);
+}
+
+static int fsg_stripe_add(struct fsg_lun *curlun, struct fsg_stripe *st,
+			  const char *name, loff_t *min_size)
+{
+	struct fsg_stripe_member	*m = &st->members[st->num_members];
+	struct file			*filp;
+	loff_t				size;
+
+	if (st->num_members == FSG_STRIPE_MAX_MEMBERS) {
+		LINFO(curlun, "too many stripe members\n");
+		return -EINVAL;
+	}
+
+	filp = fsg_backend_open_member(curlun, name, &size);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	if (*min_size < 0 || size < *min_size)
+		*min_size = size;
+
+	m->stripe = st;
+	m->filp = filp;
+	++st->num_members;
+	return 0;
+}
+
+static void fsg_stripe_work(struct work_struct *work);
+
+static void *fsg_stripe_create(struct fsg_lun *curlun, const char *args,
+			       loff_t *size)
+{
+	struct fsg_stripe	*st;
+	unsigned long long	stripe_size;
+	loff_t			min_size = -1;
+	char			*names, *p, *name;
+	unsigned int		i;
+	int			rc;
+
+	stripe_size = memparse(args, &p);
+	if (p == args || *p != ':' || stripe_size < 512 ||
+	    stripe_size > SZ_1G || !is_power_of_2(stripe_size)) {
+		LINFO(curlun, "invalid stripe size: %s\n", args);
+		return ERR_PTR(-EINVAL);
+	}
+
+	names = kstrdup(p + 1, GFP_KERNEL);
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!names || !st) {
+		rc = -ENOMEM;
+		goto fail;
+	}
+	st->stripe_bits = ilog2(stripe_size);
+	mutex_init(&st->lock);
+	init_completion(&st->done);
+
+	p = names;
+	while ((name = strsep(&p, ",")) != NULL) {
+		rc = fsg_stripe_add(curlun, st, name, &min_size);
+		if (rc)
+			goto fail;
+	}
+	min_size = round_down(min_size, (loff_t)stripe_size);
+	if (st->num_members < 2 || min_size <= 0) {
+		LINFO(curlun, "a stripe needs two or more non-empty members\n");
+		rc = -EINVAL;
+		goto fail;
+	}
+
+	rc = -ENOMEM;
+	st->wq = alloc_workqueue("fsg-stripe", WQ_UNBOUND, st->num_members);
+	if (!st->wq)
+		goto fail;
+	for (i = 0; i < st->num_members; ++i)
+		INIT_WORK(&st->members[i].work, fsg_stripe_work);
+
+	kfree(names);
+	*size = min_size * st->num_members;
+	return st;
+
+fail:
+	kfree(names);
+	if (st)
+		fsg_stripe_free(st);
+	return ERR_PTR(rc);
+}
+
+/* Where a LUN offset lives: its member, and the offset in that member */
+static unsigned int fsg_stripe_map(struct fsg_stripe *st, loff_t pos,
+				   loff_t *offset)
+{
+	u64		stripe = pos >> st->stripe_bits;
+	unsigned int	member = do_div(stripe, st->num_members);
+
+	*offset = ((loff_t)stripe << st->stripe_bits) +
+		(pos & ((1 << st->stripe_bits) - 1));
+	return member;
+}
+
+/* Do one member's stripes of the transfer, in order */
+static void fsg_stripe_work(struct work_struct *work)
+{
+	struct fsg_stripe_member *m =
+		container_of(work, struct fsg_stripe_member, work);
+	struct fsg_stripe	*st = m->stripe;
+	size_t			stripe_size = 1 << st->stripe_bits;
+	size_t			done, part;
+	loff_t			pos, offset;
+	ssize_t			rc;
+
+	for (done = 0; done < m->amount; done += part) {
+		pos = m->pos + done;
+		part = min(m->amount - done,
+			   stripe_size - (pos & (stripe_size - 1)));
+		if (m - st->members != fsg_stripe_map(st, pos, &offset))
+			continue;
+
+		if (m->write)
+			rc = kernel_write(m->filp, m->buf + done, part,
+					  offset);
+		else
+			rc = kernel_read(m->filp, offset, m->buf + done,
+					 part);
+		if (rc < 0 || rc < part) {
+			m->failed = pos + max_t(ssize_t, rc, 0);
+			m->error = rc < 0 ? rc : -EIO;
+			break;
+		}
+	}
+
+	if (atomic_dec_and_test(&st->pending))
+		complete(&st->done);
+}
+
+static ssize_t fsg_stripe_rw(struct fsg_lun *curlun, void *buf,
+			     size_t amount, loff_t pos, bool write)
+{
+	struct fsg_stripe		*st = curlun->backend_data;
+	struct fsg_stripe_member	*m;
+	loff_t				end = pos + amount, offset;
+	u64				stripes;
+	unsigned int			i, n, first;
+	int				error = 0;
+
+	if (!amount)
+		return 0;
+
+	/* Only the members holding part of the transfer have work */
+	first = fsg_stripe_map(st, pos, &offset);
+	stripes = ((end - 1) >> st->stripe_bits) - (pos >> st->stripe_bits);
+	n = min_t(u64, stripes + 1, st->num_members);
+
+	mutex_lock(&st->lock);
+	reinit_completion(&st->done);
+	atomic_set(&st->pending, n);
+	for (i = 0; i < st->num_members; ++i) {
+		m = &st->members[i];
+		m->buf = buf;
+		m->amount = amount;
+		m->pos = pos;
+		m->write = write;
+		m->failed = end;
+		m->error = 0;
+	}
+	if (n == 1) {
+		/* Within one stripe, the workers would only add latency */
+		fsg_stripe_work(&st->members[first].work);
+	} else {
+		for (i = 0; i < n; ++i)
+			queue_work(st->wq, &st->members[(first + i) %
+						       st->num_members].work);
+	}
+	wait_for_completion(&st->done);
+
+	/* Everything before the first failure was done */
+	end = pos + amount;
+	for (i = 0; i < st->num_members; ++i) {
+		m = &st->members[i];
+		if (m->failed < end) {
+			end = m->failed;
+			error = m->error;
+		}
+	}
+	mutex_unlock(&st->lock);
+	return end > pos ? end - pos : error;
+}
+
+static ssize_t fsg_stripe_read(struct fsg_lun *curlun, void *buf,
+			       size_t amount, loff_t pos)
+{
+	return fsg_stripe_rw(curlun, buf, amount, pos, false);
+}
+
+static ssize_t fsg_stripe_write(struct fsg_lun *curlun, const void *buf,
+				size_t amount, loff_t pos)
+{
+	return fsg_stripe_rw(curlun, (void *)buf, amount, pos, true);
+}
+
+static int fsg_stripe_fsync(struct fsg_lun *curlun)
+{
+	struct fsg_stripe	*st = curlun->backend_data;
+	unsigned int		i;
+	int			rc, ret = 0;
+
+	for (i = 0; i < st->num_members; ++i) {
+		rc = vfs_fsync(st->members[i].filp, 1);
+		if (rc && !ret)
+			ret = rc;
+	}
+	return ret;
+}
+
+const struct fsg_backend fsg_stripe_backend = {
+	.name		= "stripe",
+	.create		= fsg_stripe_create,
+	.close		= fsg_stripe_close,
+	.read		= fsg_stripe_read,
+	.write		= fsg_stripe_write,
+	.fsync		= fsg_stripe_fsync,
+};
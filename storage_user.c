@@ -0,0 +1,419 @@
+/*
+ * storage_user.c -- Userspace LUN backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * A "user:<size>" LUN hands its I/O to a daemon through a command ring
+ * shared over a character device; fsg_user.h has the protocol.  The
+ * daemon reads and writes the data slots in place, so the only copy is
+ * the one between a slot and the transfer buffer here.
+ *
+ * The transfer buffers themselves aren't mapped: the function frees and
+ * reallocates them when it parks an idle LUN or resizes the ring, which
+ * a mapping held by the daemon would outlive, and backend I/O also comes
+ * from cache tier lines, which are no buffhd's at all.  The slots stay
+ * put for as long as the device is open.
+ *
+ * Transfers are posted and completed one at a time: the ring is empty
+ * whenever the lock is free, which keeps slot ownership simple.  Without
+ * a daemon attached every command fails.
+ *
+ * The device and the LUN share the fsg_user structure, which goes away
+ * when the medium is ejected and the daemon has let go of the device.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "storage_common.h"
+#include "fsg_user.h"
+
+/* Biggest discard posted as one command */
+#define FSG_USER_MAX_DISCARD	SZ_1G
+
+struct fsg_user {
+	struct kref		ref;
+	struct miscdevice	misc;
+	char			name[16];
+	int			id;
+
+	loff_t			size;
+	void			*area;		/* Shared with the daemon */
+	struct fsg_user_mailbox	*mb;
+	struct fsg_user_cmd	*cmds;
+
+	struct mutex		lock;		/* Held for a whole transfer */
+	wait_queue_head_t	cmd_wait;	/* Daemon waits for commands */
+	wait_queue_head_t	done_wait;	/* LUN waits for completions */
+	bool			attached;
+	unsigned int		gen;		/* Bumped as a daemon leaves */
+	u32			head;
+	unsigned long		commands;
+	unsigned long		failures;
+};
+
+static DEFINE_IDA(fsg_user_ida);
+
+static void fsg_user_release_ref(struct kref *ref)
+{
+	struct fsg_user	*u = container_of(ref, struct fsg_user, ref);
+
+	ida_simple_remove(&fsg_user_ida, u->id);
+	vfree(u->area);
+	kfree(u);
+}
+
+static void *fsg_user_slot(struct fsg_user *u, u32 seq)
+{
+	return u->area + FSG_USER_DATA_OFFSET +
+		(seq % FSG_USER_RING_SIZE) * FSG_USER_SLOT_SIZE;
+}
+
+static bool fsg_user_gone(struct fsg_user *u, unsigned int gen)
+{
+	return READ_ONCE(u->gen) != gen || !READ_ONCE(u->attached);
+}
+
+/* Have the commands before seq completed, or the daemon gone away? */
+static bool fsg_user_done(struct fsg_user *u, unsigned int gen, u32 seq)
+{
+	return fsg_user_gone(u, gen) ||
+		(s32)(READ_ONCE(u->mb->cmd_tail) - seq) >= 0;
+}
+
+/* Wait for the ring to drain; the caller holds u->lock */
+static int fsg_user_wait(struct fsg_user *u, unsigned int gen, u32 seq)
+{
+	int	rc;
+
+	rc = wait_event_interruptible(u->done_wait,
+				      fsg_user_done(u, gen, seq));
+	if (rc)
+		return rc;
+	if (fsg_user_gone(u, gen))
+		return -EIO;
+	smp_rmb();		/* Read results after cmd_tail */
+	return 0;
+}
+
+static void fsg_user_post(struct fsg_user *u, u16 op, loff_t offset,
+			  u32 length)
+{
+	struct fsg_user_cmd	*cmd = &u->cmds[u->head % FSG_USER_RING_SIZE];
+
+	cmd->id = u->head;
+	cmd->op = op;
+	cmd->slot = u->head % FSG_USER_RING_SIZE;
+	cmd->offset = offset;
+	cmd->length = length;
+	cmd->result = -EIO;
+	++u->head;
+	++u->commands;
+}
+
+static void fsg_user_kick(struct fsg_user *u)
+{
+	smp_wmb();		/* Commands and data before cmd_head */
+	WRITE_ONCE(u->mb->cmd_head, u->head);
+	wake_up(&u->cmd_wait);
+}
+
+/*
+ * Post a batch of commands, no more than the ring holds, wait for them
+ * and gather the results.  Returns the bytes done, stopping at the first
+ * short command, or an error if none were.  Lengths are taken from what
+ * was posted rather than from the shared ring.
+ */
+static ssize_t fsg_user_batch(struct fsg_user *u, u16 op, void *buf,
+			      size_t amount, loff_t pos)
+{
+	unsigned int	gen = u->gen;
+	u32		first = u->head, seq;
+	size_t		posted, done = 0, part;
+	int		rc;
+
+	for (posted = 0; posted < amount; posted += part) {
+		part = min_t(size_t, amount - posted, FSG_USER_SLOT_SIZE);
+		if (op == FSG_USER_OP_WRITE)
+			memcpy(fsg_user_slot(u, u->head), buf + posted, part);
+		fsg_user_post(u, op, pos + posted, part);
+	}
+	fsg_user_kick(u);
+
+	rc = fsg_user_wait(u, gen, u->head);
+	if (rc)
+		return rc;
+
+	for (seq = first; seq != u->head; ++seq) {
+		part = min_t(size_t, amount - done, FSG_USER_SLOT_SIZE);
+		rc = READ_ONCE(u->cmds[seq % FSG_USER_RING_SIZE].result);
+		if (rc < 0 && !done) {
+			++u->failures;
+			return rc;
+		}
+		rc = clamp_t(int, rc, 0, part);
+		if (op == FSG_USER_OP_READ)
+			memcpy(buf + done, fsg_user_slot(u, seq), rc);
+		done += rc;
+		if (rc < part)
+			break;
+	}
+	return done;
+}
+
+static ssize_t fsg_user_transfer(struct fsg_lun *curlun, u16 op, void *buf,
+				 size_t amount, loff_t pos)
+{
+	struct fsg_user	*u = curlun->backend_data;
+	size_t		done = 0, part;
+	ssize_t		rc;
+
+	mutex_lock(&u->lock);
+	/* A transfer cut short by a signal may have left commands behind */
+	rc = fsg_user_wait(u, u->gen, u->head);
+	while (!rc && done < amount) {
+		part = min_t(size_t, amount - done,
+			     FSG_USER_RING_SIZE * FSG_USER_SLOT_SIZE);
+		rc = fsg_user_batch(u, op, buf + done, part, pos + done);
+		if (rc <= 0)
+			break;
+		done += rc;
+		rc = rc < part ? -EIO : 0;
+	}
+	mutex_unlock(&u->lock);
+	return done ? done : rc;
+}
+
+static ssize_t fsg_user_read(struct fsg_lun *curlun, void *buf,
+			     size_t amount, loff_t pos)
+{
+	return fsg_user_transfer(curlun, FSG_USER_OP_READ, buf, amount, pos);
+}
+
+static ssize_t fsg_user_write(struct fsg_lun *curlun, const void *buf,
+			      size_t amount, loff_t pos)
+{
+	return fsg_user_transfer(curlun, FSG_USER_OP_WRITE, (void *)buf,
+				 amount, pos);
+}
+
+/* Post one command without data and wait for it */
+static int fsg_user_command(struct fsg_user *u, u16 op, loff_t offset,
+			    u32 length)
+{
+	unsigned int	gen;
+	int		rc;
+
+	mutex_lock(&u->lock);
+	gen = u->gen;
+	rc = fsg_user_wait(u, gen, u->head);
+	if (!rc) {
+		fsg_user_post(u, op, offset, length);
+		fsg_user_kick(u);
+		rc = fsg_user_wait(u, gen, u->head);
+	}
+	if (!rc)
+		rc = min(READ_ONCE(u->cmds[(u->head - 1) %
+					   FSG_USER_RING_SIZE].result), 0);
+	if (rc)
+		++u->failures;
+	mutex_unlock(&u->lock);
+	return rc;
+}
+
+static int fsg_user_fsync(struct fsg_lun *curlun)
+{
+	return fsg_user_command(curlun->backend_data, FSG_USER_OP_FLUSH, 0, 0);
+}
+
+static int fsg_user_discard(struct fsg_lun *curlun, loff_t offset,
+			    loff_t length)
+{
+	loff_t	part;
+	int	rc = 0;
+
+	for (; length && !rc; offset += part, length -= part) {
+		part = min_t(loff_t, length, FSG_USER_MAX_DISCARD);
+		rc = fsg_user_command(curlun->backend_data,
+				      FSG_USER_OP_DISCARD, offset, part);
+	}
+	return rc;
+}
+
+static ssize_t fsg_user_stats(struct fsg_lun *curlun, char *buf)
+{
+	struct fsg_user	*u = curlun->backend_data;
+
+	return sprintf(buf, "device %s daemon %u commands %lu failures %lu\n",
+		       u->name, READ_ONCE(u->attached), u->commands,
+		       u->failures);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static struct fsg_user *fsg_user_from_file(struct file *file)
+{
+	return container_of(file->private_data, struct fsg_user, misc);
+}
+
+static int fsg_user_dev_open(struct inode *inode, struct file *file)
+{
+	struct fsg_user	*u = fsg_user_from_file(file);
+	int		rc = 0;
+
+	mutex_lock(&u->lock);
+	if (u->attached) {
+		rc = -EBUSY;
+	} else {
+		/* Whatever the last daemon left in the ring has failed */
+		u->head = 0;
+		u->mb->cmd_head = 0;
+		u->mb->cmd_tail = 0;
+		u->attached = true;
+		kref_get(&u->ref);
+	}
+	mutex_unlock(&u->lock);
+	return rc;
+}
+
+static int fsg_user_dev_release(struct inode *inode, struct file *file)
+{
+	struct fsg_user	*u = fsg_user_from_file(file);
+
+	/* Not under u->lock, which a waiting transfer may hold */
+	WRITE_ONCE(u->attached, false);
+	WRITE_ONCE(u->gen, u->gen + 1);
+	wake_up_all(&u->done_wait);
+	kref_put(&u->ref, fsg_user_release_ref);
+	return 0;
+}
+
+/* The doorbell: whatever is written, completions are looked at again */
+static ssize_t fsg_user_dev_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	wake_up_all(&fsg_user_from_file(file)->done_wait);
+	return count;
+}
+
+static unsigned int fsg_user_dev_poll(struct file *file, poll_table *wait)
+{
+	struct fsg_user	*u = fsg_user_from_file(file);
+	unsigned int	mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(file, &u->cmd_wait, wait);
+	if (READ_ONCE(u->mb->cmd_head) != READ_ONCE(u->mb->cmd_tail))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
+static int fsg_user_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fsg_user	*u = fsg_user_from_file(file);
+
+	return remap_vmalloc_range(vma, u->area, vma->vm_pgoff);
+}
+
+static const struct file_operations fsg_user_fops = {
+	.owner		= THIS_MODULE,
+	.open		= fsg_user_dev_open,
+	.release	= fsg_user_dev_release,
+	.write		= fsg_user_dev_write,
+	.poll		= fsg_user_dev_poll,
+	.mmap		= fsg_user_dev_mmap,
+	.llseek		= noop_llseek,
+};
+
+static void *fsg_user_create(struct fsg_lun *curlun, const char *args,
+			     loff_t *size)
+{
+	struct fsg_user		*u;
+	unsigned long long	len;
+	char			*end;
+	int			rc;
+
+	len = memparse(args, &end);
+	if (end == args || *end || !len || len > LLONG_MAX) {
+		LINFO(curlun, "invalid LUN size: %s\n", args);
+		return ERR_PTR(-EINVAL);
+	}
+
+	u = kzalloc(sizeof(*u), GFP_KERNEL);
+	if (!u)
+		return ERR_PTR(-ENOMEM);
+	kref_init(&u->ref);
+	mutex_init(&u->lock);
+	init_waitqueue_head(&u->cmd_wait);
+	init_waitqueue_head(&u->done_wait);
+	u->size = len;
+
+	u->id = ida_simple_get(&fsg_user_ida, 0, 0, GFP_KERNEL);
+	if (u->id < 0) {
+		rc = u->id;
+		kfree(u);
+		return ERR_PTR(rc);
+	}
+
+	rc = -ENOMEM;
+	u->area = vmalloc_user(PAGE_ALIGN(FSG_USER_AREA_SIZE));
+	if (!u->area)
+		goto fail;
+	u->mb = u->area;
+	u->cmds = u->area + ALIGN(sizeof(*u->mb), 64);
+	u->mb->version = FSG_USER_VERSION;
+	u->mb->ring_size = FSG_USER_RING_SIZE;
+	u->mb->slot_size = FSG_USER_SLOT_SIZE;
+	u->mb->cmd_offset = (void *)u->cmds - u->area;
+	u->mb->data_offset = FSG_USER_DATA_OFFSET;
+	u->mb->size = len;
+
+	snprintf(u->name, sizeof(u->name), "fsg-user%d", u->id);
+	u->misc.minor = MISC_DYNAMIC_MINOR;
+	u->misc.name = u->name;
+	u->misc.fops = &fsg_user_fops;
+	rc = misc_register(&u->misc);
+	if (rc)
+		goto fail;
+	LINFO(curlun, "served by /dev/%s\n", u->name);
+
+	*size = len;
+	return u;
+
+fail:
+	kref_put(&u->ref, fsg_user_release_ref);
+	return ERR_PTR(rc);
+}
+
+static void fsg_user_close(void *data)
+{
+	struct fsg_user	*u = data;
+
+	/* No new daemons; one still attached keeps u until it leaves */
+	misc_deregister(&u->misc);
+	kref_put(&u->ref, fsg_user_release_ref);
+}
+
+const struct fsg_backend fsg_user_backend = {
+	.name		= "user",
+	.create		= fsg_user_create,
+	.close		= fsg_user_close,
+	.read		= fsg_user_read,
+	.write		= fsg_user_write,
+	.fsync		= fsg_user_fsync,
+	.discard	= fsg_user_discard,
+	.stats		= fsg_user_stats,
+};